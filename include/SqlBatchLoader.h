@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2012-2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef TDS_SQLBATCHLOADER_H
+#define TDS_SQLBATCHLOADER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+
+#include "SqlConnectionOptions.h"
+#include "SqlError.h"
+#include "SqlRowBatch.h"
+
+namespace tds {
+
+enum class SqlBatchMode {
+  // query is a statement containing $KEYS, which is replaced by the
+  // comma separated key literals, e.g.
+  // "SELECT id, name FROM dbo.Users WHERE id IN ($KEYS)".
+  InList,
+
+  // query is a procedure taking the keys as a JSON array of strings in
+  // json_param, for use with OPENJSON. Keeps the statement text, and so
+  // the plan, the same for every batch.
+  Json
+};
+
+struct SqlBatchLoaderOptions {
+  SqlBatchMode mode = SqlBatchMode::InList;
+  std::string query;
+  std::string json_param = "@keys";
+
+  // Result column holding each row's key. Keys are matched as the strings
+  // GetStringCol returns, so they should be passed in the same form.
+  std::string key_column;
+
+  // InList only, keys that are plain integers go in unquoted.
+  bool numeric_keys = false;
+
+  // A batch runs when it has max_keys keys or window after its first key
+  // arrived, whichever is sooner.
+  std::chrono::microseconds window{500};
+  size_t max_keys = 256;
+};
+
+// Coalesces single key lookups made around the same time, from any number
+// of threads, into one set based query. Each caller gets back only the rows
+// for its key.
+class SqlBatchLoader {
+public:
+  SqlBatchLoader(const std::string& user, const std::string& pass,
+      const std::string& server, const std::string& database,
+      const SqlBatchLoaderOptions& options);
+
+  // Uses connections opened with the given options.
+  SqlBatchLoader(const std::string& user, const std::string& pass,
+      const std::string& server, const std::string& database,
+      const SqlBatchLoaderOptions& options,
+      const SqlConnectionOptions& conn_options);
+
+  SqlBatchLoader(const SqlBatchLoader&) = delete;
+  SqlBatchLoader& operator=(const SqlBatchLoader&) = delete;
+
+  // Blocks until the batch holding key has run, then fills out with the
+  // rows for key (none if it wasn't found). The status is that of the
+  // whole batch.
+  SqlStatus Load(const std::string& key, SqlRowBatch *out);
+
+private:
+  struct Batch;
+
+  void execute(Batch& batch);
+
+  std::string _user;
+  std::string _pass;
+  std::string _server;
+  std::string _database;
+  SqlBatchLoaderOptions _options;
+  std::optional<SqlConnectionOptions> _conn_options;
+
+  std::mutex _mutex;
+  std::condition_variable _cond;
+  std::shared_ptr<Batch> _open;  // Batch still taking keys
+};
+
+} // namespace tds
+
+#endif // TDS_SQLBATCHLOADER_H
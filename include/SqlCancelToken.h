@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2012-2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef TDS_SQLCANCELTOKEN_H
+#define TDS_SQLCANCELTOKEN_H
+
+#include <atomic>
+
+namespace tds {
+
+// A flag that can be tripped from any thread to interrupt whatever query is
+// running on the connections it has been handed to. FreeTDS polls for
+// interrupts about once a second while waiting on the server.
+class SqlCancelToken {
+public:
+  void Cancel() { _cancelled.store(true, std::memory_order_release); }
+  void Reset() { _cancelled.store(false, std::memory_order_release); }
+
+  bool IsCancelled() const
+  {
+    return _cancelled.load(std::memory_order_acquire);
+  }
+
+private:
+  std::atomic<bool> _cancelled{false};
+};
+
+} // namespace tds
+
+#endif // TDS_SQLCANCELTOKEN_H
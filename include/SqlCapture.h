@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2012-2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef TDS_SQLCAPTURE_H
+#define TDS_SQLCAPTURE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "SqlParams.h"
+
+namespace tds {
+
+enum class SqlCaptureOp : uint8_t {
+  ExecSql = 1,
+  ExecDML,
+  ExecStoredProc,
+  ExecNonQuery
+};
+
+struct SqlCaptureParam {
+  std::string name;
+  ParamType type;
+  bool is_null;
+  int32_t ivalue;
+  std::string svalue;
+};
+
+// One result set as the caller consumed it. Unless exact, the caller moved
+// on before the last row and rows only counts the ones it read.
+struct SqlCaptureShape {
+  uint32_t columns;
+  uint64_t rows;
+  bool exact;
+};
+
+// A captured SqlClient call. Times are in microseconds.
+struct SqlCaptureRecord {
+  uint64_t start_us;  // Since sql_capture_start
+  uint32_t thread;    // Calling thread, numbered in order of first call
+  SqlCaptureOp op;
+  bool ok;
+  bool complete;      // Caller got through to the last result set
+  int64_t exec_us;    // Until the call returned, retries included
+  int64_t total_us;   // Until its results were disposed
+  std::string server;
+  std::string database;
+  std::string text;   // SQL or procedure name
+  std::vector<SqlCaptureParam> params;
+  std::vector<SqlCaptureShape> shapes;
+};
+
+extern std::atomic<bool> g_sql_capture_enabled;
+
+inline bool sql_capture_enabled()
+{
+  return g_sql_capture_enabled.load(std::memory_order_relaxed);
+}
+
+// Starts appending every SqlClient call to a binary log at path, for
+// replaying with sql_replay. Statements and parameter values are written
+// as is, so the log holds whatever data they carry. Returns false if the
+// file can't be created (errno is set).
+bool sql_capture_start(const char *path);
+void sql_capture_stop();
+
+// Reads back a log written by sql_capture_start.
+class SqlCaptureReader {
+public:
+  explicit SqlCaptureReader(const char *path);
+  ~SqlCaptureReader();
+
+  SqlCaptureReader(const SqlCaptureReader&) = delete;
+  SqlCaptureReader& operator=(const SqlCaptureReader&) = delete;
+
+  // False if the file couldn't be opened or isn't a capture log.
+  bool Ok() const { return _fp != nullptr; }
+
+  // False at the end of the log (or a truncated last record).
+  bool Next(SqlCaptureRecord *rec);
+
+private:
+  FILE *_fp{nullptr};
+  int _version{0};
+  std::string _buf;
+};
+
+// Parameters of a call, in either form SqlClient takes them.
+struct SqlCaptureArgs {
+  SqlParamSpan params;
+  const db_params *legacy{nullptr};
+  size_t legacy_count{0};
+};
+
+// Capture state for a single call, owned by SqlClient. Does nothing unless
+// capturing was enabled when Begin was called.
+class SqlCaptureCall {
+public:
+  bool Active() const { return _active; }
+
+  void Begin(const char *text, bool is_proc, bool returns_rows,
+      const SqlCaptureArgs& args);
+  void Returned(bool ok);
+  void Result(int columns)
+  {
+    if (_active)
+      _rec.shapes.push_back({static_cast<uint32_t>(columns), 0, false});
+  }
+  void Row()
+  {
+    if (_active && !_rec.shapes.empty())
+      _rec.shapes.back().rows++;
+  }
+  // The current result set has no more rows.
+  void RowsDone()
+  {
+    if (_active && !_rec.shapes.empty())
+      _rec.shapes.back().exact = true;
+  }
+  // Nor are there more result sets.
+  void Complete()
+  {
+    if (_active)
+      _rec.complete = true;
+  }
+
+  // Writes the record. Calls that are not active are ignored.
+  void End(const std::string& server, const std::string& database);
+
+private:
+  bool _active{false};
+  std::chrono::steady_clock::time_point _start;
+  SqlCaptureRecord _rec;
+};
+
+} // namespace tds
+
+#endif // TDS_SQLCAPTURE_H
@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2012-2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef TDS_SQLCHANGEPOLLER_H
+#define TDS_SQLCHANGEPOLLER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "SqlClient.h"
+#include "SqlDataSource.h"
+#include "SqlError.h"
+
+namespace tds {
+
+enum class SqlChangeMode {
+  // Rows whose rowversion column went up since the last poll. Deletes
+  // aren't seen in this mode.
+  RowVersion,
+
+  // SQL Server Change Tracking (CHANGETABLE), which includes deletes. The
+  // table needs change tracking enabled.
+  ChangeTracking
+};
+
+enum class SqlChangeOp {
+  Reload, // Everything is about to be sent again, drop the local copy
+  Upsert,
+  Delete  // Only the key columns are set
+};
+
+// A table kept in sync by SqlChangePoller. Names go into the SQL as is.
+struct SqlChangeQuery {
+  std::string table;
+  std::vector<std::string> columns;
+
+  SqlChangeMode mode = SqlChangeMode::RowVersion;
+  std::string version_column;           // RowVersion mode
+  std::vector<std::string> key_columns; // ChangeTracking mode, in columns too
+
+  // Called for each changed row, with client on the row and the query's
+  // columns first, in order. Reload is called without a row before a full
+  // load: on the first poll and, with change tracking, when changes were
+  // cleaned up before they were read. Rows can arrive again after a
+  // failed poll, so applying one must be idempotent.
+  std::function<void(SqlChangeOp op, SqlClient& client)> handler;
+
+  // Last version seen, 0 starts with a full load.
+  uint64_t watermark = 0;
+};
+
+// Keeps in-memory copies of tables fresh by fetching only what changed
+// since the previous poll. Every registered query goes out in one batch
+// per poll on one pooled connection, and each query's watermark moves on
+// once its rows have been handled.
+class SqlChangePoller {
+public:
+  explicit SqlChangePoller(std::shared_ptr<const SqlDataSource> source);
+
+  // Stops polling.
+  ~SqlChangePoller();
+
+  SqlChangePoller(const SqlChangePoller&) = delete;
+  SqlChangePoller& operator=(const SqlChangePoller&) = delete;
+
+  // Registers a query, returning its index. Call before polling starts.
+  size_t Add(SqlChangeQuery query);
+
+  // Polls once on the calling thread. Exceptions from handlers propagate.
+  SqlStatus Poll();
+
+  // Polls every interval on a background thread, logging failures and
+  // trying again at the next interval.
+  void Start(std::chrono::milliseconds interval);
+  void Stop();
+
+  uint64_t Watermark(size_t query);
+
+private:
+  std::string build_batch(bool *tracked) const;
+  void poller(std::chrono::milliseconds interval);
+
+  std::shared_ptr<const SqlDataSource> _source;
+  std::vector<SqlChangeQuery> _queries; // Guarded by _poll_mutex
+
+  std::mutex _poll_mutex;
+
+  std::mutex _mutex;
+  std::condition_variable _wake;
+  bool _stop{false};
+  std::thread _thread;
+};
+
+} // namespace tds
+
+#endif // TDS_SQLCHANGEPOLLER_H
@@ -17,42 +17,133 @@
 #ifndef TDS_SQLCLIENT_H
 #define TDS_SQLCLIENT_H
 
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <memory_resource>
 #include <string>
 #include <vector>
 
+#include "SqlCancelToken.h"
+#include "SqlCapture.h"
+#include "SqlConnectionOptions.h"
+#include "SqlDataSource.h"
+#include "SqlError.h"
 #include "SqlParams.h"
+#include "SqlTrace.h"
+#include "SqlWorkload.h"
 
 namespace tds {
 
 class SqlConnection;
+class SqlLimiter;
+class SqlProxyClient;
+enum class SqlProxyOp : uint8_t;
+
+// Opt-in retrying of calls that fail with a transient error (deadlocks,
+// lock timeouts, dropped connections, failovers).
+struct SqlRetryPolicy {
+  // Total tries per call, 1 disables retrying.
+  int max_attempts = 1;
+
+  // Retry n waits a random time of up to
+  // min(max_delay, base_delay * 2^(n - 1)).
+  std::chrono::milliseconds base_delay{25};
+  std::chrono::milliseconds max_delay{2000};
+};
 
 // A wrapper around SqlConnections that uses pooling.
+//
+// With a proxy set on SqlConnectionFactory, calls go through sql_poold
+// instead and results come back as text. Legacy db_params calls, ReadText,
+// SetTextSize and cancel tokens aren't available in that mode, nor are
+// retries, which are up to the daemon's pool.
 class SqlClient {
 public:
+  // Connects through a private data source. Cheap when a thread keeps
+  // creating clients for the same settings, otherwise each client copies
+  // them into a new source. Prefer SqlDataSource::Get on hot paths.
   SqlClient(const std::string& user, const std::string& pass,
       const std::string& server, const std::string& database);
 
+  // Uses connections opened with the given options instead of the server
+  // defaults configured on SqlConnectionFactory.
+  SqlClient(const std::string& user, const std::string& pass,
+      const std::string& server, const std::string& database,
+      const SqlConnectionOptions& options);
+
+  // Connects through a shared data source, see SqlDataSource. Creating a
+  // client this way doesn't allocate.
+  explicit SqlClient(std::shared_ptr<const SqlDataSource> source);
+
   ~SqlClient();
 
+  // Moving hands over the held connection, if any. The moved from client
+  // can only be destroyed or assigned to.
   SqlClient(const SqlClient&) = delete;
   SqlClient& operator=(const SqlClient&) = delete;
-  SqlClient(SqlClient&&) = delete;
-  SqlClient& operator=(SqlClient&&) = delete;
+  SqlClient(SqlClient&& other) noexcept;
+  SqlClient& operator=(SqlClient&& other);
+
+  const std::shared_ptr<const SqlDataSource>& DataSource() const
+  {
+    return m_source;
+  }
 
   // You should not need to call this method directly, but you can.
   void Connect();
-
-  void ExecStoredProc(const char *proc, struct db_params *params, size_t parm_count);
-  void ExecStoredProc(const char *proc, const std::vector<db_param>& params);
-  void ExecNonQuery(const char *proc, struct db_params *params, size_t parm_count);
-  void ExecNonQuery(const char *proc, const std::vector<db_param>& params);
-  void ExecSql(const char *sql);
-  void ExecDML(const char *dml);
+  SqlStatus TryConnect();
+
+  // Per-call deadline and cancellation, see SqlConnection. Both only apply
+  // while this client holds the connection.
+  void SetTimeout(std::chrono::milliseconds timeout);
+  void SetCancelToken(const SqlCancelToken *token);
+
+  void SetRetryPolicy(const SqlRetryPolicy& policy) { m_retry = policy; }
+
+  // Workload class used when checking out connections from servers with
+  // workload limits (see SqlConnectionFactory::set_workload_limits). Takes
+  // effect on the next checkout.
+  void SetPriority(SqlPriority priority) { m_priority = priority; }
+
+  // With a retry policy set, idempotent calls are retried on any transient
+  // error. Other calls are only retried if they failed before reaching the
+  // server.
+  void ExecStoredProc(const char *proc, struct db_params *params,
+      size_t parm_count, bool idempotent = false);
+  void ExecStoredProc(const char *proc, SqlParamSpan params,
+      bool idempotent = false);
+  void ExecNonQuery(const char *proc, struct db_params *params,
+      size_t parm_count, bool idempotent = false);
+  void ExecNonQuery(const char *proc, SqlParamSpan params,
+      bool idempotent = false);
+  void ExecSql(const char *sql, bool idempotent = false);
+  void ExecDML(const char *dml, bool idempotent = false);
+
+  // Non-throwing variants of the above, for hot paths where failures are
+  // expected. Errors are returned inline without allocating.
+  SqlStatus TryExecStoredProc(const char *proc, struct db_params *params,
+      size_t parm_count, bool idempotent = false);
+  SqlStatus TryExecStoredProc(const char *proc, SqlParamSpan params,
+      bool idempotent = false);
+  SqlStatus TryExecNonQuery(const char *proc, struct db_params *params,
+      size_t parm_count, bool idempotent = false);
+  SqlStatus TryExecNonQuery(const char *proc, SqlParamSpan params,
+      bool idempotent = false);
+  SqlStatus TryExecSql(const char *sql, bool idempotent = false);
+  SqlStatus TryExecDML(const char *dml, bool idempotent = false);
 
   void Dispose();
 
+  // Discards pending results and hands the connection back to the pool
+  // now rather than at destruction. The next call checks one out again.
+  void Release();
+
   bool NextRow();
   bool NextResult();
+  SqlStatus TryNextRow(bool *has_row);
+  SqlStatus TryNextResult(bool *more);
 
   // Data extraction
   int GetOrdinal(const char *colName);
@@ -60,18 +151,63 @@ public:
 
   std::string GetStringCol(int col);
   std::string GetStringColByName(const char *colName);
+
+  // Results allocated from mr, see SqlConnection.
+  std::pmr::vector<std::pmr::string> GetAllColumnNames(
+      std::pmr::memory_resource *mr);
+  std::pmr::string GetStringCol(int col, std::pmr::memory_resource *mr);
   int GetInt32Col(int col);
   int GetInt32ColByName(const char *colName);
   int GetMoneyCol(int col, int *dol_out, int *cen_out);
   bool IsNullCol(int col);
 
+  // Raw row access, see SqlConnection.
+  int GetColumnCount();
+  int GetColumnType(int col);
+  const unsigned char *GetColumnData(int col, int *len);
+  int ConvertColToText(int col, char *buf, int size);
+  int GetUtf8Col(int col, char *buf, int size);
+
+  // Large value streaming, see SqlConnection.
+  bool StreamCol(int col, const std::function<bool(const char *, size_t)>& sink,
+      size_t chunk_size = 65536);
+  void WriteColToFd(int col, int fd);
+  int ReadText(void *buf, int size);
+  void SetTextSize(int bytes);
+
 private:
-  std::string m_user;
-  std::string m_pass;
-  std::string m_server;
-  std::string m_database;
+  template <typename Call>
+  SqlStatus with_retry(const char *text, bool is_proc, bool returns_rows,
+      bool idempotent, const SqlCaptureArgs& args, const Call& call);
+  void end_trace();
+  bool drop_inherited();
+  void release_slots();
+  SqlConnection& results();
+  void take(SqlClient& other) noexcept;
+  SqlStatus proxy_exec(SqlProxyOp op, const char *text,
+      SqlParamSpan params);
+
+  std::shared_ptr<const SqlDataSource> m_source;
 
   SqlConnection *m_conn;
+  std::unique_ptr<SqlProxyClient> m_proxy;
+
+  std::chrono::milliseconds m_timeout{0};
+  const SqlCancelToken *m_cancel{nullptr};
+  SqlRetryPolicy m_retry;
+
+  // The server's adaptive limit and workload gate, from the data source.
+  // m_slot_priority is the class the held connection counts against.
+  SqlLimiter *m_limiter{nullptr};
+  SqlWorkloadGate *m_gate{nullptr};
+  SqlPriority m_priority{SqlPriority::Normal};
+  SqlPriority m_slot_priority{SqlPriority::Normal};
+
+  // Timing of the current call when tracing is on, see sql_trace_start.
+  SqlTraceSpan m_trace;
+
+  // The current call's record when capturing, see sql_capture_start.
+  SqlCaptureCall m_capture;
 };
 
 } // namespace tds
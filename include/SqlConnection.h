@@ -17,22 +17,34 @@
 #ifndef TDS_SQLCONNECTION_H
 #define TDS_SQLCONNECTION_H
 
+#include <chrono>
+#include <functional>
+#include <memory_resource>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #define MSDBLIB 1
 #include <sqlfront.h>
 #include <sybdb.h>
 
+#include "SqlCancelToken.h"
+#include "SqlConnectionOptions.h"
+#include "SqlError.h"
+#include "SqlLog.h"
 #include "SqlParams.h"
 
 namespace tds {
 
+struct SqlPoolBucket;
+
 class SqlConnection {
 public:
   SqlConnection(const std::string& user, const std::string& pass,
-      const std::string& server, const std::string& database) :
-    _user{user}, _pass{pass}, _server{server}, _database{database}, _dbHandle{nullptr},
+      const std::string& server, const std::string& database,
+      const SqlConnectionOptions& options = SqlConnectionOptions()) :
+    _user{user}, _pass{pass}, _server{server}, _database{database},
+    _options{options}, _dbHandle{nullptr},
     _fetched_rows{true}, _fetched_results{true} {}
 
   ~SqlConnection();
@@ -45,6 +57,24 @@ public:
 
   const std::string& Server() const { return _server; }
   const std::string& Database() const { return _database; }
+  const SqlConnectionOptions& Options() const { return _options; }
+
+  // Set by the pool on connections opened with the server's default
+  // options rather than ones a client asked for.
+  bool DefaultOptions() const { return _default_options; }
+  void SetDefaultOptions(bool value) { _default_options = value; }
+
+  // The data source bucket the pool keeps this connection in, if any.
+  SqlPoolBucket *Bucket() const { return _bucket; }
+  void SetBucket(SqlPoolBucket *bucket) { _bucket = bucket; }
+
+  // Fork generation of the pool that opened this connection.
+  unsigned Generation() const { return _generation; }
+  void SetGeneration(unsigned generation) { _generation = generation; }
+
+  // Server name as FreeTDS takes it, without a "tcp:" prefix and with a
+  // colon before the port.
+  static std::string fix_server(const std::string& str);
 
   // Executing a stored procedure or query will automatically connect
   // It should not be necessary to call this method directly.
@@ -56,6 +86,39 @@ public:
 
   void Disconnect();
 
+  // Drops the session without logging out, for a forked child whose
+  // parent still owns it. The socket is pointed at /dev/null so nothing
+  // the child does can reach the server, the DBPROCESS is left to dbexit.
+  void Abandon();
+
+  // Details of the last error raised by the server, cleared by Dispose.
+  // Failed calls throw SqlException carrying a copy of this.
+  const SqlError& LastError() const { return _last_error; }
+
+  // Non-throwing variants of the calls below, for paths where failures are
+  // common enough that exceptions get expensive.
+  SqlStatus TryConnect();
+  SqlStatus TryDispose();
+  SqlStatus TryExecDML(const char *sql);
+  SqlStatus TryExecSql(const char *sql);
+  SqlStatus TryExecStoredProc(const char *proc, struct db_params *params,
+    size_t parm_count);
+  SqlStatus TryExecStoredProc(const char *proc, SqlParamSpan params);
+  SqlStatus TryExecNonQuery(const char *proc, struct db_params *params,
+    size_t parm_count);
+  SqlStatus TryExecNonQuery(const char *proc, SqlParamSpan params);
+  SqlStatus TryNextResult(bool *more);
+  SqlStatus TryNextRow(bool *has_row);
+
+  // Bounds how long each subsequent call, including fetching its rows, may
+  // block. A timed out call throws and the connection is either reset or
+  // dropped (to be reopened on next use). Zero, the default, waits forever.
+  void SetTimeout(std::chrono::milliseconds timeout) { _timeout = timeout; }
+
+  // Calls made while a token is set are interrupted once it is cancelled.
+  // The token must outlive its use by this connection.
+  void SetCancelToken(const SqlCancelToken *token) { _cancel = token; }
+
   // When a query is executed freetds buffers the results into a
   // local buffer. Dispose must be called to clear out the results before
   // another query is run.
@@ -72,7 +135,7 @@ public:
     size_t parm_count);
 
   // Execute a stored procedure where results/resultsets are expected.
-  void ExecStoredProc(const char *proc, const std::vector<db_param>& params);
+  void ExecStoredProc(const char *proc, SqlParamSpan params);
 
   // Execute a stored procedure where results/resultsets are NOT expected
   // or where results/resultsets can be ignored.
@@ -81,7 +144,7 @@ public:
 
   // Execute a stored procedure where results/resultsets are NOT expected
   // or where results/resultsets can be ignored.
-  void ExecNonQuery(const char *proc, const std::vector<db_param>& params);
+  void ExecNonQuery(const char *proc, SqlParamSpan params);
 
   // Move to next result set.
   bool NextResult();
@@ -95,35 +158,110 @@ public:
   std::vector<std::string> GetAllColumnNames();
 
   std::string GetStringCol(int col);
+
+  // Same as above with the result allocated from mr, so callers can put
+  // a query's strings in one arena and free them together.
+  std::pmr::vector<std::pmr::string> GetAllColumnNames(
+      std::pmr::memory_resource *mr);
+  std::pmr::string GetStringCol(int col, std::pmr::memory_resource *mr);
   std::string GetStringColByName(const char *colName);
   int GetInt32Col(int col);
   int GetInt32ColByName(const char *colName);
   int GetMoneyCol(int col, int *dol_out, int *cen_out);
   bool IsNullCol(int col);
 
+  // Raw access to the current row, for formatting values without going
+  // through std::string. Types are DB-Library's (SYBINT4, ...), data points
+  // into the row buffer and stays valid until the next fetch. A NULL has
+  // no data and a length of 0, an empty value has data and a length of 0.
+  int GetColumnCount();
+  int GetColumnType(int col);
+  const unsigned char *GetColumnData(int col, int *len);
+
+  // Converts a column to text in buf, as GetStringCol would. Returns the
+  // length, or -1 if it doesn't fit or can't be converted.
+  int ConvertColToText(int col, char *buf, int size);
+
+  // Copies a column into buf as UTF-8 without going through std::string.
+  // Binary columns are taken to be raw UTF-16 (NVARCHAR selected as
+  // VARBINARY, skipping FreeTDS's iconv) and transcoded, character columns
+  // are already in the connection's charset. Returns the length, 0 for
+  // NULL, or -1 if it doesn't fit.
+  int GetUtf8Col(int col, char *buf, int size);
+
+  // Receives successive chunks of a column value, returns false to stop.
+  using ChunkSink = std::function<bool(const char *data, size_t len)>;
+
+  // Hands a large column value to sink in pieces of at most chunk_size
+  // bytes, straight out of DB-Library's row buffer. Character and binary
+  // columns are passed through as is, other types as their string form.
+  // A chunk_size of 0 passes the whole value at once. Returns false if the
+  // sink stopped early.
+  bool StreamCol(int col, const ChunkSink& sink, size_t chunk_size = 65536);
+
+  // Writes a column value to a file descriptor, see StreamCol.
+  void WriteColToFd(int col, int fd);
+
+  // Row-less streaming for queries selecting a single text or image column.
+  // Call after ExecSql instead of NextRow. Returns the number of bytes read
+  // into buf, 0 at the end of each value and -1 once there are no more
+  // rows. Only size bytes are ever buffered here.
+  int ReadText(void *buf, int size);
+
+  // Largest text/image value the server will send (SET TEXTSIZE).
+  void SetTextSize(int bytes);
+
   // FreeTDS callback helper
   int MsgHandler(DBPROCESS * dbproc, DBINT msgno, int msgstate,
     int severity, char *msgtext, char *srvname, char *procname, int line);
 
+  // Checks whether the running call has been cancelled or run past its
+  // deadline.
+  bool Interrupted();
+
 private:
-  void run_initial_query();
-  void execute_proc_common(const char *proc, struct db_params *params, size_t parm_count);
-  void execute_proc_common2(const char *proc, const std::vector<db_param>& params);
-  static std::string fix_server(const std::string& str);
+  bool try_connect();
+  bool prepare_call();
+  bool run_initial_query();
+  bool in_database(const std::string& db);
+  void begin_call();
+  bool interrupted();
+  bool fail(const char *fmt, ...);
+  [[noreturn]] void throw_last();
+  bool dispose();
+  bool exec_dml(const char *sql);
+  bool exec_sql(const char *sql);
+  int next_result();
+  int fetch_row();
+  bool proc_results();
+  bool send_rpc();
+  bool execute_proc_common(const char *proc, struct db_params *params, size_t parm_count);
+  bool execute_proc_common2(const char *proc, SqlParamSpan params);
+  std::string_view string_col(int col, char *buf, int size);
 
   std::string _user;
   std::string _pass;
   std::string _server;
   std::string _database;
+  SqlConnectionOptions _options;
+  bool _default_options{false};
+  SqlPoolBucket *_bucket{nullptr};
+  unsigned _generation{0};
   DBPROCESS *_dbHandle;
   bool _fetched_rows;
   bool _fetched_results;
-  std::string _error;
+  bool _session_pending{false};
+  SqlError _last_error;
+
+  std::chrono::milliseconds _timeout{0};
+  std::chrono::steady_clock::time_point _deadline;
+  const SqlCancelToken *_cancel{nullptr};
+  bool _armed{false};
+  bool _interrupted{false};
 };
 
 void sql_startup(void (*log_func)(int, const char *));
 void sql_shutdown();
-void sql_log(int level, const char *msg);
 
 } // namespace tds
 
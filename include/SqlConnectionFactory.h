@@ -17,13 +17,38 @@
 #ifndef TDS_SQLCONNECTIONFACTORY_H
 #define TDS_SQLCONNECTIONFACTORY_H
 
+#include <atomic>
+#include <map>
+#include <memory>
 #include <string>
+#include <utility>
 #include <list>
 #include <mutex>
+#include <vector>
+
+#include "SqlConnectionOptions.h"
+#include "SqlError.h"
+#include "SqlLimiter.h"
+#include "SqlWorkload.h"
 
 namespace tds {
 
 class SqlConnection;
+class SqlDataSource;
+
+// Idle connections of one interned SqlDataSource.
+struct SqlPoolBucket {
+  std::string server;
+  std::string database;
+  std::vector<SqlConnection*> idle; // Guarded by the factory mutex
+};
+
+// What a child process does with the pool right after fork().
+struct SqlForkOptions {
+  // Data sources to open connections to in the background, and how many
+  // of each, so the child's first requests don't pay for the login.
+  std::vector<std::pair<std::shared_ptr<const SqlDataSource>, int>> warm_up;
+};
 
 // Singleton
 class SqlConnectionFactory {
@@ -39,16 +64,131 @@ public:
     return cf;
   }
 
+  // Options may be null to use the ones configured for server.
   SqlConnection* acquire(const std::string& user, const std::string& pass,
-      const std::string &server, const std::string &database);
+      const std::string &server, const std::string &database,
+      const SqlConnectionOptions *options = nullptr);
+
+  // Like acquire, but reports failure to connect through the status
+  // instead of throwing.
+  SqlStatus try_acquire(const std::string& user, const std::string& pass,
+      const std::string &server, const std::string &database,
+      const SqlConnectionOptions *options, SqlConnection **out);
+
+  // Checks out a connection for source, from its bucket if it has one.
+  SqlStatus try_acquire(const SqlDataSource& source, SqlConnection **out);
 
   void release(SqlConnection*);
 
+  // Closes a broken connection instead of returning it to the pool.
+  void discard(SqlConnection*);
+
+  // Default options for new connections to server. Should be set up
+  // before the first connection is made, open connections keep the
+  // options they were created with.
+  void set_target_options(const std::string& server,
+      const SqlConnectionOptions& options);
+
+  // Number of connections (0 to 2) each thread may keep in a private cache
+  // in front of the shared pool. Checkouts that hit the cache don't take
+  // the pool mutex. Disabled (0) by default.
+  void set_thread_cache_size(int slots);
+
+  // Hands the connections cached by the calling thread back to the shared
+  // pool. Worker threads should call this before going idle.
+  void flush_thread_cache();
+
+  // Turns on an adaptive concurrency limit for SqlClients of server, see
+  // SqlLimiter. Set up before clients for the server are created, only
+  // the first call for a server has any effect.
+  void set_adaptive_limit(const std::string& server,
+      const SqlLimitOptions& options);
+
+  // The server's limiter, null if it has none.
+  SqlLimiter* limiter(const std::string& server);
+
+  // Shares connections to server between workload classes, see
+  // SqlWorkloadGate. Like set_adaptive_limit, only the first call for a
+  // server has any effect.
+  void set_workload_limits(const std::string& server,
+      const SqlWorkloadOptions& options);
+
+  // The server's workload gate, null if it has none.
+  SqlWorkloadGate* workload_gate(const std::string& server);
+
+  // Makes SqlClients created from now on send their calls to the
+  // sql_poold listening on socket_path rather than opening connections of
+  // their own. An empty path goes back to direct connections. The daemon
+  // checks out a connection per call, so session state (open transactions,
+  // #temp tables, SET options) doesn't carry over between calls.
+  void set_proxy(const std::string& socket_path);
+  std::string proxy_path();
+
+  // A new, empty bucket, see SqlDataSource. Buckets live as long as the
+  // factory.
+  SqlPoolBucket* add_bucket(const std::string& server,
+      const std::string& database);
+
+  // Makes the pool safe to use across fork(). On its first checkout a
+  // child drops every connection inherited from the parent without logging
+  // it out, then opens fresh ones in the background as set out in options.
+  // Connections checked out at the time of the fork are dropped when they
+  // come back. Call from the parent before forking; later calls only
+  // replace the options.
+  void set_fork_options(const SqlForkOptions& options);
+
+  // Makes sure at least count connections to source sit idle in the pool,
+  // opening them as needed. Pre-fork servers call this in the parent to
+  // check credentials early, children get it from set_fork_options.
+  SqlStatus warm_up(const SqlDataSource& source, int count);
+
+  // True for a connection the process got from its parent through fork().
+  bool inherited(const SqlConnection *c) const;
+
+  // Server and database of each idle connection in the shared pool, for
+  // scheduling work where a connection is already waiting.
+  std::vector<std::pair<std::string, std::string>> idle_targets();
+
 private:
   SqlConnectionFactory() = default;
 
+  struct ThreadCache;
+  ThreadCache& thread_cache();
+  SqlConnection* find_idle(const std::string& server,
+      const std::string& database, const SqlConnectionOptions *options);
+  SqlConnection* find_idle(SqlPoolBucket *bucket);
+  template <typename Match>
+  SqlConnection* steal(const Match& match);
+  void park(SqlConnection *c);
+  void settle_fork();
+  static void before_fork();
+  static void after_fork_parent();
+  static void after_fork_child();
+  SqlStatus open(const std::string& user, const std::string& pass,
+      const std::string& server, const std::string& database,
+      const SqlConnectionOptions *options, SqlPoolBucket *bucket,
+      SqlConnection **out);
+
   std::mutex _mutex;
   std::list<SqlConnection*> sql_connections;
+  std::list<SqlPoolBucket> _buckets;
+  std::map<std::string, SqlConnectionOptions> _target_options;
+  std::map<std::string, std::unique_ptr<SqlLimiter>> _limiters;
+  std::map<std::string, std::unique_ptr<SqlWorkloadGate>> _workload_gates;
+  std::string _proxy_path;
+  std::atomic<bool> _proxy_enabled{false};
+  SqlForkOptions _fork_options; // Guarded by _mutex
+  std::atomic<unsigned> _generation{0};
+  // Set in a child until settle_fork has run, with the forking thread's
+  // cache, the only one still in use.
+  std::atomic<bool> _fork_pending{false};
+  ThreadCache *_fork_cache{nullptr}; // Guarded by _mutex
+
+  std::atomic<int> _thread_cache_size{0};
+  std::vector<ThreadCache*> _thread_caches; // Guarded by _mutex
+  // The calling thread's cache, if it has made one. Looked at after fork()
+  // where making a cache would take the mutex.
+  static thread_local ThreadCache *_current_cache;
 };
 
 } // namespace tds
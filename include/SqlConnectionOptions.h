@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2012-2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef TDS_SQLCONNECTIONOPTIONS_H
+#define TDS_SQLCONNECTIONOPTIONS_H
+
+#include <string>
+
+namespace tds {
+
+enum class TdsVersion {
+  V70, V71, V72, V73, V74
+};
+
+// Settings applied when a connection logs in.
+struct SqlConnectionOptions {
+  // TDS packet size in bytes. 0 keeps the server default (4096), large
+  // scans benefit from bigger packets (up to 32767).
+  int packet_size = 0;
+
+  // Number of rows DB-Library keeps buffered (DBBUFFER). 0 disables row
+  // buffering.
+  int row_buffer = 0;
+
+  TdsVersion tds_version = TdsVersion::V72;
+
+  // Require an encrypted connection.
+  bool encrypt = false;
+
+  // Client character set (DBSETLCHARSET), what FreeTDS converts character
+  // data to. Empty leaves it to freetds.conf.
+  std::string charset = "UTF-8";
+
+  bool operator==(const SqlConnectionOptions& rhs) const
+  {
+    return packet_size == rhs.packet_size && row_buffer == rhs.row_buffer &&
+      tds_version == rhs.tds_version && encrypt == rhs.encrypt &&
+      charset == rhs.charset;
+  }
+  bool operator!=(const SqlConnectionOptions& rhs) const
+  {
+    return !(*this == rhs);
+  }
+};
+
+} // namespace tds
+
+#endif // TDS_SQLCONNECTIONOPTIONS_H
@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2012-2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef TDS_SQLDATASOURCE_H
+#define TDS_SQLDATASOURCE_H
+
+#include <atomic>
+#include <memory>
+#include <optional>
+#include <string>
+
+#include "SqlConnectionOptions.h"
+
+namespace tds {
+
+class SqlLimiter;
+class SqlWorkloadGate;
+struct SqlPoolBucket;
+
+// Where and as whom SqlClients connect, set up once and shared by every
+// client for the target. Interned sources also get a pool bucket of their
+// own, so checkouts through them skip the string comparisons of the shared
+// pool (and never get a connection opened with other credentials).
+class SqlDataSource {
+public:
+  // Returns the one source for these settings, creating it on first use.
+  // Servers are compared after normalizing ("tcp:host,1433" and
+  // "host:1433" are the same source).
+  static std::shared_ptr<const SqlDataSource> Get(const std::string& user,
+      const std::string& pass, const std::string& server,
+      const std::string& database);
+  static std::shared_ptr<const SqlDataSource> Get(const std::string& user,
+      const std::string& pass, const std::string& server,
+      const std::string& database, const SqlConnectionOptions& options);
+
+  // A private source without a bucket, for one-off clients. Options may
+  // be null to use the ones configured for server.
+  static std::shared_ptr<const SqlDataSource> Create(const std::string& user,
+      const std::string& pass, const std::string& server,
+      const std::string& database, const SqlConnectionOptions *options);
+
+  SqlDataSource(const SqlDataSource&) = delete;
+  SqlDataSource& operator=(const SqlDataSource&) = delete;
+
+  const std::string& User() const { return _user; }
+  const std::string& Pass() const { return _pass; }
+  const std::string& Server() const { return _server; }
+  const std::string& Database() const { return _database; }
+
+  // Null when the server's default options apply.
+  const SqlConnectionOptions *Options() const
+  {
+    return _options ? &*_options : nullptr;
+  }
+
+  // Idle connections for this source, null for sources from Create.
+  SqlPoolBucket *Bucket() const { return _bucket; }
+
+  // The server's adaptive limit and workload gate (either may be null).
+  // Looked up until found, so one set up after the source's first client
+  // still takes effect.
+  SqlLimiter *Limiter() const;
+  SqlWorkloadGate *Gate() const;
+
+private:
+  friend class SqlConnectionFactory;
+
+  SqlDataSource(const std::string& user, const std::string& pass,
+      const std::string& server, const std::string& database,
+      const SqlConnectionOptions *options);
+
+  static std::shared_ptr<const SqlDataSource> intern(const std::string& user,
+      const std::string& pass, const std::string& server,
+      const std::string& database, const SqlConnectionOptions *options);
+
+  // Held across fork(), see SqlConnectionFactory::set_fork_options.
+  static void lock_sources();
+  static void unlock_sources();
+
+  std::string _user;
+  std::string _pass;
+  std::string _server;
+  std::string _database;
+  std::string _clean_server; // As FreeTDS takes it
+  std::optional<SqlConnectionOptions> _options;
+  SqlPoolBucket *_bucket{nullptr};
+
+  mutable std::atomic<SqlLimiter*> _limiter{nullptr};
+  mutable std::atomic<SqlWorkloadGate*> _gate{nullptr};
+};
+
+} // namespace tds
+
+#endif // TDS_SQLDATASOURCE_H
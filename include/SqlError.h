@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2012-2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef TDS_SQLERROR_H
+#define TDS_SQLERROR_H
+
+#include <stdexcept>
+
+namespace tds {
+
+enum class SqlErrorKind {
+  None,
+  General,        // Anything not listed below (syntax, constraints, etc)
+  Deadlock,       // Chosen as deadlock victim (1205)
+  LockTimeout,    // Lock request time out (1222)
+  ConnectionLost, // Connection dropped or could not be opened
+  Failover,       // Database moving, unavailable or throttled
+  Timeout,        // Call ran past its deadline
+  Cancelled,      // Call cancelled through a SqlCancelToken
+  Overloaded      // Turned away by the client side concurrency limit
+};
+
+// The last error reported by the server (or DB-Library) for a call. Kept
+// in fixed size buffers so that recording an error never allocates; long
+// messages are truncated.
+struct SqlError {
+  SqlError() { Clear(); }
+
+  void Clear()
+  {
+    msgno = severity = state = line = 0;
+    kind = SqlErrorKind::None;
+    server[0] = proc[0] = message[0] = text[0] = '\0';
+  }
+
+  int msgno;
+  int severity;
+  int state;
+  int line;
+  SqlErrorKind kind;
+  char server[64];
+  char proc[128];
+  char message[512];
+
+  // The full report as SQL Server tools would print it, followed by any
+  // informational messages that came after the error.
+  char text[1024];
+};
+
+// Maps a server message number to the kind of error it represents.
+SqlErrorKind sql_classify_error(int msgno);
+
+// Transient errors may succeed if the call is simply tried again.
+bool sql_error_is_transient(SqlErrorKind kind);
+
+class SqlException : public std::runtime_error {
+public:
+  explicit SqlException(const SqlError& error) :
+    std::runtime_error(error.text), _error{error} {}
+
+  const SqlError& Error() const { return _error; }
+  SqlErrorKind Kind() const { return _error.kind; }
+  bool IsTransient() const { return sql_error_is_transient(_error.kind); }
+
+private:
+  SqlError _error;
+};
+
+// Outcome of a call made through the non-throwing Try* API. A failure
+// carries its error inline, so handling one costs no allocations.
+class SqlStatus {
+public:
+  SqlStatus() = default;
+  explicit SqlStatus(const SqlError& error) : _ok{false}, _error{error} {}
+
+  bool Ok() const { return _ok; }
+  explicit operator bool() const { return _ok; }
+
+  // Only meaningful when the call failed.
+  const SqlError& Error() const { return _error; }
+
+private:
+  bool _ok{true};
+  SqlError _error;
+};
+
+} // namespace tds
+
+#endif // TDS_SQLERROR_H
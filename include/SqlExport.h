@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2012-2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef TDS_SQLEXPORT_H
+#define TDS_SQLEXPORT_H
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace tds {
+
+class SqlClient;
+
+enum class SqlExportFormat {
+  Csv,       // RFC 4180, NULL is an empty field
+  JsonLines  // One object per row keyed by column name
+};
+
+struct SqlExportOptions {
+  SqlExportFormat format = SqlExportFormat::Csv;
+  bool header = true;        // Csv: column names first
+  char delimiter = ',';      // Csv
+  size_t buffer_size = 1 << 20;
+};
+
+// Streams result sets straight from DB-Library's row buffer into a file
+// descriptor or string. Values are formatted by type without going through
+// GetStringCol, output is written in buffer_size pieces.
+class SqlExporter {
+public:
+  using Sink = std::function<void(const char *data, size_t len)>;
+
+  SqlExporter(const Sink& sink, const SqlExportOptions& options = SqlExportOptions());
+  SqlExporter(int fd, const SqlExportOptions& options = SqlExportOptions());
+  SqlExporter(std::string *out, const SqlExportOptions& options = SqlExportOptions());
+
+  // Flushes, errors from the sink are lost at this point, call Flush
+  // first to see them.
+  ~SqlExporter();
+
+  SqlExporter(const SqlExporter&) = delete;
+  SqlExporter& operator=(const SqlExporter&) = delete;
+
+  // Writes the remaining rows of client's current result set, returns the
+  // number written.
+  int64_t Write(SqlClient& client);
+
+  void Flush();
+
+private:
+  void put(char c)
+  {
+    if (_len == _size)
+      Flush();
+    _buf[_len++] = c;
+  }
+  void put(const char *data, size_t len);
+  char *reserve(size_t len);
+
+  void write_header(SqlClient& client, int cols);
+  void write_value(SqlClient& client, int col, int type);
+  void write_text(const char *data, size_t len);
+
+  Sink _sink;
+  SqlExportOptions _options;
+  std::unique_ptr<char[]> _buf;
+  size_t _size;
+  size_t _len{0};
+  std::vector<std::string> _json_keys;
+};
+
+} // namespace tds
+
+#endif // TDS_SQLEXPORT_H
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2012-2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef TDS_SQLLIMITER_H
+#define TDS_SQLLIMITER_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+namespace tds {
+
+struct SqlLimitOptions {
+  int initial_limit = 20;
+  int min_limit = 2;
+  int max_limit = 200;
+
+  // Latency growth over the long term baseline that is tolerated before
+  // the limit starts coming down, 1.5 allows 50%.
+  double tolerance = 1.5;
+
+  // Weight of each new limit estimate, lower reacts more slowly.
+  double smoothing = 0.2;
+
+  // Multiplier applied on timeouts and dropped connections.
+  double backoff = 0.9;
+};
+
+// Gradient style concurrency limit for one server. Compares short term
+// call latency against a slowly moving baseline: while they agree the
+// limit grows by about sqrt(limit) per sample, once latency rises (the
+// server is queueing) it shrinks in proportion. Calls over the limit are
+// turned away immediately instead of adding to the queue.
+class SqlLimiter {
+public:
+  explicit SqlLimiter(const SqlLimitOptions& options);
+
+  // Takes a slot, false if the limit has been reached.
+  bool TryAcquire();
+  void Release();
+
+  // Feeds back the latency of a finished call. dropped marks calls that
+  // timed out or lost their connection.
+  void Sample(std::chrono::microseconds latency, bool dropped);
+
+  int Limit() const { return _limit.load(std::memory_order_relaxed); }
+  int InFlight() const { return _in_flight.load(std::memory_order_relaxed); }
+
+private:
+  friend class SqlConnectionFactory; // Locks _mutex across fork()
+
+  SqlLimitOptions _options;
+  std::atomic<int> _limit;
+  std::atomic<int> _in_flight{0};
+
+  std::mutex _mutex;  // Guards the estimator state below
+  double _estimate;
+  double _short_rtt{0.0};
+  double _long_rtt{0.0};
+};
+
+} // namespace tds
+
+#endif // TDS_SQLLIMITER_H
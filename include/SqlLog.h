@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2012-2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef TDS_SQLLOG_H
+#define TDS_SQLLOG_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace tds {
+
+#define SQL_LOG_ERROR 0
+#define SQL_LOG_INFO 1
+#define SQL_LOG_DEBUG 2
+
+// A structured log entry. Fields that don't apply are empty or -1.
+struct SqlLogRecord {
+  int level;
+  const char *event;   // Static string naming what happened
+  int64_t time_us;     // Wall clock, microseconds since the epoch
+  int64_t duration_us;
+  int64_t rows;
+  char target[128];    // "server/database"
+  char message[256];
+};
+
+// Highest level that currently gets logged, -1 when there's nowhere for
+// log records to go. Use sql_log_enabled rather than reading this.
+extern std::atomic<int> g_sql_log_threshold;
+
+// Cheap check to make before building anything to log.
+inline bool sql_log_enabled(int level)
+{
+  return level <= g_sql_log_threshold.load(std::memory_order_relaxed);
+}
+
+// Drops records above level (SQL_LOG_DEBUG by default).
+void sql_log_set_level(int level);
+
+// Text sink, passed the record's message (sql_startup sets this).
+void sql_log_set_func(void (*log_func)(int, const char *));
+
+// Structured sink, passed every record.
+void sql_log_set_record_func(void (*record_func)(const SqlLogRecord&));
+
+// Hands records to a background thread through a lock-free queue of the
+// given capacity, so sinks no longer run on query threads. Records that
+// don't fit are dropped and counted.
+void sql_log_start_async(size_t capacity = 4096);
+
+// Delivers whatever is queued and stops the background thread. Async
+// delivery can be started again afterwards.
+void sql_log_stop_async();
+
+void sql_log(int level, const char *msg);
+
+// Logs an event with structured fields, the message is printf style.
+void sql_log_event(int level, const char *event, const char *server,
+    const char *database, int64_t duration_us, int64_t rows,
+    const char *fmt, ...);
+
+} // namespace tds
+
+#endif // TDS_SQLLOG_H
@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2012-2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef TDS_SQLPARALLELSCAN_H
+#define TDS_SQLPARALLELSCAN_H
+
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "SqlConnectionOptions.h"
+#include "SqlRowBatch.h"
+
+namespace tds {
+
+struct SqlScanOptions {
+  std::string table;          // FROM clause, e.g. "dbo.Orders"
+  std::string key;            // Integer column to split on
+  std::string columns = "*";  // Select list
+  std::string where;          // Optional filter, ANDed with the ranges
+
+  // Connections used at once and number of ranges, ranges defaults to
+  // workers.
+  int workers = 4;
+  int ranges = 0;
+
+  // Split points between ranges, ascending. When empty they're worked out
+  // by the server: evenly between MIN(key) and MAX(key), or from quantiles
+  // of a TABLESAMPLE when sample_percent is set (better for skewed keys).
+  std::vector<int64_t> bounds;
+  double sample_percent = 0.0;
+
+  // Rows per batch, and batches each range may have buffered ahead of the
+  // consumer. Memory use is about workers * (queue_batches + 1) batches.
+  size_t batch_rows = 1000;
+  size_t queue_batches = 4;
+};
+
+// Splits a table scan into key ranges and reads them concurrently over
+// pooled connections. The first range has no lower bound and the last no
+// upper bound, so rows outside the computed bounds aren't lost.
+class SqlParallelScan {
+public:
+  SqlParallelScan(const std::string& user, const std::string& pass,
+      const std::string& server, const std::string& database,
+      const SqlScanOptions& options);
+
+  // Uses connections opened with the given options.
+  SqlParallelScan(const std::string& user, const std::string& pass,
+      const std::string& server, const std::string& database,
+      const SqlScanOptions& options, const SqlConnectionOptions& conn_options);
+
+  // Calls consumer on the worker threads, concurrently, with the batches
+  // of each range. A worker doesn't read ahead while its consumer is busy.
+  void Run(const std::function<void(int range, SqlRowBatch&)>& consumer);
+
+  // Calls consumer on the calling thread with all batches in key order.
+  // Workers block once queue_batches of their range are waiting.
+  void RunOrdered(const std::function<void(SqlRowBatch&)>& consumer);
+
+  // The split points used by the last run.
+  const std::vector<int64_t>& Bounds() const { return _bounds; }
+
+private:
+  struct Shared;
+
+  void compute_bounds();
+  std::string range_sql(size_t range, bool ordered) const;
+  void scan_range(Shared& shared, size_t range);
+  void run(Shared& shared);
+
+  std::string _user;
+  std::string _pass;
+  std::string _server;
+  std::string _database;
+  SqlScanOptions _options;
+  std::optional<SqlConnectionOptions> _conn_options;
+  std::vector<int64_t> _bounds;
+};
+
+} // namespace tds
+
+#endif // TDS_SQLPARALLELSCAN_H
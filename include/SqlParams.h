@@ -17,6 +17,9 @@
 #ifndef TDS_SQLPARAMS_H
 #define TDS_SQLPARAMS_H
 
+#include <cstddef>
+#include <initializer_list>
+#include <memory_resource>
 #include <string>
 #include <vector>
 
@@ -52,6 +55,11 @@ struct db_param {
 
 class SqlParams {
 public:
+  SqlParams() = default;
+
+  // Keeps the parameter list in mr, eg a per-request arena.
+  explicit SqlParams(std::pmr::memory_resource *mr) : pvec{mr} {}
+
   void AddInt(const char *name, int ival);
   void AddString(const char *name, const std::string& str);
   void AddString(const char *name, const char *str, size_t sz);
@@ -59,11 +67,52 @@ public:
 
   void AddNull(const char *name, ParamType type);
 
-  const std::vector<db_param>& ToVec() { return pvec; }
+  // The list as it is kept, calls take this (or the SqlParams itself)
+  // without copying.
+  const std::pmr::vector<db_param>& Params() const { return pvec; }
+
+  // A std::vector copy of the list, for code written against the type
+  // ToVec has always returned.
+  std::vector<db_param> ToVec() const
+  {
+    return std::vector<db_param>(pvec.begin(), pvec.end());
+  }
 private:
-  std::vector<db_param> pvec;
+  std::pmr::vector<db_param> pvec;
 };
 
+// The parameters of a call, as a view over wherever the caller keeps them
+// (std::vector, std::pmr::vector, SqlParams or a braced list). They only
+// need to outlive the call.
+class SqlParamSpan {
+public:
+  SqlParamSpan() = default;
+  SqlParamSpan(const db_param *data, size_t size) : _data{data}, _size{size} {}
+
+  template <typename Alloc>
+  SqlParamSpan(const std::vector<db_param, Alloc>& params) :
+    _data{params.data()}, _size{params.size()} {}
+
+  SqlParamSpan(std::initializer_list<db_param> params) :
+    _data{params.begin()}, _size{params.size()} {}
+
+  SqlParamSpan(const SqlParams& params) : SqlParamSpan(params.Params()) {}
+
+  const db_param *begin() const { return _data; }
+  const db_param *end() const { return _data + _size; }
+  size_t size() const { return _size; }
+  bool empty() const { return _size == 0; }
+  const db_param& operator[](size_t i) const { return _data[i]; }
+
+private:
+  const db_param *_data{nullptr};
+  size_t _size{0};
+};
+
+// Quotes str as an N'...' string literal, for the rare cases where values
+// have to go into the SQL text instead of parameters.
+std::string sql_quote_literal(const std::string& str);
+
 }
 
 #endif // TDS_SQLPARAMS_H
@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2012-2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef TDS_SQLPREFETCHREADER_H
+#define TDS_SQLPREFETCHREADER_H
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "SqlRowBatch.h"
+
+namespace tds {
+
+class SqlClient;
+
+// Reads the current result set of a client on a background thread, depth
+// batches ahead of the consumer, so fetching and decoding rows overlaps
+// with processing them. The client must not be touched until the reader
+// is destroyed; rows left unread at that point are discarded by the
+// client's next call.
+class SqlPrefetchReader {
+public:
+  explicit SqlPrefetchReader(SqlClient& client, size_t batch_rows = 1000,
+      size_t depth = 2);
+  ~SqlPrefetchReader();
+
+  SqlPrefetchReader(const SqlPrefetchReader&) = delete;
+  SqlPrefetchReader& operator=(const SqlPrefetchReader&) = delete;
+
+  const std::vector<std::string>& GetAllColumnNames() const { return _names; }
+
+  // Swaps the next batch into batch, whose old storage is recycled for
+  // reading ahead. Returns false at the end of the result set and rethrows
+  // any error the fetch ran into.
+  bool NextBatch(SqlRowBatch& batch);
+
+  // Row at a time access on top of NextBatch, columns are 0 based as with
+  // SqlClient.
+  bool NextRow();
+  const std::string& GetStringCol(int col) const
+  {
+    return _current.Get(_row, static_cast<size_t>(col));
+  }
+  bool IsNullCol(int col) const
+  {
+    return _current.IsNull(_row, static_cast<size_t>(col));
+  }
+
+private:
+  void fetch();
+
+  SqlClient& _client;
+  size_t _batch_rows;
+  size_t _depth;
+  std::vector<std::string> _names;
+
+  std::mutex _mutex;
+  std::condition_variable _cond;
+  std::deque<SqlRowBatch> _ready;
+  std::vector<SqlRowBatch> _free;
+  bool _done{false};
+  bool _stop{false};
+  std::exception_ptr _error;
+  std::thread _thread;
+
+  // Row cursor state.
+  SqlRowBatch _current;
+  size_t _row{0};
+  bool _started{false};
+};
+
+} // namespace tds
+
+#endif // TDS_SQLPREFETCHREADER_H
@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2012-2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef TDS_SQLPROXY_H
+#define TDS_SQLPROXY_H
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "SqlError.h"
+#include "SqlParams.h"
+
+namespace tds {
+
+class SqlClient;
+
+// Protocol spoken between SqlClient in proxy mode and sql_poold over a
+// Unix domain socket. Each request is a length prefixed frame, each
+// response a frame carrying the call's status plus, for calls that
+// returned rows, a memfd holding all result sets (passed with
+// SCM_RIGHTS), which the client maps instead of copying rows through the
+// socket.
+enum class SqlProxyOp : uint8_t {
+  ExecSql = 1,
+  ExecDML,
+  ExecStoredProc,
+  ExecNonQuery
+};
+
+struct SqlProxyRequest {
+  SqlProxyOp op;
+  std::string user;
+  std::string pass;
+  std::string server;
+  std::string database;
+  std::string text;     // SQL or procedure name
+  int32_t timeout_ms{0};
+
+  struct Param {
+    std::string name;
+    ParamType type;
+    bool is_null;
+    int32_t ivalue;
+    std::string svalue;
+  };
+  std::vector<Param> params;
+
+  // Parameters as SqlClient takes them, pointing into params.
+  std::vector<db_param> ToParams() const;
+};
+
+// Daemon side. Reads the next request, false on EOF or a malformed frame.
+bool sql_proxy_read_request(int sock, SqlProxyRequest *req);
+
+// Writes every result set pending on client to a new memfd and returns it.
+int sql_proxy_write_results(SqlClient& client);
+
+// Sends status and, unless it's -1, the results fd.
+bool sql_proxy_send_response(int sock, const SqlStatus& status, int results_fd);
+
+// Client side, one socket connection per SqlClient.
+class SqlProxyClient {
+public:
+  explicit SqlProxyClient(const std::string& socket_path);
+  ~SqlProxyClient();
+
+  SqlProxyClient(const SqlProxyClient&) = delete;
+  SqlProxyClient& operator=(const SqlProxyClient&) = delete;
+
+  SqlStatus Exec(SqlProxyOp op, const std::string& user,
+      const std::string& pass, const std::string& server,
+      const std::string& database, const char *text,
+      SqlParamSpan params, std::chrono::milliseconds timeout);
+
+  // Same positioning rules as SqlConnection, after Exec the first result
+  // set is current.
+  bool NextResult();
+  bool NextRow();
+  void Dispose();
+
+  int GetColumnCount() const { return static_cast<int>(_names.size()); }
+  const std::vector<std::string>& GetAllColumnNames() const { return _names; }
+  int GetOrdinal(const char *name) const;
+
+  // Values arrive as text, data is null for NULL.
+  const char *GetColumnData(int col, int *len) const
+  {
+    *len = static_cast<int>(_cells[col].second);
+    return _cells[col].first;
+  }
+
+private:
+  bool connect_socket();
+  bool read_result_header();
+
+  std::string _path;
+  int _sock{-1};
+
+  // Mapped results and the read position in them.
+  const char *_map{nullptr};
+  size_t _map_len{0};
+  const char *_pos{nullptr};
+  bool _in_rows{false};
+
+  std::vector<std::string> _names;
+  std::vector<std::pair<const char *, uint32_t>> _cells;
+};
+
+} // namespace tds
+
+#endif // TDS_SQLPROXY_H
@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2012-2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef TDS_SQLRINGBUFFER_H
+#define TDS_SQLRINGBUFFER_H
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+namespace tds {
+
+// Bounded lock-free queue for any number of producers and consumers
+// (Dmitry Vyukov's design). Each slot carries a sequence number telling
+// producers and consumers whose turn it is, so the only contention is on
+// the head and tail counters.
+template <typename T>
+class SqlRingBuffer {
+public:
+  // Capacity is rounded up to a power of two.
+  explicit SqlRingBuffer(size_t capacity)
+  {
+    size_t size = 2;
+    while (size < capacity)
+      size <<= 1;
+
+    _mask = size - 1;
+    _cells.reset(new Cell[size]);
+    for (size_t i = 0; i < size; i++)
+      _cells[i].seq.store(i, std::memory_order_relaxed);
+  }
+
+  SqlRingBuffer(const SqlRingBuffer&) = delete;
+  SqlRingBuffer& operator=(const SqlRingBuffer&) = delete;
+
+  size_t Capacity() const { return _mask + 1; }
+
+  // Returns false if the queue is full, item is only moved from on
+  // success so the caller can try again.
+  bool TryPush(T&& item) { return push(std::move(item)); }
+  bool TryPush(const T& item) { return push(item); }
+
+  // Returns false if the queue is empty.
+  bool TryPop(T& item)
+  {
+    size_t pos = _head.load(std::memory_order_relaxed);
+    for (;;) {
+      Cell& cell = _cells[pos & _mask];
+      size_t seq = cell.seq.load(std::memory_order_acquire);
+      auto diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos + 1);
+      if (diff == 0) {
+        if (_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          item = std::move(cell.data);
+          cell.seq.store(pos + _mask + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = _head.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // Approximate, only good for heuristics.
+  size_t Size() const
+  {
+    size_t tail = _tail.load(std::memory_order_relaxed);
+    size_t head = _head.load(std::memory_order_relaxed);
+    return tail > head ? tail - head : 0;
+  }
+
+private:
+  template <typename U>
+  bool push(U&& item)
+  {
+    size_t pos = _tail.load(std::memory_order_relaxed);
+    for (;;) {
+      Cell& cell = _cells[pos & _mask];
+      size_t seq = cell.seq.load(std::memory_order_acquire);
+      auto diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos);
+      if (diff == 0) {
+        if (_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          cell.data = std::forward<U>(item);
+          cell.seq.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = _tail.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  struct Cell {
+    std::atomic<size_t> seq;
+    T data;
+  };
+
+  std::unique_ptr<Cell[]> _cells;
+  size_t _mask;
+
+  // Keep producers and consumers off each other's cache lines.
+  alignas(64) std::atomic<size_t> _tail{0};
+  alignas(64) std::atomic<size_t> _head{0};
+};
+
+} // namespace tds
+
+#endif // TDS_SQLRINGBUFFER_H
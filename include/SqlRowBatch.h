@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2012-2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef TDS_SQLROWBATCH_H
+#define TDS_SQLROWBATCH_H
+
+#include <string>
+#include <vector>
+
+namespace tds {
+
+class SqlClient;
+
+// A block of rows stored column by column, values are kept as the strings
+// GetStringCol returns.
+class SqlRowBatch {
+public:
+  struct Column {
+    std::string name;
+    // At least Rows() entries. Ones past that are left over from before the
+    // last Clear or Reset, and are written over by the next Append.
+    std::vector<std::string> values;
+    std::vector<bool> nulls;
+  };
+
+  size_t Rows() const { return _rows; }
+  size_t Columns() const { return _columns.size(); }
+  bool Empty() const { return _rows == 0; }
+
+  const Column& GetColumn(size_t col) const { return _columns[col]; }
+  const std::string& Get(size_t row, size_t col) const
+  {
+    return _columns[col].values[row];
+  }
+  bool IsNull(size_t row, size_t col) const { return _columns[col].nulls[row]; }
+
+  // Sets up the columns of the current result set of client. Cell strings
+  // from earlier use are kept.
+  void Reset(const std::vector<std::string>& names, size_t reserve_rows);
+
+  // Empties the batch, keeping columns and the cell strings for reuse.
+  void Clear();
+
+  // Appends the row client is positioned on.
+  void Append(SqlClient& client);
+
+private:
+  std::vector<Column> _columns;
+  size_t _rows{0};
+};
+
+} // namespace tds
+
+#endif // TDS_SQLROWBATCH_H
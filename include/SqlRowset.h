@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2012-2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef TDS_SQLROWSET_H
+#define TDS_SQLROWSET_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace tds {
+
+class SqlClient;
+
+// How a rowset column is stored. Integers and bits are Int, float and real
+// are Float, everything else is Text. Binary and image columns keep their
+// raw bytes, the rest the text GetStringCol would give.
+enum class SqlRowsetType {
+  Int, Float, Text
+};
+
+struct SqlRowsetOptions {
+  // Text beyond this many bytes is spilled to an unlinked temp file in
+  // temp_dir and memory mapped, instead of living on the heap.
+  size_t spill_threshold = 64 << 20;
+  std::string temp_dir = "/tmp";
+};
+
+// One result set of a SqlRowset, stored column by column.
+class SqlRowsetTable {
+public:
+  size_t Rows() const { return _rows; }
+  size_t Columns() const { return _columns.size(); }
+  const std::string& ColumnName(size_t col) const { return _columns[col].name; }
+  SqlRowsetType ColumnType(size_t col) const { return _columns[col].type; }
+
+  bool IsNull(size_t row, size_t col) const
+  {
+    return (_columns[col].nulls[row / 64] >> (row % 64)) & 1;
+  }
+
+  // Values converted to the requested type if needed, 0 or empty for NULL.
+  int64_t GetInt64(size_t row, size_t col) const;
+  double GetDouble(size_t row, size_t col) const;
+  std::string GetString(size_t row, size_t col) const;
+
+  // Text columns only, no copy. Valid as long as the rowset is.
+  std::string_view GetText(size_t row, size_t col) const
+  {
+    const Column& c = _columns[col];
+    return std::string_view(_arena + c.offsets[row],
+        c.offsets[row + 1] - c.offsets[row]);
+  }
+
+private:
+  friend class SqlRowset;
+
+  struct Column {
+    std::string name;
+    SqlRowsetType type;
+    std::vector<uint64_t> nulls;    // Bitmap
+    std::vector<int64_t> ints;
+    std::vector<double> floats;
+    std::vector<uint64_t> offsets;  // Rows + 1 entries into the arena
+  };
+
+  std::vector<Column> _columns;
+  size_t _rows{0};
+  const char *_arena{nullptr};
+};
+
+// Every result set of a call, read in full so the connection can go back
+// to the pool before the rows are looked at. Immutable once loaded, so a
+// rowset can be shared and read from any number of threads.
+class SqlRowset {
+public:
+  // Reads all pending result sets of client, then releases its connection.
+  static std::shared_ptr<const SqlRowset> Load(SqlClient& client,
+      const SqlRowsetOptions& options = SqlRowsetOptions());
+
+  ~SqlRowset();
+
+  SqlRowset(const SqlRowset&) = delete;
+  SqlRowset& operator=(const SqlRowset&) = delete;
+
+  size_t ResultCount() const { return _tables.size(); }
+  const SqlRowsetTable& Result(size_t i) const { return _tables[i]; }
+
+  // Bytes of text held, and whether they live in a mapped file.
+  uint64_t TextBytes() const { return _arena_size; }
+  bool Spilled() const { return _map != nullptr; }
+
+private:
+  SqlRowset() = default;
+
+  void load(SqlClient& client, const SqlRowsetOptions& options);
+  void append_text(const char *data, size_t len,
+      const SqlRowsetOptions& options);
+  void flush_spill();
+  void finish();
+
+  std::vector<SqlRowsetTable> _tables;
+
+  // The text arena is built in _heap, moving to _fd once it passes the
+  // spill threshold.
+  std::vector<char> _heap;
+  std::vector<char> _spill_buf;
+  int _fd{-1};
+  uint64_t _arena_size{0};
+  void *_map{nullptr};
+};
+
+} // namespace tds
+
+#endif // TDS_SQLROWSET_H
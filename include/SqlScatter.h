@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2012-2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef TDS_SQLSCATTER_H
+#define TDS_SQLSCATTER_H
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "SqlClient.h"
+#include "SqlError.h"
+#include "SqlParams.h"
+#include "SqlRowBatch.h"
+
+namespace tds {
+
+struct SqlShard {
+  std::string server;
+  std::string database;
+};
+
+struct SqlScatterOptions {
+  int max_threads = 16;      // Targets in flight overall
+  int max_per_server = 4;    // Targets in flight per server, at least 1
+  size_t batch_rows = 500;
+
+  // Applied to each target's SqlClient.
+  std::chrono::milliseconds timeout{0};
+  SqlRetryPolicy retry;
+};
+
+// Outcome of one target, in the order the targets were given.
+struct SqlScatterResult {
+  SqlStatus status;
+  int64_t rows{0};
+  std::chrono::microseconds elapsed{0};
+};
+
+// Runs the same call against many (server, database) targets at once,
+// merging the rows into a single stream. A failing target doesn't stop the
+// others, its error is reported in its result.
+class SqlScatter {
+public:
+  // Called with the index of the target the batch came from. Calls are
+  // serialized, the consumer needs no locking of its own.
+  using Consumer = std::function<void(size_t target, SqlRowBatch&)>;
+
+  // Runs call on a client connected to each target. The call returns its
+  // status, rows of every result set it leaves pending are passed on to
+  // consumer.
+  using Call = std::function<SqlStatus(SqlClient&)>;
+
+  SqlScatter(const std::string& user, const std::string& pass,
+      const SqlScatterOptions& options = SqlScatterOptions());
+
+  std::vector<SqlScatterResult> Run(const std::vector<SqlShard>& targets,
+      const Call& call, const Consumer& consumer);
+
+  std::vector<SqlScatterResult> ExecSql(const std::vector<SqlShard>& targets,
+      const char *sql, const Consumer& consumer);
+  std::vector<SqlScatterResult> ExecStoredProc(
+      const std::vector<SqlShard>& targets, const char *proc,
+      const std::vector<db_param>& params, const Consumer& consumer);
+
+private:
+  std::string _user;
+  std::string _pass;
+  SqlScatterOptions _options;
+};
+
+} // namespace tds
+
+#endif // TDS_SQLSCATTER_H
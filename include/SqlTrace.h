@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2012-2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef TDS_SQLTRACE_H
+#define TDS_SQLTRACE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace tds {
+
+struct SqlTraceOptions {
+  // Calls taking at least this long are logged as "slow_query" at
+  // SQL_LOG_INFO. Zero disables slow query records.
+  std::chrono::microseconds slow_threshold{100000};
+
+  // Fraction (0 to 1) of the remaining calls logged as "query_sample" at
+  // SQL_LOG_DEBUG.
+  double sample_rate = 0.0;
+
+  // Distinct fingerprints kept in the stats table, anything beyond is
+  // counted under fingerprint 0.
+  size_t max_fingerprints = 1024;
+};
+
+// Aggregated timings for one statement shape. Times are in microseconds.
+struct SqlTraceStat {
+  uint64_t fingerprint;
+  std::string text;    // Normalized statement or procedure name
+  uint64_t calls;
+  uint64_t errors;
+  int64_t rows;
+  int64_t total_us;
+  int64_t max_us;
+  int64_t checkout_us; // Waiting for a pooled connection
+  int64_t exec_us;     // Sending and waiting for the first result
+  int64_t first_row_us;
+  int64_t drain_us;    // First row until the results were disposed
+};
+
+extern std::atomic<bool> g_sql_trace_enabled;
+
+inline bool sql_trace_enabled()
+{
+  return g_sql_trace_enabled.load(std::memory_order_relaxed);
+}
+
+// Starts timing SqlClient calls. Can be called again to change options,
+// the stats table is kept.
+void sql_trace_start(const SqlTraceOptions& options = SqlTraceOptions());
+void sql_trace_stop();
+
+// Snapshot of the stats table, most total time first.
+std::vector<SqlTraceStat> sql_trace_stats();
+void sql_trace_reset();
+
+// Normalizes sql (literals become ?, comments and extra whitespace are
+// dropped, IN (...) lists of literals collapse to one ? and VALUES rows to
+// the first), writing as much of the result as fits into out. Returns a
+// hash of the full normalized text.
+uint64_t sql_fingerprint(const char *sql, char *out, size_t out_size);
+
+// Timing state for a single call, owned by SqlClient. Does nothing unless
+// tracing was enabled when Begin was called.
+class SqlTraceSpan {
+public:
+  bool Active() const { return _active; }
+
+  void Begin(const char *text, bool is_proc);
+  void Checkout(std::chrono::steady_clock::time_point start);
+  void Sent(bool ok);
+  void Row()
+  {
+    if (_active && _rows++ == 0)
+      _first_row = std::chrono::steady_clock::now();
+  }
+
+  // Records the call. Spans that are not active are ignored.
+  void End(const std::string& server, const std::string& database);
+
+private:
+  bool _active{false};
+  bool _failed{false};
+  int _attempts{0};
+  int64_t _rows{0};
+  int64_t _checkout_us{0};
+  std::chrono::steady_clock::time_point _start;
+  std::chrono::steady_clock::time_point _sent;
+  std::chrono::steady_clock::time_point _first_row;
+  uint64_t _fingerprint{0};
+  char _text[256];
+};
+
+} // namespace tds
+
+#endif // TDS_SQLTRACE_H
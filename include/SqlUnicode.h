@@ -0,0 +1,35 @@
+/*
+ * Copyright (c) 2012-2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef TDS_SQLUNICODE_H
+#define TDS_SQLUNICODE_H
+
+#include <cstddef>
+
+namespace tds {
+
+// Converts UTF-16LE (NVARCHAR as the server stores it, eg selected as
+// CAST(col AS VARBINARY(MAX))) to UTF-8 in dst. An odd trailing byte is
+// ignored and unpaired surrogates become U+FFFD. Returns the length
+// written, or -1 if dst is too small; at most 3 bytes per code unit are
+// ever needed. ASCII runs are converted 8 code units at a time with SSE2
+// where available.
+int sql_utf16_to_utf8(const unsigned char *src, size_t src_len, char *dst,
+    size_t dst_size);
+
+} // namespace tds
+
+#endif // TDS_SQLUNICODE_H
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2012-2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef TDS_SQLWORKLOAD_H
+#define TDS_SQLWORKLOAD_H
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+namespace tds {
+
+// Workload classes, highest priority first.
+enum class SqlPriority {
+  Interactive, Normal, Batch
+};
+
+constexpr int sql_priority_count = 3;
+
+struct SqlWorkloadOptions {
+  // Connections that may be checked out to the server at once.
+  int max_connections = 50;
+
+  // Per class (indexed by SqlPriority): connections kept free for the class
+  // while it's below its reservation, and the most it may hold.
+  int reserved[sql_priority_count] = {10, 0, 0};
+  int cap[sql_priority_count] = {50, 50, 20};
+
+  // How long a checkout waits for a connection before failing.
+  std::chrono::milliseconds max_wait{1000};
+};
+
+// Shares a server's connections between workload classes. Each class is
+// held to its cap, connections reserved for other classes are off limits,
+// and when several classes are waiting the highest priority one that can
+// run goes first.
+class SqlWorkloadGate {
+public:
+  explicit SqlWorkloadGate(const SqlWorkloadOptions& options);
+
+  // Waits up to max_wait for a slot, false if none came free.
+  bool Acquire(SqlPriority priority);
+  void Release(SqlPriority priority);
+
+  int InUse(SqlPriority priority);
+
+private:
+  friend class SqlConnectionFactory; // Locks _mutex across fork()
+
+  bool admissible(int cls) const;
+  bool runnable(int cls) const;
+  void wake();
+
+  SqlWorkloadOptions _options;
+
+  std::mutex _mutex;
+  std::condition_variable _cond[sql_priority_count];
+  int _in_use[sql_priority_count] = {};
+  int _waiting[sql_priority_count] = {};
+  int _total{0};
+};
+
+} // namespace tds
+
+#endif // TDS_SQLWORKLOAD_H
@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2012-2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef TDS_SQLWRITEBEHIND_H
+#define TDS_SQLWRITEBEHIND_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "SqlClient.h"
+#include "SqlError.h"
+#include "SqlParams.h"
+#include "SqlRingBuffer.h"
+
+namespace tds {
+
+// A procedure call queued for writing later. Unlike SqlParams the values
+// are owned, the caller's buffers can go away after enqueueing.
+class SqlWrite {
+public:
+  SqlWrite() = default;
+  explicit SqlWrite(const std::string& proc) : _proc{proc} { }
+
+  SqlWrite& AddInt(const char *name, int ival);
+  SqlWrite& AddString(const char *name, const std::string& str);
+  SqlWrite& AddBool(const char *name, bool bval);
+  SqlWrite& AddNull(const char *name);
+
+  // Called from a flusher thread once the write's transaction committed
+  // (ok status) or failed.
+  SqlWrite& OnDone(std::function<void(const SqlStatus&)> done);
+
+private:
+  friend class SqlWriteBehind;
+
+  // Appends "EXEC proc @a = ..., @b = ...;" to sql.
+  void append_exec(std::string& sql) const;
+
+  std::string _proc;
+  std::string _args;
+  std::function<void(const SqlStatus&)> _done;
+};
+
+struct SqlWriteBehindOptions {
+  size_t capacity = 8192;    // Queued writes before Enqueue blocks
+  int flushers = 1;
+  size_t max_batch = 100;    // Writes per transaction
+
+  // How long a flusher waits for a batch to fill up.
+  std::chrono::milliseconds flush_interval{50};
+
+  SqlRetryPolicy retry;
+};
+
+// Takes fire and forget writes off request threads. Writes go into a lock
+// free queue and flusher threads send them in batches, each batch one
+// multi-statement transaction on one pooled connection. If the server
+// rejects a write, the rest of its batch is sent again one write at a time.
+class SqlWriteBehind {
+public:
+  SqlWriteBehind(const std::string& user, const std::string& pass,
+      const std::string& server, const std::string& database,
+      const SqlWriteBehindOptions& options = SqlWriteBehindOptions());
+
+  // Writes whatever is still queued.
+  ~SqlWriteBehind();
+
+  SqlWriteBehind(const SqlWriteBehind&) = delete;
+  SqlWriteBehind& operator=(const SqlWriteBehind&) = delete;
+
+  // Returns false, leaving write alone, if the queue is full.
+  bool TryEnqueue(SqlWrite&& write);
+
+  // Waits for room in the queue, returns false if stopped meanwhile.
+  bool Enqueue(SqlWrite&& write);
+
+  // Waits until as many writes as had been queued at the time of the call
+  // have been sent.
+  void Flush();
+
+  // Writes everything queued and stops the flushers. Writes enqueued
+  // afterwards are rejected.
+  void Stop();
+
+  size_t Pending() const { return _queue.Size(); }
+
+private:
+  void flusher();
+  void write_batch(SqlClient& client, std::vector<SqlWrite>& batch);
+
+  std::string _user;
+  std::string _pass;
+  std::string _server;
+  std::string _database;
+  SqlWriteBehindOptions _options;
+
+  SqlRingBuffer<SqlWrite> _queue;
+  std::atomic<uint64_t> _enqueued{0};
+  std::atomic<uint64_t> _written{0};
+  std::atomic<bool> _stopping{false}; // Rejects new writes
+  std::atomic<int> _enqueuing{0};     // TryEnqueue calls in progress
+  std::atomic<bool> _closed{false};   // Flushers exit once the queue is empty
+
+  std::mutex _mutex;
+  uint64_t _flush_target{0};         // Guarded by _mutex
+  std::condition_variable _wake;     // Flushers, on Flush and Stop
+  std::condition_variable _progress; // Flush callers
+  std::vector<std::thread> _threads;
+};
+
+} // namespace tds
+
+#endif // TDS_SQLWRITEBEHIND_H
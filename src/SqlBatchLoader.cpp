@@ -0,0 +1,208 @@
+/*
+ * Copyright (c) 2012-2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <cstdio>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "SqlBatchLoader.h"
+#include "SqlClient.h"
+#include "SqlParams.h"
+
+namespace tds {
+
+struct SqlBatchLoader::Batch {
+  std::vector<std::string> keys;
+  std::unordered_set<std::string> seen;
+
+  // Filled in by the thread that ran the batch.
+  bool done{false};
+  SqlStatus status;
+  std::unordered_map<std::string, SqlRowBatch> rows;
+};
+
+SqlBatchLoader::SqlBatchLoader(const std::string& user,
+    const std::string& pass, const std::string& server,
+    const std::string& database, const SqlBatchLoaderOptions& options) :
+  _user{user}, _pass{pass}, _server{server}, _database{database},
+  _options{options}
+{
+}
+
+SqlBatchLoader::SqlBatchLoader(const std::string& user,
+    const std::string& pass, const std::string& server,
+    const std::string& database, const SqlBatchLoaderOptions& options,
+    const SqlConnectionOptions& conn_options) :
+  _user{user}, _pass{pass}, _server{server}, _database{database},
+  _options{options}, _conn_options{conn_options}
+{
+}
+
+SqlStatus SqlBatchLoader::Load(const std::string& key, SqlRowBatch *out)
+{
+  std::unique_lock<std::mutex> locker(_mutex);
+
+  // The first caller of a batch waits out the window and then runs it,
+  // everyone else just waits for the results.
+  std::shared_ptr<Batch> batch = _open;
+  bool leader = batch == nullptr;
+  if (leader) {
+    batch = std::make_shared<Batch>();
+    _open = batch;
+  }
+
+  if (batch->seen.insert(key).second)
+    batch->keys.push_back(key);
+  if (batch->keys.size() >= _options.max_keys) {
+    _open.reset();
+    _cond.notify_all();
+  }
+
+  if (leader) {
+    auto deadline = std::chrono::steady_clock::now() + _options.window;
+    _cond.wait_until(locker, deadline, [&] { return _open != batch; });
+    if (_open == batch)
+      _open.reset();
+    locker.unlock();
+
+    execute(*batch);
+
+    locker.lock();
+    batch->done = true;
+    _cond.notify_all();
+  } else {
+    _cond.wait(locker, [&] { return batch->done; });
+  }
+  locker.unlock();
+
+  // Results are read only once the batch is done.
+  if (auto it = batch->rows.find(key); it != batch->rows.end())
+    *out = it->second;
+  else
+    out->Clear();
+  return batch->status;
+}
+
+static bool is_integer(const std::string& key)
+{
+  size_t i = key.size() > 1 && key[0] == '-' ? 1 : 0;
+  if (i == key.size())
+    return false;
+  for (; i < key.size(); i++) {
+    if (key[i] < '0' || key[i] > '9')
+      return false;
+  }
+  return true;
+}
+
+static std::string json_array(const std::vector<std::string>& keys)
+{
+  std::string json = "[";
+  for (const auto& key : keys) {
+    if (json.size() > 1)
+      json += ',';
+    json += '"';
+    for (unsigned char c : key) {
+      if (c == '"' || c == '\\') {
+        json += '\\';
+        json += static_cast<char>(c);
+      } else if (c < 0x20) {
+        char esc[8];
+        snprintf(esc, sizeof(esc), "\\u%04x", c);
+        json += esc;
+      } else {
+        json += static_cast<char>(c);
+      }
+    }
+    json += '"';
+  }
+  json += ']';
+  return json;
+}
+
+void SqlBatchLoader::execute(Batch& batch)
+{
+  try {
+    std::optional<SqlClient> client;
+    if (_conn_options)
+      client.emplace(_user, _pass, _server, _database, *_conn_options);
+    else
+      client.emplace(_user, _pass, _server, _database);
+
+    std::string text;
+    if (_options.mode == SqlBatchMode::InList) {
+      std::string list;
+      for (const auto& key : batch.keys) {
+        if (!list.empty())
+          list += ", ";
+        list += _options.numeric_keys && is_integer(key) ? key :
+          sql_quote_literal(key);
+      }
+
+      text = _options.query;
+      if (size_t pos = text.find("$KEYS"); pos != std::string::npos)
+        text.replace(pos, 5, list);
+      batch.status = client->TryExecSql(text.c_str(), true);
+    } else {
+      text = json_array(batch.keys);
+      SqlParams params;
+      params.AddString(_options.json_param.c_str(), text);
+      batch.status = client->TryExecStoredProc(_options.query.c_str(),
+          params, true);
+    }
+    if (!batch.status)
+      return;
+
+    std::vector<std::string> names = client->GetAllColumnNames();
+    int key_col = -1;
+    for (size_t i = 0; i < names.size(); i++) {
+      if (names[i] == _options.key_column)
+        key_col = static_cast<int>(i);
+    }
+    if (key_col < 0) {
+      SqlError error;
+      error.kind = SqlErrorKind::General;
+      snprintf(error.text, sizeof(error.text),
+          "SqlBatchLoader > Key column %s not in results",
+          _options.key_column.c_str());
+      snprintf(error.message, sizeof(error.message), "%s", error.text);
+      batch.status = SqlStatus(error);
+      return;
+    }
+
+    bool has_row;
+    while ((batch.status = client->TryNextRow(&has_row)) && has_row) {
+      auto it = batch.rows.find(client->GetStringCol(key_col));
+      if (it == batch.rows.end()) {
+        it = batch.rows.emplace(client->GetStringCol(key_col),
+            SqlRowBatch()).first;
+        it->second.Reset(names, 1);
+      }
+      it->second.Append(*client);
+    }
+  } catch (const SqlException& e) {
+    batch.status = SqlStatus(e.Error());
+  } catch (const std::exception& e) {
+    SqlError error;
+    error.kind = SqlErrorKind::General;
+    snprintf(error.message, sizeof(error.message), "%s", e.what());
+    snprintf(error.text, sizeof(error.text), "%s", e.what());
+    batch.status = SqlStatus(error);
+  }
+}
+
+}
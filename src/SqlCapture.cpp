@@ -0,0 +1,370 @@
+/*
+ * Copyright (c) 2012-2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <pthread.h>
+
+#include "SqlCapture.h"
+
+namespace tds {
+
+std::atomic<bool> g_sql_capture_enabled{false};
+
+// Version 02 added SqlCaptureRecord::complete and SqlCaptureShape::exact.
+static const char capture_magic[8] = {'S', 'Q', 'L', 'C', 'A', 'P', '0', '2'};
+
+static std::mutex g_capture_mutex;
+static FILE *g_capture_fp;
+static std::atomic<std::chrono::steady_clock::rep> g_capture_start{0};
+static std::atomic<uint32_t> g_capture_threads{0};
+
+// Held across fork(), with the log flushed so a child that exits doesn't
+// write the parent's buffered records out a second time.
+static void before_fork()
+{
+  g_capture_mutex.lock();
+  if (g_capture_fp != nullptr)
+    fflush(g_capture_fp);
+}
+
+static void after_fork_parent()
+{
+  g_capture_mutex.unlock();
+}
+
+// Two processes appending to one log would interleave records, children
+// stop capturing. The stream is only forgotten, its buffer was flushed
+// before the fork.
+static void after_fork_child()
+{
+  g_sql_capture_enabled.store(false, std::memory_order_relaxed);
+  g_capture_fp = nullptr;
+  g_capture_mutex.unlock();
+}
+
+bool sql_capture_start(const char *path)
+{
+  static std::once_flag installed;
+  std::call_once(installed, [] {
+    pthread_atfork(before_fork, after_fork_parent, after_fork_child);
+  });
+
+  FILE *fp = fopen(path, "wbe");
+  if (fp == nullptr)
+    return false;
+  fwrite(capture_magic, 1, sizeof(capture_magic), fp);
+
+  std::lock_guard<std::mutex> locker(g_capture_mutex);
+  if (g_capture_fp != nullptr)
+    fclose(g_capture_fp);
+  g_capture_fp = fp;
+  g_capture_start.store(
+      std::chrono::steady_clock::now().time_since_epoch().count());
+  g_sql_capture_enabled.store(true);
+  return true;
+}
+
+void sql_capture_stop()
+{
+  g_sql_capture_enabled.store(false);
+
+  std::lock_guard<std::mutex> locker(g_capture_mutex);
+  if (g_capture_fp != nullptr) {
+    fclose(g_capture_fp);
+    g_capture_fp = nullptr;
+  }
+}
+
+namespace {
+
+struct Encoder {
+  std::string& buf;
+
+  void u8(uint8_t v) { buf += static_cast<char>(v); }
+  void u32(uint32_t v) { buf.append(reinterpret_cast<const char *>(&v), sizeof(v)); }
+  void u64(uint64_t v) { buf.append(reinterpret_cast<const char *>(&v), sizeof(v)); }
+  void str(const std::string& s)
+  {
+    u32(static_cast<uint32_t>(s.size()));
+    buf += s;
+  }
+};
+
+struct Decoder {
+  const char *p;
+  const char *end;
+  bool ok{true};
+
+  bool have(size_t n)
+  {
+    if (ok && static_cast<size_t>(end - p) >= n)
+      return true;
+    ok = false;
+    return false;
+  }
+  uint8_t u8() { return have(1) ? static_cast<uint8_t>(*p++) : 0; }
+  uint32_t u32()
+  {
+    uint32_t v = 0;
+    if (have(sizeof(v))) {
+      memcpy(&v, p, sizeof(v));
+      p += sizeof(v);
+    }
+    return v;
+  }
+  uint64_t u64()
+  {
+    uint64_t v = 0;
+    if (have(sizeof(v))) {
+      memcpy(&v, p, sizeof(v));
+      p += sizeof(v);
+    }
+    return v;
+  }
+  std::string str()
+  {
+    uint32_t len = u32();
+    if (!have(len))
+      return std::string();
+    std::string s(p, len);
+    p += len;
+    return s;
+  }
+};
+
+}
+
+// Records are a u32 length followed by the fields in declaration order.
+static void encode(const SqlCaptureRecord& rec, std::string& buf)
+{
+  buf.assign(sizeof(uint32_t), '\0');
+  Encoder out{buf};
+  out.u64(rec.start_us);
+  out.u32(rec.thread);
+  out.u8(static_cast<uint8_t>(rec.op));
+  out.u8(rec.ok ? 1 : 0);
+  out.u8(rec.complete ? 1 : 0);
+  out.u64(static_cast<uint64_t>(rec.exec_us));
+  out.u64(static_cast<uint64_t>(rec.total_us));
+  out.str(rec.server);
+  out.str(rec.database);
+  out.str(rec.text);
+  out.u32(static_cast<uint32_t>(rec.params.size()));
+  for (const auto& param : rec.params) {
+    out.str(param.name);
+    out.u8(static_cast<uint8_t>(param.type));
+    out.u8(param.is_null ? 1 : 0);
+    out.u32(static_cast<uint32_t>(param.ivalue));
+    out.str(param.svalue);
+  }
+  out.u32(static_cast<uint32_t>(rec.shapes.size()));
+  for (const auto& shape : rec.shapes) {
+    out.u32(shape.columns);
+    out.u64(shape.rows);
+    out.u8(shape.exact ? 1 : 0);
+  }
+
+  uint32_t len = static_cast<uint32_t>(buf.size() - sizeof(uint32_t));
+  memcpy(&buf[0], &len, sizeof(len));
+}
+
+static bool decode(const std::string& buf, int version, SqlCaptureRecord *rec)
+{
+  Decoder in{buf.data(), buf.data() + buf.size()};
+  rec->start_us = in.u64();
+  rec->thread = in.u32();
+  rec->op = static_cast<SqlCaptureOp>(in.u8());
+  rec->ok = in.u8() != 0;
+  // Version 01 didn't say, so its shapes are only lower bounds.
+  rec->complete = version >= 2 && in.u8() != 0;
+  rec->exec_us = static_cast<int64_t>(in.u64());
+  rec->total_us = static_cast<int64_t>(in.u64());
+  rec->server = in.str();
+  rec->database = in.str();
+  rec->text = in.str();
+
+  uint32_t count = in.u32();
+  rec->params.clear();
+  for (uint32_t i = 0; i < count && in.ok; i++) {
+    SqlCaptureParam param;
+    param.name = in.str();
+    param.type = static_cast<ParamType>(in.u8());
+    param.is_null = in.u8() != 0;
+    param.ivalue = static_cast<int32_t>(in.u32());
+    param.svalue = in.str();
+    rec->params.push_back(std::move(param));
+  }
+
+  count = in.u32();
+  rec->shapes.clear();
+  for (uint32_t i = 0; i < count && in.ok; i++) {
+    SqlCaptureShape shape;
+    shape.columns = in.u32();
+    shape.rows = in.u64();
+    shape.exact = version >= 2 && in.u8() != 0;
+    rec->shapes.push_back(shape);
+  }
+  return in.ok;
+}
+
+SqlCaptureReader::SqlCaptureReader(const char *path)
+{
+  _fp = fopen(path, "rbe");
+  if (_fp == nullptr)
+    return;
+
+  // Older logs are still readable, the version is the last two digits.
+  char magic[sizeof(capture_magic)];
+  if (fread(magic, 1, sizeof(magic), _fp) != sizeof(magic) ||
+      memcmp(magic, capture_magic, sizeof(magic) - 2) != 0) {
+    fclose(_fp);
+    _fp = nullptr;
+    return;
+  }
+  _version = (magic[6] - '0') * 10 + (magic[7] - '0');
+  if (_version < 1 || _version > 2) {
+    fclose(_fp);
+    _fp = nullptr;
+  }
+}
+
+SqlCaptureReader::~SqlCaptureReader()
+{
+  if (_fp != nullptr)
+    fclose(_fp);
+}
+
+bool SqlCaptureReader::Next(SqlCaptureRecord *rec)
+{
+  if (_fp == nullptr)
+    return false;
+
+  uint32_t len;
+  if (fread(&len, 1, sizeof(len), _fp) != sizeof(len))
+    return false;
+
+  _buf.resize(len);
+  if (len > 0 && fread(&_buf[0], 1, len, _fp) != len)
+    return false;
+  return decode(_buf, _version, rec);
+}
+
+static uint32_t capture_thread()
+{
+  thread_local uint32_t id = g_capture_threads.fetch_add(1,
+      std::memory_order_relaxed);
+  return id;
+}
+
+static void add_param(SqlCaptureRecord& rec, const char *name, ParamType type,
+    bool is_null, int32_t ivalue, const char *svalue, size_t len)
+{
+  SqlCaptureParam param;
+  param.name = name != nullptr ? name : "";
+  param.type = type;
+  param.is_null = is_null;
+  param.ivalue = ivalue;
+  if (svalue != nullptr)
+    param.svalue.assign(svalue, len);
+  rec.params.push_back(std::move(param));
+}
+
+void SqlCaptureCall::Begin(const char *text, bool is_proc, bool returns_rows,
+    const SqlCaptureArgs& args)
+{
+  _active = sql_capture_enabled();
+  if (!_active)
+    return;
+
+  _start = std::chrono::steady_clock::now();
+  _rec.op = is_proc ?
+    (returns_rows ? SqlCaptureOp::ExecStoredProc : SqlCaptureOp::ExecNonQuery) :
+    (returns_rows ? SqlCaptureOp::ExecSql : SqlCaptureOp::ExecDML);
+  _rec.ok = false;
+  _rec.complete = !returns_rows;
+  _rec.exec_us = 0;
+  _rec.text = text;
+  _rec.params.clear();
+  _rec.shapes.clear();
+
+  for (const auto& p : args.params) {
+    bool is_null = p.type == ParamType::String ? p.pvalue == nullptr :
+      p.datalen == 0;
+    add_param(_rec, p.name, p.type, is_null, p.ivalue,
+        p.type == ParamType::String && !is_null ?
+          static_cast<const char *>(p.pvalue) : nullptr,
+        p.datalen);
+  }
+
+  // Legacy parameters point at their values, ints and bits both as ints.
+  for (size_t i = 0; i < args.legacy_count; i++) {
+    const db_params& p = args.legacy[i];
+    if (p.type == STRING_TYPE) {
+      add_param(_rec, p.name, ParamType::String, p.value == nullptr, 0,
+          static_cast<const char *>(p.value), p.datalen);
+    } else {
+      int32_t value = 0;
+      if (p.value != nullptr)
+        memcpy(&value, p.value, sizeof(value));
+      add_param(_rec, p.name, p.type == INT32_TYPE ? ParamType::Int :
+          ParamType::Bit, p.value == nullptr, value, nullptr, 0);
+    }
+  }
+}
+
+void SqlCaptureCall::Returned(bool ok)
+{
+  if (!_active)
+    return;
+
+  _rec.ok = ok;
+  _rec.exec_us = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - _start).count();
+}
+
+void SqlCaptureCall::End(const std::string& server,
+    const std::string& database)
+{
+  if (!_active)
+    return;
+  _active = false;
+
+  _rec.total_us = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - _start).count();
+  _rec.thread = capture_thread();
+  _rec.server = server;
+  _rec.database = database;
+
+  // Calls begun before a restart count from the restart.
+  std::chrono::steady_clock::time_point capture_start{
+    std::chrono::steady_clock::duration{g_capture_start.load()}};
+  auto start = std::max(_start, capture_start);
+  _rec.start_us = static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::microseconds>(
+        start - capture_start).count());
+
+  // Encode outside the lock, only the write is serialized.
+  thread_local std::string buf;
+  encode(_rec, buf);
+
+  std::lock_guard<std::mutex> locker(g_capture_mutex);
+  if (g_capture_fp != nullptr)
+    fwrite(buf.data(), 1, buf.size(), g_capture_fp);
+}
+
+} // namespace tds
@@ -0,0 +1,267 @@
+/*
+ * Copyright (c) 2012-2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+#include "SqlChangePoller.h"
+#include "SqlLog.h"
+#include "SqlParams.h"
+
+namespace tds {
+
+SqlChangePoller::SqlChangePoller(std::shared_ptr<const SqlDataSource> source) :
+  _source{std::move(source)}
+{
+}
+
+SqlChangePoller::~SqlChangePoller()
+{
+  Stop();
+}
+
+size_t SqlChangePoller::Add(SqlChangeQuery query)
+{
+  std::lock_guard<std::mutex> locker(_poll_mutex);
+  _queries.push_back(std::move(query));
+  return _queries.size() - 1;
+}
+
+uint64_t SqlChangePoller::Watermark(size_t query)
+{
+  std::lock_guard<std::mutex> locker(_poll_mutex);
+  return _queries.at(query).watermark;
+}
+
+static void append_list(std::string& sql, const std::vector<std::string>& items,
+    const char *prefix, const char *separator)
+{
+  for (size_t i = 0; i < items.size(); i++) {
+    if (i > 0)
+      sql += separator;
+    sql += prefix;
+    sql += items[i];
+  }
+}
+
+// One result set per query, preceded by the change tracking version and
+// which queries need a full load when any query uses change tracking.
+// Rowversion queries stop short of MIN_ACTIVE_ROWVERSION so rows from
+// transactions still in flight aren't skipped over. The batch runs inside
+// EXEC () so its SET NOCOUNT ON reverts when it ends, a SET NOCOUNT OFF at
+// the end would be skipped when a query fails or Poll stops reading.
+std::string SqlChangePoller::build_batch(bool *tracked) const
+{
+  std::string sql = "SET NOCOUNT ON;\n";
+
+  *tracked = std::any_of(_queries.begin(), _queries.end(),
+      [](const SqlChangeQuery& q) {
+        return q.mode == SqlChangeMode::ChangeTracking;
+      });
+  if (*tracked) {
+    sql += "DECLARE @ct_now BIGINT = CHANGE_TRACKING_CURRENT_VERSION();\n";
+    std::string flags;
+    for (size_t i = 0; i < _queries.size(); i++) {
+      const SqlChangeQuery& q = _queries[i];
+      if (q.mode != SqlChangeMode::ChangeTracking)
+        continue;
+
+      std::string var = "@reload" + std::to_string(i);
+      sql += "DECLARE " + var + " INT = CASE WHEN ";
+      if (q.watermark == 0) {
+        sql += "1 = 1";
+      } else {
+        sql += "CHANGE_TRACKING_MIN_VALID_VERSION(OBJECT_ID(" +
+          sql_quote_literal(q.table) + ")) > " + std::to_string(q.watermark);
+      }
+      sql += " THEN 1 ELSE 0 END;\n";
+      flags += ", " + var;
+    }
+    sql += "SELECT @ct_now" + flags + ";\n";
+  }
+
+  for (size_t i = 0; i < _queries.size(); i++) {
+    const SqlChangeQuery& q = _queries[i];
+    if (q.mode == SqlChangeMode::RowVersion) {
+      sql += "SELECT ";
+      append_list(sql, q.columns, "", ", ");
+      sql += ", CAST(" + q.version_column + " AS BIGINT) FROM " + q.table +
+        " WHERE " + q.version_column + " > CAST(CAST(" +
+        std::to_string(q.watermark) + " AS BIGINT) AS BINARY(8)) AND " +
+        q.version_column + " < MIN_ACTIVE_ROWVERSION() ORDER BY " +
+        q.version_column + ";\n";
+      continue;
+    }
+
+    sql += "IF @reload" + std::to_string(i) + " = 1\n  SELECT ";
+    append_list(sql, q.columns, "t.", ", ");
+    sql += ", 'R', @ct_now FROM " + q.table + " AS t;\nELSE\n  SELECT ";
+    for (size_t c = 0; c < q.columns.size(); c++) {
+      bool key = std::find(q.key_columns.begin(), q.key_columns.end(),
+          q.columns[c]) != q.key_columns.end();
+      sql += c > 0 ? ", " : "";
+      sql += (key ? "ct." : "t.") + q.columns[c];
+    }
+    sql += ", ct.SYS_CHANGE_OPERATION, ct.SYS_CHANGE_VERSION FROM "
+      "CHANGETABLE(CHANGES " + q.table + ", " + std::to_string(q.watermark) +
+      ") AS ct LEFT JOIN " + q.table + " AS t ON ";
+    for (size_t k = 0; k < q.key_columns.size(); k++) {
+      sql += k > 0 ? " AND " : "";
+      sql += "t." + q.key_columns[k] + " = ct." + q.key_columns[k];
+    }
+    sql += " WHERE ct.SYS_CHANGE_VERSION <= @ct_now;\n";
+  }
+  return "EXEC (" + sql_quote_literal(sql) + ");";
+}
+
+static SqlStatus poll_error(const char *what)
+{
+  SqlError error;
+  error.kind = SqlErrorKind::General;
+  snprintf(error.message, sizeof(error.message), "%s", what);
+  snprintf(error.text, sizeof(error.text), "SqlChangePoller > %s", what);
+  return SqlStatus(error);
+}
+
+static uint64_t to_version(const std::string& str)
+{
+  return strtoull(str.c_str(), nullptr, 10);
+}
+
+SqlStatus SqlChangePoller::Poll()
+{
+  std::lock_guard<std::mutex> locker(_poll_mutex);
+  if (_queries.empty())
+    return SqlStatus();
+
+  bool tracked;
+  std::string sql = build_batch(&tracked);
+
+  SqlClient client(_source);
+  SqlStatus status = client.TryExecSql(sql.c_str());
+  if (!status)
+    return status;
+
+  bool has_row;
+  bool more = true;
+  bool first = true;
+  auto next_result = [&]() {
+    if (!first)
+      status = client.TryNextResult(&more);
+    first = false;
+    if (status && !more)
+      status = poll_error("Batch returned fewer result sets than queries");
+    return status.Ok();
+  };
+
+  uint64_t ct_now = 0;
+  std::vector<bool> reload(_queries.size());
+  if (tracked) {
+    if (!next_result() || !(status = client.TryNextRow(&has_row)))
+      return status;
+    if (!has_row)
+      return poll_error("Missing change tracking version");
+
+    ct_now = to_version(client.GetStringCol(0));
+    int col = 1;
+    for (size_t i = 0; i < _queries.size(); i++) {
+      if (_queries[i].mode == SqlChangeMode::ChangeTracking)
+        reload[i] = client.GetInt32Col(col++) != 0;
+    }
+    while ((status = client.TryNextRow(&has_row)) && has_row) {
+    }
+    if (!status)
+      return status;
+  }
+
+  for (size_t i = 0; i < _queries.size(); i++) {
+    SqlChangeQuery& q = _queries[i];
+    if (!next_result())
+      return status;
+
+    bool rowversion = q.mode == SqlChangeMode::RowVersion;
+    int op_col = static_cast<int>(q.columns.size());
+    if ((rowversion && q.watermark == 0) || (!rowversion && reload[i]))
+      q.handler(SqlChangeOp::Reload, client);
+
+    uint64_t watermark = rowversion ? q.watermark : ct_now;
+    while ((status = client.TryNextRow(&has_row)) && has_row) {
+      if (rowversion) {
+        watermark = std::max(watermark, to_version(client.GetStringCol(op_col)));
+        q.handler(SqlChangeOp::Upsert, client);
+      } else {
+        std::string op = client.GetStringCol(op_col);
+        q.handler(op == "D" ? SqlChangeOp::Delete : SqlChangeOp::Upsert,
+            client);
+      }
+    }
+    if (!status)
+      return status;
+
+    // Everything up to here has been applied.
+    q.watermark = watermark;
+  }
+  return SqlStatus();
+}
+
+void SqlChangePoller::Start(std::chrono::milliseconds interval)
+{
+  std::lock_guard<std::mutex> locker(_mutex);
+  if (_thread.joinable())
+    return;
+
+  _stop = false;
+  _thread = std::thread(&SqlChangePoller::poller, this, interval);
+}
+
+void SqlChangePoller::Stop()
+{
+  {
+    std::lock_guard<std::mutex> locker(_mutex);
+    _stop = true;
+  }
+  _wake.notify_all();
+
+  if (_thread.joinable())
+    _thread.join();
+}
+
+void SqlChangePoller::poller(std::chrono::milliseconds interval)
+{
+  for (;;) {
+    SqlStatus status;
+    try {
+      status = Poll();
+    } catch (const SqlException& e) {
+      status = SqlStatus(e.Error());
+    } catch (const std::exception& e) {
+      status = poll_error(e.what());
+    }
+
+    if (!status) {
+      sql_log_event(SQL_LOG_ERROR, "change_poll_failed",
+          _source->Server().c_str(), _source->Database().c_str(), -1, -1,
+          "SqlChangePoller > Poll failed: %s", status.Error().text);
+    }
+
+    std::unique_lock<std::mutex> locker(_mutex);
+    if (_wake.wait_for(locker, interval, [this] { return _stop; }))
+      return;
+  }
+}
+
+} // namespace tds
@@ -15,124 +15,796 @@
  */
 
 #include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
 #include <stdexcept>
+#include <thread>
+#include <utility>
+#include <unistd.h>
 
 #include "SqlClient.h"
 #include "SqlConnection.h"
 #include "SqlConnectionFactory.h"
+#include "SqlDataSource.h"
+#include "SqlLimiter.h"
+#include "SqlProxy.h"
 
 namespace tds {
 
+static SqlProxyClient *make_proxy()
+{
+  std::string path = SqlConnectionFactory::instance().proxy_path();
+  return path.empty() ? nullptr : new SqlProxyClient(path);
+}
+
+// Clients made from strings are usually made over and over for the same
+// target, often in a loop. Each thread keeps the last source it created
+// and hands it out again while the settings match, sparing the copies.
+static std::shared_ptr<const SqlDataSource> legacy_source(
+    const std::string& user, const std::string& pass,
+    const std::string& server, const std::string& database,
+    const SqlConnectionOptions *options)
+{
+  thread_local std::shared_ptr<const SqlDataSource> last;
+  if (!last || last->Server() != server || last->Database() != database ||
+      last->User() != user || last->Pass() != pass ||
+      (options == nullptr ? last->Options() != nullptr :
+        last->Options() == nullptr || !(*last->Options() == *options))) {
+    last = SqlDataSource::Create(user, pass, server, database, options);
+  }
+  return last;
+}
+
 SqlClient::SqlClient(const std::string& user, const std::string& pass,
     const std::string& server, const std::string& database) :
-  m_user{user}, m_pass{pass}, m_server{server}, m_database{database}, m_conn{nullptr}
+  m_source{legacy_source(user, pass, server, database, nullptr)},
+  m_conn{nullptr}, m_proxy{make_proxy()}
+{
+}
+
+SqlClient::SqlClient(const std::string& user, const std::string& pass,
+    const std::string& server, const std::string& database,
+    const SqlConnectionOptions& options) :
+  m_source{legacy_source(user, pass, server, database, &options)},
+  m_conn{nullptr}, m_proxy{make_proxy()}
+{
+}
+
+SqlClient::SqlClient(std::shared_ptr<const SqlDataSource> source) :
+  m_source{std::move(source)}, m_conn{nullptr}, m_proxy{make_proxy()}
 {
 }
 
 SqlClient::~SqlClient()
 {
-  if (m_conn) {
-    m_conn->Dispose();
+  Release();
+}
+
+SqlClient::SqlClient(SqlClient&& other) noexcept :
+  m_conn{nullptr}
+{
+  take(other);
+}
+
+SqlClient& SqlClient::operator=(SqlClient&& other)
+{
+  if (this != &other) {
+    Release();
+    take(other);
+  }
+  return *this;
+}
+
+// Moves other's state, including a held connection and its slots, into
+// this client, which holds nothing.
+void SqlClient::take(SqlClient& other) noexcept
+{
+  m_source = std::move(other.m_source);
+  m_conn = std::exchange(other.m_conn, nullptr);
+  m_proxy = std::move(other.m_proxy);
+  m_timeout = other.m_timeout;
+  m_cancel = other.m_cancel;
+  m_retry = other.m_retry;
+  m_limiter = other.m_limiter;
+  m_gate = other.m_gate;
+  m_priority = other.m_priority;
+  m_slot_priority = other.m_slot_priority;
+  m_trace = std::exchange(other.m_trace, SqlTraceSpan());
+  m_capture = std::exchange(other.m_capture, SqlCaptureCall());
+}
+
+void SqlClient::Release()
+{
+  if (m_proxy) {
+    m_proxy->Dispose();
+    return;
   }
 
-  SqlConnectionFactory::instance().release(m_conn);
+  if (m_conn == nullptr)
+    return;
+
+  if (drop_inherited()) {
+    end_trace();
+    return;
+  }
+
+  // Runs from the destructor, so a failed drain drops the connection
+  // rather than throw.
+  bool drained = m_conn->TryDispose().Ok();
+  end_trace();
+
+  // Don't leak our settings to the next user of the connection.
+  m_conn->SetTimeout(std::chrono::milliseconds{0});
+  m_conn->SetCancelToken(nullptr);
+
+  if (drained)
+    SqlConnectionFactory::instance().release(m_conn);
+  else
+    SqlConnectionFactory::instance().discard(m_conn);
+  m_conn = nullptr;
+  release_slots();
+}
+
+// A connection held across fork() is the parent's, the child must not
+// read or write it. Returns true if m_conn was one and has been dropped.
+bool SqlClient::drop_inherited()
+{
+  SqlConnectionFactory& factory = SqlConnectionFactory::instance();
+  if (!factory.inherited(m_conn))
+    return false;
+
+  factory.discard(m_conn);
+  m_conn = nullptr;
+  release_slots();
+  return true;
+}
+
+void SqlClient::release_slots()
+{
+  if (m_limiter != nullptr)
+    m_limiter->Release();
+  if (m_gate != nullptr)
+    m_gate->Release(m_slot_priority);
 }
 
 void SqlClient::Connect()
 {
+  if (SqlStatus status = TryConnect(); !status)
+    throw SqlException(status.Error());
+}
+
+static SqlStatus overloaded(const char *fmt, ...)
+{
+  SqlError error;
+  error.kind = SqlErrorKind::Overloaded;
+
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(error.text, sizeof(error.text), fmt, ap);
+  va_end(ap);
+
+  snprintf(error.message, sizeof(error.message), "%s", error.text);
+  return SqlStatus(error);
+}
+
+SqlStatus SqlClient::TryConnect()
+{
+  // The daemon checks out a connection for each call.
+  if (m_proxy || (m_conn != nullptr && !drop_inherited()))
+    return SqlStatus();
+
+  m_limiter = m_source->Limiter();
+  m_gate = m_source->Gate();
+
+  // Wait our turn among the server's workload classes.
+  if (m_gate != nullptr) {
+    if (!m_gate->Acquire(m_priority)) {
+      return overloaded("SqlClient > No connection for priority class %d "
+          "to %s came free in time", static_cast<int>(m_priority),
+          m_source->Server().c_str());
+    }
+    m_slot_priority = m_priority;
+  }
+
+  // Holding a connection takes one of the server's slots, turn the call
+  // away rather than queue when there are none.
+  if (m_limiter != nullptr && !m_limiter->TryAcquire()) {
+    if (m_gate != nullptr)
+      m_gate->Release(m_slot_priority);
+    return overloaded("SqlClient > Concurrency limit of %d reached for %s",
+        m_limiter->Limit(), m_source->Server().c_str());
+  }
+
+  SqlStatus status = SqlConnectionFactory::instance().try_acquire(*m_source,
+      &m_conn);
+  if (status) {
+    m_conn->SetTimeout(m_timeout);
+    m_conn->SetCancelToken(m_cancel);
+  } else {
+    release_slots();
+  }
+  return status;
+}
+
+void SqlClient::SetTimeout(std::chrono::milliseconds timeout)
+{
+  m_timeout = timeout;
   if (m_conn != nullptr)
-    return;
+    m_conn->SetTimeout(timeout);
+}
+
+void SqlClient::SetCancelToken(const SqlCancelToken *token)
+{
+  m_cancel = token;
+  if (m_conn != nullptr)
+    m_conn->SetCancelToken(token);
+}
 
-  m_conn = SqlConnectionFactory::instance().acquire(
-      m_user, m_pass, m_server, m_database);
+// Retries are paid for out of a process wide budget that successful calls
+// top up, so a struggling server doesn't get hit with a retry storm. Units
+// are tenths of a retry.
+static constexpr int retry_budget_max = 100;
+static constexpr int retry_cost = 10;
+static std::atomic<int> g_retry_budget{retry_budget_max};
+
+static void retry_budget_earn()
+{
+  int budget = g_retry_budget.load(std::memory_order_relaxed);
+  while (budget < retry_budget_max &&
+      !g_retry_budget.compare_exchange_weak(budget, budget + 1,
+        std::memory_order_relaxed)) {
+  }
 }
 
-void SqlClient::ExecStoredProc(const char *proc, struct db_params *params, size_t parm_count)
+static bool retry_budget_spend()
 {
-  Connect();
-  m_conn->ExecStoredProc(proc, params, parm_count);
+  int budget = g_retry_budget.load(std::memory_order_relaxed);
+  while (budget >= retry_cost) {
+    if (g_retry_budget.compare_exchange_weak(budget, budget - retry_cost,
+          std::memory_order_relaxed)) {
+      return true;
+    }
+  }
+  return false;
 }
 
-void SqlClient::ExecNonQuery(const char *proc, struct db_params *params, size_t parm_count)
+// Exponential backoff with full jitter.
+static std::chrono::milliseconds retry_delay(const SqlRetryPolicy& policy,
+    int attempt)
 {
-  Connect();
-  m_conn->ExecNonQuery(proc, params, parm_count);
+  thread_local std::minstd_rand rng{std::random_device{}()};
+
+  auto ceiling = policy.base_delay.count() << std::min(attempt - 1, 16);
+  ceiling = std::min<decltype(ceiling)>(ceiling, policy.max_delay.count());
+  if (ceiling <= 0)
+    return std::chrono::milliseconds{0};
+
+  std::uniform_int_distribution<decltype(ceiling)> dist(0, ceiling);
+  return std::chrono::milliseconds{dist(rng)};
+}
+
+void SqlClient::end_trace()
+{
+  if (m_trace.Active())
+    m_trace.End(m_source->Server(), m_source->Database());
+  if (m_capture.Active())
+    m_capture.End(m_source->Server(), m_source->Database());
+}
+
+template <typename Call>
+SqlStatus SqlClient::with_retry(const char *text, bool is_proc,
+    bool returns_rows, bool idempotent, const SqlCaptureArgs& args,
+    const Call& call)
+{
+  // The previous call's results are drained by now.
+  end_trace();
+  m_trace.Begin(text, is_proc);
+  m_capture.Begin(text, is_proc, returns_rows, args);
+
+  for (int attempt = 1; ; attempt++) {
+    auto checkout_start = std::chrono::steady_clock::now();
+    SqlStatus status = TryConnect();
+    m_trace.Checkout(checkout_start);
+
+    bool sent = status.Ok();
+    if (sent)
+      status = call();
+    m_trace.Sent(status.Ok());
+
+    // Checkout wait and call latency drive the adaptive limit.
+    if (sent && m_limiter != nullptr) {
+      SqlErrorKind kind = status.Ok() ? SqlErrorKind::None : status.Error().kind;
+      m_limiter->Sample(std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - checkout_start),
+          kind == SqlErrorKind::Timeout || kind == SqlErrorKind::ConnectionLost);
+    }
+
+    if (status) {
+      if (m_retry.max_attempts > 1)
+        retry_budget_earn();
+
+      m_capture.Returned(true);
+      if (returns_rows && m_capture.Active())
+        m_capture.Result(m_conn->GetColumnCount());
+
+      // Calls with results stay open until they're disposed.
+      if (!returns_rows)
+        end_trace();
+      return status;
+    }
+
+    const SqlError& error = status.Error();
+    if (attempt >= m_retry.max_attempts || !sql_error_is_transient(error.kind) ||
+        (sent && !idempotent) || !retry_budget_spend()) {
+      m_capture.Returned(false);
+      end_trace();
+      return status;
+    }
+
+    // A dead connection is of no further use, get a fresh one next time
+    // around.
+    if (m_conn != nullptr) {
+      if (error.kind == SqlErrorKind::ConnectionLost ||
+          error.kind == SqlErrorKind::Failover) {
+        SqlConnectionFactory::instance().discard(m_conn);
+        m_conn = nullptr;
+        release_slots();
+      } else {
+        m_conn->TryDispose();
+      }
+    }
+
+    sql_log_event(SQL_LOG_INFO, "retry", m_source->Server().c_str(),
+        m_source->Database().c_str(),
+        -1, -1, "SqlClient > Retrying after transient error: %s", error.text);
+
+    std::this_thread::sleep_for(retry_delay(m_retry, attempt));
+  }
+}
+
+SqlStatus SqlClient::proxy_exec(SqlProxyOp op, const char *text,
+    SqlParamSpan params)
+{
+  return m_proxy->Exec(op, m_source->User(), m_source->Pass(),
+      m_source->Server(), m_source->Database(), text, params, m_timeout);
+}
+
+static SqlStatus proxy_unsupported(const char *what)
+{
+  SqlError error;
+  error.kind = SqlErrorKind::General;
+  snprintf(error.text, sizeof(error.text),
+      "SqlClient > %s is not supported through sql_poold", what);
+  snprintf(error.message, sizeof(error.message), "%s", error.text);
+  return SqlStatus(error);
+}
+
+static void throw_if_failed(const SqlStatus& status)
+{
+  if (!status)
+    throw SqlException(status.Error());
+}
+
+SqlStatus SqlClient::TryExecStoredProc(const char *proc,
+    struct db_params *params, size_t parm_count, bool idempotent)
+{
+  if (m_proxy)
+    return proxy_unsupported("db_params");
+  return with_retry(proc, true, true, idempotent,
+      SqlCaptureArgs{SqlParamSpan(), params, parm_count}, [&] {
+    return m_conn->TryExecStoredProc(proc, params, parm_count);
+  });
+}
+
+SqlStatus SqlClient::TryExecNonQuery(const char *proc,
+    struct db_params *params, size_t parm_count, bool idempotent)
+{
+  if (m_proxy)
+    return proxy_unsupported("db_params");
+  return with_retry(proc, true, false, idempotent,
+      SqlCaptureArgs{SqlParamSpan(), params, parm_count}, [&] {
+    return m_conn->TryExecNonQuery(proc, params, parm_count);
+  });
+}
+
+SqlStatus SqlClient::TryExecStoredProc(const char *proc,
+    SqlParamSpan params, bool idempotent)
+{
+  if (m_proxy)
+    return proxy_exec(SqlProxyOp::ExecStoredProc, proc, params);
+  return with_retry(proc, true, true, idempotent,
+      SqlCaptureArgs{params}, [&] {
+    return m_conn->TryExecStoredProc(proc, params);
+  });
+}
+
+SqlStatus SqlClient::TryExecNonQuery(const char *proc,
+    SqlParamSpan params, bool idempotent)
+{
+  if (m_proxy)
+    return proxy_exec(SqlProxyOp::ExecNonQuery, proc, params);
+  return with_retry(proc, true, false, idempotent,
+      SqlCaptureArgs{params}, [&] {
+    return m_conn->TryExecNonQuery(proc, params);
+  });
+}
+
+SqlStatus SqlClient::TryExecSql(const char *sql, bool idempotent)
+{
+  if (m_proxy)
+    return proxy_exec(SqlProxyOp::ExecSql, sql, SqlParamSpan());
+  return with_retry(sql, false, true, idempotent,
+      SqlCaptureArgs(), [&] {
+    return m_conn->TryExecSql(sql);
+  });
+}
+
+SqlStatus SqlClient::TryExecDML(const char *dml, bool idempotent)
+{
+  if (m_proxy)
+    return proxy_exec(SqlProxyOp::ExecDML, dml, SqlParamSpan());
+  return with_retry(dml, false, false, idempotent,
+      SqlCaptureArgs(), [&] {
+    return m_conn->TryExecDML(dml);
+  });
+}
+
+void SqlClient::ExecStoredProc(const char *proc, struct db_params *params,
+    size_t parm_count, bool idempotent)
+{
+  throw_if_failed(TryExecStoredProc(proc, params, parm_count, idempotent));
+}
+
+void SqlClient::ExecNonQuery(const char *proc, struct db_params *params,
+    size_t parm_count, bool idempotent)
+{
+  throw_if_failed(TryExecNonQuery(proc, params, parm_count, idempotent));
 }
 
 void SqlClient::ExecStoredProc(const char *proc,
-    const std::vector<db_param>& params)
+    SqlParamSpan params, bool idempotent)
 {
-  Connect();
-  m_conn->ExecStoredProc(proc, params);
+  throw_if_failed(TryExecStoredProc(proc, params, idempotent));
 }
 
 void SqlClient::ExecNonQuery(const char *proc,
-    const std::vector<db_param>& params)
+    SqlParamSpan params, bool idempotent)
 {
-  Connect();
-  m_conn->ExecNonQuery(proc, params);
+  throw_if_failed(TryExecNonQuery(proc, params, idempotent));
 }
 
 void SqlClient::Dispose()
 {
-  m_conn->Dispose();
+  if (m_proxy) {
+    m_proxy->Dispose();
+    return;
+  }
+  // Nothing to do once Release or a discarded retry gave up the connection.
+  if (m_conn != nullptr)
+    m_conn->Dispose();
+  end_trace();
 }
 
-void SqlClient::ExecSql(const char *sql)
+void SqlClient::ExecSql(const char *sql, bool idempotent)
 {
-  Connect();
-  m_conn->ExecSql(sql);
+  throw_if_failed(TryExecSql(sql, idempotent));
 }
 
-void SqlClient::ExecDML(const char *dml)
+void SqlClient::ExecDML(const char *dml, bool idempotent)
 {
-  Connect();
-  m_conn->ExecDML(dml);
+  throw_if_failed(TryExecDML(dml, idempotent));
 }
 
 bool SqlClient::NextRow()
 {
-  return m_conn->NextRow();
+  if (m_proxy)
+    return m_proxy->NextRow();
+
+  if (m_conn == nullptr)
+    return false;
+  if (!m_conn->NextRow()) {
+    m_capture.RowsDone();
+    return false;
+  }
+
+  m_trace.Row();
+  m_capture.Row();
+  return true;
 }
 
 bool SqlClient::NextResult()
 {
-  return m_conn->NextResult();
+  if (m_proxy)
+    return m_proxy->NextResult();
+
+  // The last result set is done with, so is the call. Don't let the
+  // caller's idle time until Dispose count against it.
+  if (m_conn == nullptr || !m_conn->NextResult()) {
+    m_capture.Complete();
+    end_trace();
+    return false;
+  }
+
+  if (m_capture.Active())
+    m_capture.Result(m_conn->GetColumnCount());
+  return true;
+}
+
+SqlStatus SqlClient::TryNextRow(bool *has_row)
+{
+  if (m_proxy) {
+    *has_row = m_proxy->NextRow();
+    return SqlStatus();
+  }
+
+  if (m_conn == nullptr) {
+    *has_row = false;
+    return SqlStatus();
+  }
+
+  SqlStatus status = m_conn->TryNextRow(has_row);
+  if (*has_row) {
+    m_trace.Row();
+    m_capture.Row();
+  } else if (status) {
+    m_capture.RowsDone();
+  }
+  return status;
+}
+
+SqlStatus SqlClient::TryNextResult(bool *more)
+{
+  if (m_proxy) {
+    *more = m_proxy->NextResult();
+    return SqlStatus();
+  }
+
+  if (m_conn == nullptr) {
+    *more = false;
+    end_trace();
+    return SqlStatus();
+  }
+
+  SqlStatus status = m_conn->TryNextResult(more);
+  if (!*more) {
+    if (status)
+      m_capture.Complete();
+    end_trace();
+  }
+  else if (m_capture.Active())
+    m_capture.Result(m_conn->GetColumnCount());
+  return status;
+}
+
+// The connection holding the current results. Reading a column after
+// Release is a caller error, but it shouldn't crash.
+SqlConnection& SqlClient::results()
+{
+  if (m_conn == nullptr)
+    throw std::runtime_error("SqlClient > No results, the connection was released");
+  return *m_conn;
+}
+
+// Proxied values are text, this is the current row's copy of one.
+static std::string proxy_text(const SqlProxyClient& proxy, int col)
+{
+  int len;
+  const char *data = proxy.GetColumnData(col, &len);
+  return data != nullptr ? std::string(data, len) : std::string();
 }
 
 std::string SqlClient::GetStringCol(int col)
 {
-  return m_conn->GetStringCol(col);
+  if (m_proxy)
+    return proxy_text(*m_proxy, col);
+  return results().GetStringCol(col);
+}
+
+std::pmr::string SqlClient::GetStringCol(int col, std::pmr::memory_resource *mr)
+{
+  if (m_proxy) {
+    int len;
+    const char *data = m_proxy->GetColumnData(col, &len);
+    return data != nullptr ? std::pmr::string(data, len, mr) :
+      std::pmr::string(mr);
+  }
+  return results().GetStringCol(col, mr);
 }
 
 std::string SqlClient::GetStringColByName(const char *colName)
 {
-  return m_conn->GetStringColByName(colName);
+  if (m_proxy)
+    return proxy_text(*m_proxy, m_proxy->GetOrdinal(colName));
+  return results().GetStringColByName(colName);
 }
 
 int SqlClient::GetInt32Col(int col)
 {
-  return m_conn->GetInt32Col(col);
+  if (m_proxy)
+    return static_cast<int>(strtol(proxy_text(*m_proxy, col).c_str(), nullptr, 10));
+  return results().GetInt32Col(col);
 }
 
 int SqlClient::GetInt32ColByName(const char *colName)
 {
-  return m_conn->GetInt32ColByName(colName);
+  if (m_proxy)
+    return GetInt32Col(m_proxy->GetOrdinal(colName));
+  return results().GetInt32ColByName(colName);
 }
 
 int SqlClient::GetMoneyCol(int col, int *dol_out, int *cen_out)
 {
-  return m_conn->GetMoneyCol(col, dol_out, cen_out);
+  if (m_proxy) {
+    // Money converts to text as eg "-12.34". Match the direct path: whole
+    // units keep the sign, the fraction is in ten-thousandths and never
+    // negative.
+    std::string text = proxy_text(*m_proxy, col);
+    if (text.empty())
+      return 0;
+
+    char *end;
+    *dol_out = static_cast<int>(strtol(text.c_str(), &end, 10));
+    int cen = 0;
+    int digits = 0;
+    if (*end == '.') {
+      const char *p = end + 1;
+      while (digits < 4 && isdigit(static_cast<unsigned char>(*p))) {
+        cen = cen * 10 + (*p++ - '0');
+        digits++;
+      }
+    }
+    for (; digits < 4; digits++)
+      cen *= 10;
+    *cen_out = cen;
+    return 1;
+  }
+  return results().GetMoneyCol(col, dol_out, cen_out);
 }
 
 bool SqlClient::IsNullCol(int col)
 {
-  return m_conn->IsNullCol(col);
+  if (m_proxy) {
+    int len;
+    return m_proxy->GetColumnData(col, &len) == nullptr;
+  }
+  return results().IsNullCol(col);
+}
+
+int SqlClient::GetColumnCount()
+{
+  if (m_proxy)
+    return m_proxy->GetColumnCount();
+  return results().GetColumnCount();
+}
+
+int SqlClient::GetColumnType(int col)
+{
+  if (m_proxy)
+    return SYBCHAR;
+  return results().GetColumnType(col);
+}
+
+const unsigned char *SqlClient::GetColumnData(int col, int *len)
+{
+  if (m_proxy) {
+    return reinterpret_cast<const unsigned char *>(
+        m_proxy->GetColumnData(col, len));
+  }
+  return results().GetColumnData(col, len);
+}
+
+int SqlClient::ConvertColToText(int col, char *buf, int size)
+{
+  if (m_proxy) {
+    int len;
+    const char *data = m_proxy->GetColumnData(col, &len);
+    if (data == nullptr)
+      len = 0;
+    if (len >= size)
+      return -1;
+    memcpy(buf, data, len);
+    buf[len] = '\0';
+    return len;
+  }
+  return results().ConvertColToText(col, buf, size);
+}
+
+int SqlClient::GetUtf8Col(int col, char *buf, int size)
+{
+  if (m_proxy) {
+    int len;
+    const char *data = m_proxy->GetColumnData(col, &len);
+    if (data == nullptr)
+      return 0;
+    if (len > size)
+      return -1;
+    memcpy(buf, data, len);
+    return len;
+  }
+  return results().GetUtf8Col(col, buf, size);
+}
+
+bool SqlClient::StreamCol(int col,
+    const std::function<bool(const char *, size_t)>& sink, size_t chunk_size)
+{
+  if (m_proxy) {
+    int len;
+    const char *data = m_proxy->GetColumnData(col, &len);
+    size_t remaining = len > 0 ? static_cast<size_t>(len) : 0;
+    if (chunk_size == 0)
+      chunk_size = remaining;
+    while (remaining > 0) {
+      size_t n = std::min(remaining, chunk_size);
+      if (!sink(data, n))
+        return false;
+      data += n;
+      remaining -= n;
+    }
+    return true;
+  }
+  return results().StreamCol(col, sink, chunk_size);
+}
+
+void SqlClient::WriteColToFd(int col, int fd)
+{
+  if (m_proxy) {
+    StreamCol(col, [fd](const char *data, size_t len) {
+      while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR)
+          continue;
+        if (n < 0)
+          throw std::runtime_error("SqlClient > Failed to write column");
+        data += n;
+        len -= static_cast<size_t>(n);
+      }
+      return true;
+    });
+    return;
+  }
+  results().WriteColToFd(col, fd);
+}
+
+int SqlClient::ReadText(void *buf, int size)
+{
+  if (m_proxy)
+    throw std::runtime_error("SqlClient > ReadText is not supported through sql_poold");
+  return results().ReadText(buf, size);
+}
+
+void SqlClient::SetTextSize(int bytes)
+{
+  if (m_proxy)
+    throw std::runtime_error("SqlClient > SetTextSize is not supported through sql_poold");
+  Connect();
+  m_conn->SetTextSize(bytes);
 }
 
 std::vector<std::string> SqlClient::GetAllColumnNames()
 {
-  return m_conn->GetAllColumnNames();
+  if (m_proxy)
+    return m_proxy->GetAllColumnNames();
+  return results().GetAllColumnNames();
+}
+
+std::pmr::vector<std::pmr::string> SqlClient::GetAllColumnNames(
+    std::pmr::memory_resource *mr)
+{
+  if (m_proxy) {
+    const std::vector<std::string>& names = m_proxy->GetAllColumnNames();
+    std::pmr::vector<std::pmr::string> columns(mr);
+    columns.reserve(names.size());
+    for (const auto& name : names)
+      columns.emplace_back(name);
+    return columns;
+  }
+  return results().GetAllColumnNames(mr);
 }
 
 }
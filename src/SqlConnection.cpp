@@ -15,20 +15,26 @@
  */
 
 #include <algorithm> // std::replace
+#include <cerrno>
+#include <cstdarg>
+#include <cstdio>
 #include <cstring>
 #include <stdexcept>
 
+#include <fcntl.h>
+#include <unistd.h>
+
 // FreeTDS stuff
 #define MSDBLIB 1
 #include <sqlfront.h>
 #include <sybdb.h>
 
+#include "SqlCapture.h"
 #include "SqlConnection.h"
+#include "SqlUnicode.h"
 
 namespace tds {
 
-static void (*g_log_func)(int level, const char *msg) = nullptr;
-
 // Sadly, FreeTDS does not seem to check the return value of this message
 // handler.
 extern "C" int
@@ -48,9 +54,31 @@ sql_db_msg_handler(DBPROCESS * dbproc, DBINT msgno, int msgstate,
   return 0;
 }
 
+// Appends to a fixed size buffer, quietly truncating once it is full.
+static void append(char *buf, size_t size, const char *fmt, ...)
+{
+  size_t len = strlen(buf);
+  if (len + 1 >= size)
+    return;
+
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(buf + len, size - len, fmt, ap);
+  va_end(ap);
+}
+
+template <size_t N>
+static void copy_str(char (&dst)[N], const char *src)
+{
+  snprintf(dst, N, "%s", src != nullptr ? src : "");
+}
+
 int SqlConnection::MsgHandler(DBPROCESS * dbproc, DBINT msgno, int msgstate,
     int severity, char *msgtext, char *srvname, char *procname, int line)
 {
+  char *text = _last_error.text;
+  size_t size = sizeof(_last_error.text);
+
   /*
    * If the severity is something other than 0 or the msg number is
    * 0 (user informational messages).
@@ -62,42 +90,32 @@ int SqlConnection::MsgHandler(DBPROCESS * dbproc, DBINT msgno, int msgstate,
      * stderr with a little pre-amble information.
      */
     if (msgno > 0 && severity > 0) {
-      _error.clear();
-
-      // Incorporate format?
-      _error += "Msg ";
-      _error += std::to_string(msgno);
-      _error += ", Level ";
-      _error += std::to_string(severity);
-      _error += ", State ";
-      _error += std::to_string(msgstate);
-      _error += "\nServer '";
-      _error += srvname;
-      _error += "'";
-
-      if (procname != nullptr && *procname != '\0') {
-        _error += ", Procedure '";
-        _error += procname;
-        _error += "'";
-      }
-      if (line > 0) {
-        _error += ", Line ";
-        _error += std::to_string(line);
-      }
-      _error += "\n";
-      if (char const *database = dbname(dbproc); database != nullptr && *database != '\0') {
-        _error += "Database '";
-        _error += database;
-        _error += "'\n";
-      }
-      _error += msgtext;
+      _last_error.Clear();
+      _last_error.msgno = msgno;
+      _last_error.severity = severity;
+      _last_error.state = msgstate;
+      _last_error.line = line;
+      _last_error.kind = sql_classify_error(msgno);
+      copy_str(_last_error.server, srvname);
+      copy_str(_last_error.proc, procname);
+      copy_str(_last_error.message, msgtext);
+
+      append(text, size, "Msg %d, Level %d, State %d\nServer '%s'", msgno,
+          severity, msgstate, srvname != nullptr ? srvname : "");
+
+      if (procname != nullptr && *procname != '\0')
+        append(text, size, ", Procedure '%s'", procname);
+      if (line > 0)
+        append(text, size, ", Line %d", line);
+      append(text, size, "\n");
+      if (char const *database = dbname(dbproc); database != nullptr && *database != '\0')
+        append(text, size, "Database '%s'\n", database);
+      append(text, size, "%s", msgtext);
     } else {
+      if (size_t len = strlen(text); len > 0 && text[len - 1] != '\n')
+        append(text, size, "\n");
 
-      if (_error.back() != '\n') {
-        _error.append(1, '\n');
-      }
-
-      _error += msgtext;
+      append(text, size, "%s", msgtext);
       if (msgno == 3621) {
         severity = 1;
       } else {
@@ -108,25 +126,24 @@ int SqlConnection::MsgHandler(DBPROCESS * dbproc, DBINT msgno, int msgstate,
 
   if (msgno == 904) {
     /* Database cannot be autostarted during server shutdown or startup */
-    _error += "Database does not exist, returning 0.\n";
+    append(text, size, "Database does not exist, returning 0.\n");
     return 0;
   }
 
   if (msgno == 911) {
     /* Database does not exist */
-    _error += "Database does not exist, returning 0.\n";
+    append(text, size, "Database does not exist, returning 0.\n");
     return 0;
   }
 
   if (msgno == 952) {
     /* Database is in transition. */
-    _error += "Database is in transition, returning 0.\n";
+    append(text, size, "Database is in transition, returning 0.\n");
     return 0;
   }
 
   return severity > 0;
 }
-
 extern "C" int
 sql_db_err_handler(DBPROCESS *dbproc, int severity, int dberr,
     int oserr, char *dberrstr, char *oserrstr)
@@ -136,11 +153,19 @@ sql_db_err_handler(DBPROCESS *dbproc, int severity, int dberr,
   return INT_CANCEL;
 }
 
-void sql_log(int level, const char *msg)
+// Polled by FreeTDS (about once a second) while it waits on the server.
+extern "C" int
+sql_db_chkintr(void *dbproc)
 {
-  if (g_log_func != nullptr) {
-    g_log_func(level, msg);
-  }
+  auto *conn = reinterpret_cast<SqlConnection *>(
+      dbgetuserdata(static_cast<DBPROCESS *>(dbproc)));
+  return conn != nullptr && conn->Interrupted();
+}
+
+extern "C" int
+sql_db_hndlintr(void *dbproc)
+{
+  return INT_CANCEL;
 }
 
 // FreeTDS DBLib requires some initialization.
@@ -152,11 +177,13 @@ void sql_startup(void (*log_func)(int, const char *))
   dberrhandle(sql_db_err_handler);
 
   dbsetlogintime(5);
-  g_log_func = log_func;
+  sql_log_set_func(log_func);
 }
 
 void sql_shutdown()
 {
+  sql_log_stop_async();
+  sql_capture_stop();
   dbexit();
 }
 
@@ -165,39 +192,209 @@ SqlConnection::~SqlConnection()
   Disconnect();
 }
 
+// Heterogeneous queries require the ANSI_NULLS and ANSI_WARNINGS options to
+// be set for the connection.
+static const char session_options[] =
+  "SET ANSI_NULLS, ANSI_NULL_DFLT_ON, ANSI_PADDING, ANSI_WARNINGS,"
+  " QUOTED_IDENTIFIER, CONCAT_NULL_YIELDS_NULL ON;";
+
+static BYTE tds_version(TdsVersion version)
+{
+  switch (version) {
+  case TdsVersion::V70:
+    return DBVERSION_70;
+  case TdsVersion::V71:
+    return DBVERSION_71;
+  case TdsVersion::V73:
+    return DBVERSION_73;
+  case TdsVersion::V74:
+    return DBVERSION_74;
+  case TdsVersion::V72:
+  default:
+    return DBVERSION_72;
+  }
+}
+
 void SqlConnection::Connect()
+{
+  if (!try_connect())
+    throw_last();
+}
+
+SqlStatus SqlConnection::TryConnect()
+{
+  if (!try_connect())
+    return SqlStatus(_last_error);
+  return SqlStatus();
+}
+
+bool SqlConnection::try_connect()
 {
   if (_dbHandle == nullptr || dbdead(_dbHandle)) {
     LOGINREC *login = dblogin();
     DBSETLAPP(login, "Microsoft");
-    dbsetlversion(login, DBVERSION_72);
+    dbsetlversion(login, tds_version(_options.tds_version));
     DBSETLUSER(login, _user.c_str());
     DBSETLPWD(login, _pass.c_str());
+    if (!_database.empty())
+      DBSETLDBNAME(login, _database.c_str());
+    if (_options.packet_size > 0)
+      DBSETLPACKET(login, _options.packet_size);
+    if (_options.encrypt)
+      DBSETLENCRYPT(login, 1);
+    if (!_options.charset.empty())
+      DBSETLCHARSET(login, _options.charset.c_str());
     _dbHandle = tdsdbopen(login, fix_server(_server).c_str(), 1);
     dbloginfree(login);
 
-    if (_dbHandle == nullptr || dbdead(_dbHandle))
-      throw std::runtime_error("Failed to connect to SQL Server");
+    if (_dbHandle == nullptr || dbdead(_dbHandle)) {
+      _last_error.Clear();
+      return fail("Failed to connect to SQL Server");
+    }
 
     // FreeTDS is so gross. Yep, instead of a void *, it's a BYTE * which
     // is an "unsigned char *"
     dbsetuserdata(_dbHandle, reinterpret_cast<BYTE *>(this));
+    dbsetinterrupt(_dbHandle, sql_db_chkintr, sql_db_hndlintr);
+
+    if (_options.row_buffer > 0) {
+      char buf[16];
+      snprintf(buf, sizeof(buf), "%d", _options.row_buffer);
+      dbsetopt(_dbHandle, DBBUFFER, buf, 0);
+    }
 
-    dbuse(_dbHandle, _database.c_str());
-    run_initial_query();
+    // The login record normally lands us in the right database already.
+    if (!_database.empty() && !in_database(_database))
+      dbuse(_dbHandle, _database.c_str());
+
+    // The session options go out ahead of the first call, connections
+    // that are never used don't pay for them.
+    _session_pending = true;
+  }
+  return true;
+}
+
+bool SqlConnection::in_database(const std::string& db)
+{
+  const char *current = dbname(_dbHandle);
+  return current != nullptr && db == current;
+}
+
+bool SqlConnection::run_initial_query()
+{
+  if (!_session_pending)
+    return true;
+
+  // A batch of their own, spliced into the caller's SQL they would break
+  // batches that must start with CREATE PROCEDURE and the like.
+  begin_call();
+  _fetched_rows = false;
+  _fetched_results = false;
+  if (dbcmd(_dbHandle, session_options) == FAIL)
+    return fail("Failed to submit command to freetds");
+
+  if (dbsqlexec(_dbHandle) == FAIL)
+    return fail("Failed to set session options");
+
+  if (!dispose())
+    return false;
+  _session_pending = false;
+  return true;
+}
+
+bool SqlConnection::Interrupted()
+{
+  if (!_armed)
+    return false;
+
+  if ((_cancel != nullptr && _cancel->IsCancelled()) ||
+      (_timeout.count() > 0 && std::chrono::steady_clock::now() >= _deadline)) {
+    _interrupted = true;
   }
+  return _interrupted;
+}
+
+// Starts the clock on a new call.
+void SqlConnection::begin_call()
+{
+  _interrupted = false;
+  _armed = _timeout.count() > 0 || _cancel != nullptr;
+
+  // The deadline is only enforced through sql_db_chkintr. DBSETTIME is no
+  // help here, it sets the session's LOCK_TIMEOUT rather than a client
+  // timer, and that would outlive the call on a pooled connection.
+  if (_timeout.count() > 0)
+    _deadline = std::chrono::steady_clock::now() + _timeout;
 }
 
-void SqlConnection::run_initial_query()
+// Disposes of the previous call's results (if any) and makes sure the
+// connection is open. The drain gets a deadline of its own rather than
+// what is left of the previous call's, and it comes first because a drain
+// that runs out of time drops the connection.
+bool SqlConnection::prepare_call()
 {
-  // Heterogeneous queries require the ANSI_NULLS and ANSI_WARNINGS options to
-  // be set for the connection.
-  ExecDML("SET ANSI_NULLS ON;"
-      "SET ANSI_NULL_DFLT_ON ON;"
-      "SET ANSI_PADDING ON;"
-      "SET ANSI_WARNINGS ON;"
-      "SET QUOTED_IDENTIFIER ON;"
-      "SET CONCAT_NULL_YIELDS_NULL ON;");
+  if (!_fetched_results && _dbHandle != nullptr && !dbdead(_dbHandle))
+    begin_call();
+  return dispose() && try_connect();
+}
+
+// If the last DB-Library failure was caused by a timeout or cancellation,
+// bring the connection back to a usable state and record why.
+bool SqlConnection::interrupted()
+{
+  if (!_interrupted || !_armed)
+    return false;
+
+  _armed = false;
+  _fetched_rows = true;
+  _fetched_results = true;
+
+  // Throw away whatever the server still has queued for us. If that
+  // doesn't work the connection is dropped and reopened on next use.
+  if (dbdead(_dbHandle) || dbcancel(_dbHandle) == FAIL)
+    Disconnect();
+
+  _last_error.Clear();
+  if (_cancel != nullptr && _cancel->IsCancelled()) {
+    _last_error.kind = SqlErrorKind::Cancelled;
+    copy_str(_last_error.text, "Query was cancelled");
+  } else {
+    _last_error.kind = SqlErrorKind::Timeout;
+    copy_str(_last_error.text, "Query timed out");
+  }
+  copy_str(_last_error.message, _last_error.text);
+  copy_str(_last_error.server, _server.c_str());
+  return true;
+}
+
+// Records why a call failed and returns false. Whatever the server had to
+// say about it takes precedence over the generic description.
+bool SqlConnection::fail(const char *fmt, ...)
+{
+  interrupted();
+
+  if (_last_error.text[0] == '\0') {
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(_last_error.text, sizeof(_last_error.text), fmt, ap);
+    va_end(ap);
+    copy_str(_last_error.message, _last_error.text);
+    copy_str(_last_error.server, _server.c_str());
+  }
+
+  if (_last_error.kind == SqlErrorKind::None ||
+      _last_error.kind == SqlErrorKind::General) {
+    if (_dbHandle == nullptr || dbdead(_dbHandle))
+      _last_error.kind = SqlErrorKind::ConnectionLost;
+    else
+      _last_error.kind = SqlErrorKind::General;
+  }
+  return false;
+}
+
+void SqlConnection::throw_last()
+{
+  throw SqlException(_last_error);
 }
 
 void SqlConnection::Disconnect()
@@ -208,114 +405,221 @@ void SqlConnection::Disconnect()
   }
 }
 
+void SqlConnection::Abandon()
+{
+  if (_dbHandle == nullptr)
+    return;
+
+  // Closing the descriptor outright would let a later open() reuse the
+  // number while FreeTDS still thinks it owns it.
+  int fd = dbiordesc(_dbHandle);
+  int devnull = open("/dev/null", O_RDWR | O_CLOEXEC);
+  if (fd >= 0 && devnull >= 0)
+    dup3(devnull, fd, O_CLOEXEC);
+  if (devnull >= 0)
+    close(devnull);
+  _dbHandle = nullptr;
+}
+
 void SqlConnection::Dispose()
 {
-  // We're done, so clear our error state.
-  _error.clear();
+  if (!dispose())
+    throw_last();
+}
 
-  // Did we already fetch all result sets?
-  if (_fetched_results)
-    return;
+SqlStatus SqlConnection::TryDispose()
+{
+  if (!dispose())
+    return SqlStatus(_last_error);
+  return SqlStatus();
+}
 
-  // If the current result set has rows, drain them.
-  if (!_fetched_rows) {
-    while (NextRow());
-  }
+bool SqlConnection::dispose()
+{
+  // Did we already fetch all result sets? If not, drain them. Draining
+  // that runs out of time has already reset the connection, which is all
+  // we were after anyway. A dead connection has nothing left to drain.
+  if (_dbHandle == nullptr || dbdead(_dbHandle))
+    _fetched_results = true;
 
-  // While there are more results, drain those rows as well.
-  while (NextResult()) {
-    while (NextRow());
+  if (!_fetched_results) {
+    int res;
+    while ((res = next_result()) > 0);
+    if (res < 0 && !_interrupted)
+      return false;
+    _fetched_results = true;
   }
-  _fetched_results = true;
+
+  // We're done, so clear our error state.
+  _last_error.Clear();
+  return true;
 }
 
 void SqlConnection::ExecDML(const char *sql)
 {
-  Connect();
+  if (!exec_dml(sql))
+    throw_last();
+}
 
-  // Dispose of any previous result set (if any).
-  Dispose();
+SqlStatus SqlConnection::TryExecDML(const char *sql)
+{
+  if (!exec_dml(sql))
+    return SqlStatus(_last_error);
+  return SqlStatus();
+}
 
+bool SqlConnection::exec_dml(const char *sql)
+{
+  if (!prepare_call() || !run_initial_query())
+    return false;
+
+  begin_call();
   _fetched_rows = false;
   _fetched_results = false;
+
   if (dbcmd(_dbHandle, sql) == FAIL)
-    throw std::runtime_error("Failed to submit command to freetds");
+    return fail("Failed to submit command to freetds");
 
   if (dbsqlexec(_dbHandle) == FAIL)
-    throw std::runtime_error("Failed to execute DML");
+    return fail("Failed to execute DML");
 
-  Dispose();
+  return dispose();
 }
 
-
 bool SqlConnection::NextResult()
+{
+  int res = next_result();
+  if (res < 0)
+    throw_last();
+  return res > 0;
+}
+
+SqlStatus SqlConnection::TryNextResult(bool *more)
+{
+  int res = next_result();
+  *more = res > 0;
+  if (res < 0)
+    return SqlStatus(_last_error);
+  return SqlStatus();
+}
+
+// Returns 1 when positioned on a new result set, 0 when there are no more
+// and -1 on failure.
+int SqlConnection::next_result()
 {
   // In order to advance to the next result set, we need to fetch
   // all rows.
   if (!_fetched_rows) {
-    while (NextRow());
+    int res;
+    while ((res = fetch_row()) > 0);
+    if (res < 0)
+      return -1;
   }
 
   int res = dbresults(_dbHandle);
-  if (res == FAIL)
-    throw std::runtime_error("Failed to fetch next result");
+  if (res == FAIL) {
+    fail("Failed to fetch next result");
+    return -1;
+  }
 
   if (res == NO_MORE_RESULTS) {
     _fetched_results = true;
-    return false;
+    return 0;
   }
 
-  return true;
+  // The new result set's rows haven't been read yet. Without this a
+  // Dispose after NextResult skipped them and left the connection with
+  // rows pending, as the baseline did.
+  _fetched_rows = false;
+  return 1;
 }
 
 bool SqlConnection::NextRow()
+{
+  int res = fetch_row();
+
+  // A plain DB-Library failure has always just ended the rows, but a
+  // caller must find out that it didn't get all of them because of a
+  // timeout.
+  if (res < 0 && (_last_error.kind == SqlErrorKind::Timeout ||
+        _last_error.kind == SqlErrorKind::Cancelled)) {
+    throw_last();
+  }
+  return res > 0;
+}
+
+SqlStatus SqlConnection::TryNextRow(bool *has_row)
+{
+  int res = fetch_row();
+  *has_row = res > 0;
+  if (res < 0)
+    return SqlStatus(_last_error);
+  return SqlStatus();
+}
+
+// Returns 1 when positioned on a new row, 0 at the end of the result set
+// and -1 on failure.
+int SqlConnection::fetch_row()
 {
   int row_code;
   do {
     row_code = dbnextrow(_dbHandle);
     if (row_code == NO_MORE_ROWS) {
       _fetched_rows = true;
-      return false;
+      return 0;
     }
 
     if (row_code == REG_ROW)
-      return true;
+      return 1;
 
     if (row_code == FAIL) {
-      // ERROR ??
-      return false;
+      fail("Failed to fetch row");
+      return -1;
     }
+
+    // Row buffering is on and the buffer is full. We never go back to
+    // earlier rows, so make room for more.
+    if (row_code == BUF_FULL)
+      dbclrbuf(_dbHandle, _options.row_buffer);
   } while (row_code == BUF_FULL);
 
-  return false;
+  return 0;
 }
 
 void SqlConnection::ExecSql(const char *sql)
 {
-  Connect();
+  if (!exec_sql(sql))
+    throw_last();
+}
 
-  // Dispose of any previous result set (if any).
-  Dispose();
+SqlStatus SqlConnection::TryExecSql(const char *sql)
+{
+  if (!exec_sql(sql))
+    return SqlStatus(_last_error);
+  return SqlStatus();
+}
 
+bool SqlConnection::exec_sql(const char *sql)
+{
+  if (!prepare_call() || !run_initial_query())
+    return false;
+
+  begin_call();
   _fetched_rows = false;
   _fetched_results = false;
   if (dbcmd(_dbHandle, sql) == FAIL)
-    throw std::runtime_error("Failed to submit command to freetds");
+    return fail("Failed to submit command to freetds");
 
-  if (dbsqlexec(_dbHandle) == FAIL) {
-    if (!_error.empty()) {
-      throw std::runtime_error(_error);
-    } else {
-      throw std::runtime_error("Failed to execute SQL");
-    }
-  }
+  if (dbsqlexec(_dbHandle) == FAIL)
+    return fail("Failed to execute SQL");
 
   int res = dbresults(_dbHandle);
   if (res == FAIL)
-    throw std::runtime_error("Failed to fetch results SQL");
+    return fail("Failed to fetch results SQL");
 
   if (res == NO_MORE_RESULTS)
     _fetched_results = true;
+  return true;
 }
 
 int
@@ -339,8 +643,10 @@ SqlConnection::GetOrdinal(const char *colName)
   return i;
 }
 
-std::string
-SqlConnection::GetStringCol(int col)
+// Character data straight from the row buffer, anything else converted
+// into buf.
+std::string_view
+SqlConnection::string_col(int col, char *buf, int size)
 {
   if (col > dbnumcols(_dbHandle))
     throw std::runtime_error("Requested string on nonexistent column");
@@ -348,32 +654,28 @@ SqlConnection::GetStringCol(int col)
   int coltype = dbcoltype(_dbHandle, col + 1);
   DBINT srclen = dbdatlen(_dbHandle, col + 1);
 
-  if (coltype == SYBDATETIME) {
-    DBDATETIME data;
-    DBDATEREC output;
-    char date_string[64];
-
-    memcpy(&data, dbdata(_dbHandle, col + 1), srclen);
-    dbdatecrack(_dbHandle, &output, &data);
-    snprintf(date_string, sizeof(date_string),
-        "%04d-%02d-%02d %02d:%02d:%02d.%03d", output.year, output.month,
-        output.day, output.hour, output.minute, output.second,
-        output.millisecond);
-
-    return date_string;
-  } else if (coltype != SYBCHAR && coltype != SYBTEXT) {
-    char nonstr[4096];
-    int dest_size;
-
-    dest_size = dbconvert(_dbHandle, coltype, dbdata(_dbHandle, col + 1),
-        srclen, SYBCHAR, (BYTE *)nonstr, sizeof(nonstr));
+  if (coltype != SYBCHAR && coltype != SYBTEXT) {
+    int dest_size = ConvertColToText(col, buf, size);
     if (dest_size == -1) {
       throw std::runtime_error("Could not convert source to string.");
     }
-    nonstr[dest_size] = '\0';
-    return nonstr;
+    return std::string_view(buf, dest_size);
   }
-  return std::string((const char *)dbdata(_dbHandle, col + 1), srclen);
+  return std::string_view((const char *)dbdata(_dbHandle, col + 1), srclen);
+}
+
+std::string
+SqlConnection::GetStringCol(int col)
+{
+  char nonstr[4096];
+  return std::string(string_col(col, nonstr, sizeof(nonstr)));
+}
+
+std::pmr::string
+SqlConnection::GetStringCol(int col, std::pmr::memory_resource *mr)
+{
+  char nonstr[4096];
+  return std::pmr::string(string_col(col, nonstr, sizeof(nonstr)), mr);
 }
 
 std::string
@@ -442,48 +744,236 @@ SqlConnection::IsNullCol(int col)
   if (col > dbnumcols(_dbHandle))
     return true;
 
+  // An empty string has a length of 0 too, only NULL has no data.
+  return dbdata(_dbHandle, col + 1) == nullptr;
+}
+
+int
+SqlConnection::GetColumnCount()
+{
+  return dbnumcols(_dbHandle);
+}
+
+int
+SqlConnection::GetColumnType(int col)
+{
+  return dbcoltype(_dbHandle, col + 1);
+}
+
+const unsigned char *
+SqlConnection::GetColumnData(int col, int *len)
+{
+  BYTE *data = dbdata(_dbHandle, col + 1);
+  DBINT srclen = data != nullptr ? dbdatlen(_dbHandle, col + 1) : 0;
+  *len = srclen > 0 ? srclen : 0;
+  return data;
+}
+
+int
+SqlConnection::ConvertColToText(int col, char *buf, int size)
+{
+  int coltype = dbcoltype(_dbHandle, col + 1);
+  DBINT srclen = dbdatlen(_dbHandle, col + 1);
+  if (srclen <= 0)
+    return 0;
+
+  if (coltype == SYBDATETIME) {
+    DBDATETIME data;
+    DBDATEREC output;
+
+    memcpy(&data, dbdata(_dbHandle, col + 1), srclen);
+    dbdatecrack(_dbHandle, &output, &data);
+    int n = snprintf(buf, size, "%04d-%02d-%02d %02d:%02d:%02d.%03d",
+        output.year, output.month, output.day, output.hour, output.minute,
+        output.second, output.millisecond);
+    return n < size ? n : -1;
+  }
+
+  // dbconvert wants room for a terminator.
+  return dbconvert(_dbHandle, coltype, dbdata(_dbHandle, col + 1), srclen,
+      SYBCHAR, reinterpret_cast<BYTE *>(buf), size - 1);
+}
+
+int
+SqlConnection::GetUtf8Col(int col, char *buf, int size)
+{
+  int len;
+  const unsigned char *data = GetColumnData(col, &len);
+  if (data == nullptr)
+    return 0;
+
+  switch (dbcoltype(_dbHandle, col + 1)) {
+  case SYBBINARY:
+  case SYBVARBINARY:
+  case SYBIMAGE:
+    return sql_utf16_to_utf8(data, len, buf, size);
+  case SYBCHAR:
+  case SYBVARCHAR:
+  case SYBTEXT:
+    if (len > size)
+      return -1;
+    memcpy(buf, data, len);
+    return len;
+  default:
+    return ConvertColToText(col, buf, size);
+  }
+}
+
+bool
+SqlConnection::StreamCol(int col, const ChunkSink& sink, size_t chunk_size)
+{
+  if (col > dbnumcols(_dbHandle))
+    throw std::runtime_error("Requested stream on nonexistent column");
+
+  switch (dbcoltype(_dbHandle, col + 1)) {
+  case SYBCHAR:
+  case SYBVARCHAR:
+  case SYBTEXT:
+  case SYBBINARY:
+  case SYBVARBINARY:
+  case SYBIMAGE:
+    break;
+  default: {
+    // Small fixed size types, nothing to gain from chunking.
+    std::string str = GetStringCol(col);
+    return sink(str.data(), str.size());
+  }
+  }
+
+  const char *data = reinterpret_cast<const char *>(dbdata(_dbHandle, col + 1));
   DBINT srclen = dbdatlen(_dbHandle, col + 1);
-  return srclen <= 0;
+  if (data == nullptr || srclen <= 0)
+    return true;
+
+  size_t remaining = static_cast<size_t>(srclen);
+  if (chunk_size == 0)
+    chunk_size = remaining;
+  while (remaining > 0) {
+    size_t len = std::min(remaining, chunk_size);
+    if (!sink(data, len))
+      return false;
+    data += len;
+    remaining -= len;
+  }
+  return true;
 }
 
-void SqlConnection::ExecStoredProc(const char *proc, struct db_params *params,
-    size_t parm_count)
+void
+SqlConnection::WriteColToFd(int col, int fd)
 {
-  execute_proc_common(proc, params, parm_count);
+  StreamCol(col, [fd](const char *data, size_t len) {
+    while (len > 0) {
+      ssize_t n = write(fd, data, len);
+      if (n < 0) {
+        if (errno == EINTR)
+          continue;
+        throw std::runtime_error(std::string("Failed to write column: ") +
+            strerror(errno));
+      }
+      data += n;
+      len -= static_cast<size_t>(n);
+    }
+    return true;
+  });
+}
 
-  int res = dbresults(_dbHandle);
-  if (res == FAIL)
-    throw std::runtime_error("Failed to get results");
+int
+SqlConnection::ReadText(void *buf, int size)
+{
+  STATUS res = dbreadtext(_dbHandle, buf, size);
+  if (res == NO_MORE_ROWS) {
+    _fetched_rows = true;
+    return -1;
+  }
 
-  if (res == NO_MORE_RESULTS)
-    _fetched_results = true;
+  if (res < 0) {
+    fail("Failed to read text column");
+    throw_last();
+  }
+
+  return res;
+}
+
+void
+SqlConnection::SetTextSize(int bytes)
+{
+  Connect();
+
+  char buf[16];
+  snprintf(buf, sizeof(buf), "%d", bytes);
+  if (dbsetopt(_dbHandle, DBTEXTSIZE, buf, 0) == FAIL)
+    throw std::runtime_error("Failed to set text size");
+}
+
+void SqlConnection::ExecStoredProc(const char *proc, struct db_params *params,
+    size_t parm_count)
+{
+  if (!execute_proc_common(proc, params, parm_count) || !proc_results())
+    throw_last();
 }
 
 void SqlConnection::ExecNonQuery(const char *proc, struct db_params *params,
     size_t parm_count)
 {
-  execute_proc_common(proc, params, parm_count);
-  Dispose();
+  if (!execute_proc_common(proc, params, parm_count) || !dispose())
+    throw_last();
 }
 
 void SqlConnection::ExecStoredProc(const char *proc,
-    const std::vector<db_param>& params)
+    SqlParamSpan params)
+{
+  if (!execute_proc_common2(proc, params) || !proc_results())
+    throw_last();
+}
+
+void SqlConnection::ExecNonQuery(const char *proc,
+    SqlParamSpan params)
+{
+  if (!execute_proc_common2(proc, params) || !dispose())
+    throw_last();
+}
+
+SqlStatus SqlConnection::TryExecStoredProc(const char *proc,
+    struct db_params *params, size_t parm_count)
 {
-  execute_proc_common2(proc, params);
+  if (!execute_proc_common(proc, params, parm_count) || !proc_results())
+    return SqlStatus(_last_error);
+  return SqlStatus();
+}
+
+SqlStatus SqlConnection::TryExecNonQuery(const char *proc,
+    struct db_params *params, size_t parm_count)
+{
+  if (!execute_proc_common(proc, params, parm_count) || !dispose())
+    return SqlStatus(_last_error);
+  return SqlStatus();
+}
+
+SqlStatus SqlConnection::TryExecStoredProc(const char *proc,
+    SqlParamSpan params)
+{
+  if (!execute_proc_common2(proc, params) || !proc_results())
+    return SqlStatus(_last_error);
+  return SqlStatus();
+}
+
+SqlStatus SqlConnection::TryExecNonQuery(const char *proc,
+    SqlParamSpan params)
+{
+  if (!execute_proc_common2(proc, params) || !dispose())
+    return SqlStatus(_last_error);
+  return SqlStatus();
+}
 
+bool SqlConnection::proc_results()
+{
   int res = dbresults(_dbHandle);
   if (res == FAIL)
-    throw std::runtime_error("Failed to get results");
+    return fail("Failed to get results");
 
   if (res == NO_MORE_RESULTS)
     _fetched_results = true;
-}
-
-void SqlConnection::ExecNonQuery(const char *proc,
-    const std::vector<db_param>& params)
-{
-  execute_proc_common2(proc, params);
-  Dispose();
+  return true;
 }
 
 
@@ -519,20 +1009,32 @@ std::vector<std::string> SqlConnection::GetAllColumnNames()
   return columns;
 }
 
-void SqlConnection::execute_proc_common(const char *proc, struct db_params *params, size_t parm_count)
+std::pmr::vector<std::pmr::string>
+SqlConnection::GetAllColumnNames(std::pmr::memory_resource *mr)
 {
-  Connect();
+  int total_cols = dbnumcols(_dbHandle);
+
+  std::pmr::vector<std::pmr::string> columns(mr);
+  columns.reserve(total_cols);
+
+  for (int i = 0; i < total_cols; i++) {
+    columns.emplace_back(dbcolname(_dbHandle, i + 1));
+  }
 
-  Dispose();
+  return columns;
+}
+
+bool SqlConnection::execute_proc_common(const char *proc, struct db_params *params, size_t parm_count)
+{
+  if (!prepare_call() || !run_initial_query())
+    return false;
 
+  begin_call();
   _fetched_rows = false;
   _fetched_results = false;
 
-  if (dbrpcinit(_dbHandle, proc, 0) == FAIL) {
-    std::string error = "Failed to init stored procedure: ";
-    error += proc;
-    throw std::runtime_error(error);
-  }
+  if (dbrpcinit(_dbHandle, proc, 0) == FAIL)
+    return fail("Failed to init stored procedure: %s", proc);
 
   for (size_t i = 0; i < parm_count; i++) {
     int real_type = 0;
@@ -547,52 +1049,32 @@ void SqlConnection::execute_proc_common(const char *proc, struct db_params *para
         real_type = SYBCHAR;
         break;
       default:
-        throw std::runtime_error("Unknown stored procedure parameter type");
+        return fail("Unknown stored procedure parameter type");
     }
     if (dbrpcparam(_dbHandle, params[i].name, params[i].status,
                    real_type, params[i].maxlen, params[i].datalen,
                    (BYTE *)params[i].value) == FAIL) {
-      std::string error = "Failed to set parameter ";
-      if (params[i].name != nullptr) {
-        error += params[i].name;
-        error.append(1, ' ');
-      }
-      error += "on procedure ";
-      error += proc;
-      throw std::runtime_error(error);
+      return fail("Failed to set parameter %s%son procedure %s",
+          params[i].name != nullptr ? params[i].name : "",
+          params[i].name != nullptr ? " " : "", proc);
     }
   }
 
-  if (dbrpcsend(_dbHandle) == FAIL)
-    throw std::runtime_error("Failed to send RPC");
-
-  // Wait for the server to return
-  if (dbsqlok(_dbHandle) == FAIL)
-    throw std::runtime_error(_error);
-
-  // FreeTDS's implementation of dblib does not always process the result of
-  // of the message handler. For instance there are situations where an error
-  // has occurred but dbsqlok returned success. In these situations we need to
-  // check the actual _error property and throw if it is not blank.
-  if (!_error.empty())
-    throw std::runtime_error(_error);
+  return send_rpc();
 }
 
-void SqlConnection::execute_proc_common2(const char *proc,
-    const std::vector<db_param>& params)
+bool SqlConnection::execute_proc_common2(const char *proc,
+    SqlParamSpan params)
 {
-  Connect();
-
-  Dispose();
+  if (!prepare_call() || !run_initial_query())
+    return false;
 
+  begin_call();
   _fetched_rows = false;
   _fetched_results = false;
 
-  if (dbrpcinit(_dbHandle, proc, 0) == FAIL) {
-    std::string error = "Failed to init stored procedure: ";
-    error += proc;
-    throw std::runtime_error(error);
-  }
+  if (dbrpcinit(_dbHandle, proc, 0) == FAIL)
+    return fail("Failed to init stored procedure: %s", proc);
 
   for (const auto& param : params) {
     int real_type = 0;
@@ -611,39 +1093,53 @@ void SqlConnection::execute_proc_common2(const char *proc,
       break;
     default:
       // Not reached?
-      throw std::runtime_error("Unknown stored procedure parameter type");
+      return fail("Unknown stored procedure parameter type");
     }
 
     if (dbrpcparam(_dbHandle, param.name, 0,
                    real_type, -1, param.datalen, value) == FAIL) {
-      std::string error = "Failed to set parameter ";
-      if (param.name != nullptr) {
-        error += param.name;
-        error.append(1, ' ');
-      }
-      error += "on procedure ";
-      error += proc;
-      throw std::runtime_error(error);
+      return fail("Failed to set parameter %s%son procedure %s",
+          param.name != nullptr ? param.name : "",
+          param.name != nullptr ? " " : "", proc);
     }
   }
 
+  return send_rpc();
+}
+
+bool SqlConnection::send_rpc()
+{
   if (dbrpcsend(_dbHandle) == FAIL)
-    throw std::runtime_error("Failed to send RPC");
+    return fail("Failed to send RPC");
 
   // Wait for the server to return
   if (dbsqlok(_dbHandle) == FAIL)
-    throw std::runtime_error(_error);
+    return fail("Failed to execute stored procedure");
 
   // FreeTDS's implementation of dblib does not always process the result of
   // of the message handler. For instance there are situations where an error
   // has occurred but dbsqlok returned success. In these situations we need to
-  // check the actual _error property and throw if it is not blank.
-  if (!_error.empty())
-    throw std::runtime_error(_error);
+  // check the actual error text and fail if it is not blank.
+  if (_last_error.text[0] != '\0')
+    return fail("Failed to execute stored procedure");
+
+  return true;
 }
 
 bool SqlConnection::ChangeDatabase(const std::string &newdb)
 {
+  // Dropped after a failed call, Connect() will pick the new database.
+  if (_dbHandle == nullptr) {
+    _database = newdb;
+    return true;
+  }
+
+  // Nothing to do if the session is already there.
+  if (in_database(newdb)) {
+    _database = newdb;
+    return true;
+  }
+
   if (dbuse(_dbHandle, newdb.c_str()) != FAIL) {
     _database = newdb;
     return true;
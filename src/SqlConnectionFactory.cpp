@@ -14,57 +14,584 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <algorithm>
 #include <stdexcept>
 #include <list>
+#include <thread>
+
+#include <pthread.h>
 
 #include "SqlConnection.h"
 #include "SqlConnectionFactory.h"
+#include "SqlDataSource.h"
 
 namespace tds {
 
+// A small per-thread stash of idle connections that sits in front of the
+// shared pool. Only the owning thread ever puts connections into its slots,
+// other threads may take them out (steal) when the shared pool can't
+// satisfy a request.
+struct SqlConnectionFactory::ThreadCache {
+  static constexpr int max_slots = 2;
+
+  std::atomic<SqlConnection *> slots[max_slots];
+  unsigned generation; // Guarded by the factory mutex
+
+  ThreadCache()
+  {
+    for (auto& slot : slots)
+      slot.store(nullptr, std::memory_order_relaxed);
+
+    SqlConnectionFactory& f = SqlConnectionFactory::instance();
+    std::lock_guard<std::mutex> locker(f._mutex);
+    generation = f._generation.load(std::memory_order_relaxed);
+    f._thread_caches.push_back(this);
+    _current_cache = this;
+  }
+
+  // Thread is exiting, hand everything back to the shared pool.
+  ~ThreadCache()
+  {
+    _current_cache = nullptr;
+
+    SqlConnectionFactory& f = SqlConnectionFactory::instance();
+    std::lock_guard<std::mutex> locker(f._mutex);
+    f._thread_caches.erase(std::remove(f._thread_caches.begin(),
+          f._thread_caches.end(), this), f._thread_caches.end());
+    drain(f, 0);
+  }
+
+  // Moves connections in slots [first, max_slots) to the shared pool.
+  // Must be called with the factory mutex held.
+  void drain(SqlConnectionFactory& f, int first)
+  {
+    for (int i = first; i < max_slots; i++) {
+      SqlConnection *c = slots[i].exchange(nullptr, std::memory_order_acquire);
+      if (c != nullptr)
+        f.park(c);
+    }
+  }
+};
+
+// Checks whether an idle connection can serve a request. Connections
+// opened with a server's default options only go to callers that didn't
+// ask for specific options and vice versa. Bucketed connections belong to
+// their data source.
+static bool same_target(const SqlConnection *c, const std::string& server,
+    const SqlConnectionOptions *options)
+{
+  if (c->Bucket() != nullptr || c->Server() != server)
+    return false;
+
+  if (options == nullptr)
+    return c->DefaultOptions();
+  return !c->DefaultOptions() && c->Options() == *options;
+}
+
+thread_local SqlConnectionFactory::ThreadCache *
+SqlConnectionFactory::_current_cache = nullptr;
+
+SqlConnectionFactory::ThreadCache& SqlConnectionFactory::thread_cache()
+{
+  thread_local ThreadCache cache;
+  return cache;
+}
+
+void SqlConnectionFactory::set_thread_cache_size(int slots)
+{
+  slots = std::max(0, std::min(slots, ThreadCache::max_slots));
+  _thread_cache_size.store(slots, std::memory_order_relaxed);
+
+  // Anything sitting in slots that are no longer in use goes back to the
+  // shared pool.
+  std::lock_guard<std::mutex> locker(_mutex);
+  for (ThreadCache *cache : _thread_caches)
+    cache->drain(*this, slots);
+}
+
+void SqlConnectionFactory::flush_thread_cache()
+{
+  if (_thread_cache_size.load(std::memory_order_relaxed) == 0)
+    return;
+
+  ThreadCache& cache = thread_cache();
+  std::lock_guard<std::mutex> locker(_mutex);
+  cache.drain(*this, 0);
+}
+
+std::vector<std::pair<std::string, std::string>>
+SqlConnectionFactory::idle_targets()
+{
+  std::vector<std::pair<std::string, std::string>> targets;
+
+  settle_fork();
+  std::lock_guard<std::mutex> locker(_mutex);
+  targets.reserve(sql_connections.size());
+  for (const SqlConnection *c : sql_connections)
+    targets.emplace_back(c->Server(), c->Database());
+  for (const SqlPoolBucket& bucket : _buckets) {
+    for (size_t i = 0; i < bucket.idle.size(); i++)
+      targets.emplace_back(bucket.server, bucket.database);
+  }
+  return targets;
+}
+
+SqlPoolBucket* SqlConnectionFactory::add_bucket(const std::string& server,
+    const std::string& database)
+{
+  std::lock_guard<std::mutex> locker(_mutex);
+  _buckets.emplace_back();
+  _buckets.back().server = server;
+  _buckets.back().database = database;
+  return &_buckets.back();
+}
+
+// Puts an idle connection back where it belongs. Must be called with
+// _mutex held.
+void SqlConnectionFactory::park(SqlConnection *c)
+{
+  if (SqlPoolBucket *bucket = c->Bucket(); bucket != nullptr)
+    bucket->idle.push_back(c);
+  else
+    sql_connections.push_back(c);
+}
+
+// Takes a cached connection accepted by match away from another thread.
+// Must be called with _mutex held.
+template <typename Match>
+SqlConnection* SqlConnectionFactory::steal(const Match& match)
+{
+  for (ThreadCache *cache : _thread_caches) {
+    for (auto& slot : cache->slots) {
+      // Only take connections we can use, emptying other threads' caches
+      // on every miss would defeat them. Peeking is safe because cached
+      // connections are only freed by discard, which waits for the mutex
+      // we hold, and match only looks at what never changes.
+      SqlConnection *c = slot.load(std::memory_order_acquire);
+      if (c == nullptr || !match(c))
+        continue;
+
+      // The owning thread may be racing us for it.
+      if (slot.compare_exchange_strong(c, nullptr, std::memory_order_acquire,
+            std::memory_order_relaxed)) {
+        return c;
+      }
+    }
+  }
+  return nullptr;
+}
+
+void SqlConnectionFactory::set_target_options(const std::string& server,
+    const SqlConnectionOptions& options)
+{
+  std::lock_guard<std::mutex> locker(_mutex);
+  _target_options[server] = options;
+}
+
+void SqlConnectionFactory::set_adaptive_limit(const std::string& server,
+    const SqlLimitOptions& options)
+{
+  std::lock_guard<std::mutex> locker(_mutex);
+  // Clients keep pointers to the limiter, so it can't be replaced.
+  auto& limiter = _limiters[server];
+  if (!limiter)
+    limiter.reset(new SqlLimiter(options));
+}
+
+SqlLimiter* SqlConnectionFactory::limiter(const std::string& server)
+{
+  std::lock_guard<std::mutex> locker(_mutex);
+  auto it = _limiters.find(server);
+  return it != _limiters.end() ? it->second.get() : nullptr;
+}
+
+void SqlConnectionFactory::set_workload_limits(const std::string& server,
+    const SqlWorkloadOptions& options)
+{
+  std::lock_guard<std::mutex> locker(_mutex);
+  auto& gate = _workload_gates[server];
+  if (!gate)
+    gate.reset(new SqlWorkloadGate(options));
+}
+
+SqlWorkloadGate* SqlConnectionFactory::workload_gate(const std::string& server)
+{
+  std::lock_guard<std::mutex> locker(_mutex);
+  auto it = _workload_gates.find(server);
+  return it != _workload_gates.end() ? it->second.get() : nullptr;
+}
+
+void SqlConnectionFactory::set_proxy(const std::string& socket_path)
+{
+  std::lock_guard<std::mutex> locker(_mutex);
+  _proxy_path = socket_path;
+  _proxy_enabled.store(!socket_path.empty(), std::memory_order_relaxed);
+}
+
+std::string SqlConnectionFactory::proxy_path()
+{
+  // Checked on every SqlClient construction, keep the common case off the
+  // mutex.
+  if (!_proxy_enabled.load(std::memory_order_relaxed))
+    return std::string();
+
+  std::lock_guard<std::mutex> locker(_mutex);
+  return _proxy_path;
+}
+
+void SqlConnectionFactory::set_fork_options(const SqlForkOptions& options)
+{
+  static std::once_flag installed;
+  std::call_once(installed, [] {
+    pthread_atfork(before_fork, after_fork_parent, after_fork_child);
+  });
+
+  std::lock_guard<std::mutex> locker(_mutex);
+  _fork_options = options;
+}
+
+// Holding the mutexes across fork() means the child never sees the pool,
+// a data source list or a limit half way through an update. Sources are
+// locked first, interning one takes the factory mutex to add its bucket.
+void SqlConnectionFactory::before_fork()
+{
+  SqlConnectionFactory& f = instance();
+  SqlDataSource::lock_sources();
+  f._mutex.lock();
+  for (auto& entry : f._limiters)
+    entry.second->_mutex.lock();
+  for (auto& entry : f._workload_gates)
+    entry.second->_mutex.lock();
+}
+
+void SqlConnectionFactory::after_fork_parent()
+{
+  SqlConnectionFactory& f = instance();
+  for (auto& entry : f._workload_gates)
+    entry.second->_mutex.unlock();
+  for (auto& entry : f._limiters)
+    entry.second->_mutex.unlock();
+  f._mutex.unlock();
+  SqlDataSource::unlock_sources();
+}
+
+// Runs in the child with only the forking thread alive, where little more
+// than unlocking is safe. Connections and caches inherited from the parent
+// are dealt with by settle_fork, on the child's first checkout. A child
+// that only execs never gets there.
+void SqlConnectionFactory::after_fork_child()
+{
+  SqlConnectionFactory& f = instance();
+  f._generation.fetch_add(1, std::memory_order_relaxed);
+  f._fork_cache = _current_cache;
+  f._fork_pending.store(true, std::memory_order_relaxed);
+  after_fork_parent();
+}
+
+// Drops every connection inherited from the parent, without logging it
+// out, along with the caches of threads that didn't survive the fork, then
+// starts warming up the pool for the child.
+void SqlConnectionFactory::settle_fork()
+{
+  if (!_fork_pending.load(std::memory_order_relaxed))
+    return;
+
+  std::vector<SqlConnection*> dropped;
+  std::vector<std::pair<std::shared_ptr<const SqlDataSource>, int>> warm;
+  {
+    std::lock_guard<std::mutex> locker(_mutex);
+    if (!_fork_pending.load(std::memory_order_relaxed))
+      return;
+    _fork_pending.store(false, std::memory_order_relaxed);
+
+    auto drop_stale = [this, &dropped](auto& idle) {
+      auto it = std::stable_partition(idle.begin(), idle.end(),
+          [this](const SqlConnection *c) { return !inherited(c); });
+      dropped.insert(dropped.end(), it, idle.end());
+      idle.erase(it, idle.end());
+    };
+    drop_stale(sql_connections);
+    for (SqlPoolBucket& bucket : _buckets)
+      drop_stale(bucket.idle);
+
+    unsigned generation = _generation.load(std::memory_order_relaxed);
+    auto dead = [&](ThreadCache *cache) {
+      if (cache->generation == generation)
+        return false;
+      for (auto& slot : cache->slots) {
+        SqlConnection *c = slot.load(std::memory_order_relaxed);
+        if (c != nullptr && inherited(c) &&
+            slot.compare_exchange_strong(c, nullptr)) {
+          dropped.push_back(c);
+        }
+      }
+      cache->generation = generation;
+      return cache != _fork_cache;
+    };
+    _thread_caches.erase(std::remove_if(_thread_caches.begin(),
+          _thread_caches.end(), dead), _thread_caches.end());
+    _fork_cache = nullptr;
+
+    warm = _fork_options.warm_up;
+  }
+
+  for (SqlConnection *c : dropped) {
+    c->Abandon();
+    delete c;
+  }
+
+  // Don't hold up the child's start, it can serve requests while the
+  // connections are being made.
+  if (!warm.empty()) {
+    std::thread([warm] {
+      SqlConnectionFactory& f = instance();
+      for (const auto& entry : warm) {
+        if (SqlStatus status = f.warm_up(*entry.first, entry.second); !status) {
+          sql_log_event(SQL_LOG_ERROR, "connect", entry.first->Server().c_str(),
+              entry.first->Database().c_str(), -1, -1,
+              "SqlConnectionFactory::warm_up > %s", status.Error().message);
+        }
+      }
+      f.flush_thread_cache();
+    }).detach();
+  }
+}
+
+SqlStatus SqlConnectionFactory::warm_up(const SqlDataSource& source, int count)
+{
+  // Holding every connection until the end forces new ones to be opened
+  // once the idle ones run out.
+  std::vector<SqlConnection*> held;
+  SqlStatus status;
+  for (int i = 0; i < count; i++) {
+    SqlConnection *c;
+    if (!(status = try_acquire(source, &c)))
+      break;
+    held.push_back(c);
+  }
+
+  for (SqlConnection *c : held)
+    release(c);
+  return status;
+}
+
+bool SqlConnectionFactory::inherited(const SqlConnection *c) const
+{
+  return c->Generation() != _generation.load(std::memory_order_relaxed);
+}
+
 void SqlConnectionFactory::release(SqlConnection *c)
 {
+  if (c == nullptr)
+    return;
+
+  // Checked out before a fork, the parent is still using the session.
+  if (inherited(c)) {
+    discard(c);
+    return;
+  }
+
+  // A connection whose results can't be drained isn't fit for the next
+  // user, and release must not throw.
+  if (!c->TryDispose()) {
+    discard(c);
+    return;
+  }
+
+  if (int slots = _thread_cache_size.load(std::memory_order_relaxed); slots > 0) {
+    ThreadCache& cache = thread_cache();
+    for (int i = 0; i < slots; i++) {
+      SqlConnection *expected = nullptr;
+      if (cache.slots[i].compare_exchange_strong(expected, c,
+            std::memory_order_release, std::memory_order_relaxed)) {
+        return;
+      }
+    }
+  }
+
   std::lock_guard<std::mutex> locker(_mutex);
-  c->Dispose();
-  sql_connections.push_back(c);
+  park(c);
 }
 
 
+void SqlConnectionFactory::discard(SqlConnection *c)
+{
+  if (c == nullptr)
+    return;
+  if (inherited(c))
+    c->Abandon();
+
+  // A steal that peeked at c while it was still cached may be looking at
+  // it, let it finish.
+  { std::lock_guard<std::mutex> locker(_mutex); }
+  delete c;
+}
+
 SqlConnection* SqlConnectionFactory::acquire(const std::string& user,
     const std::string& pass, const std::string& server,
-    const std::string& database)
+    const std::string& database, const SqlConnectionOptions *options)
+{
+  SqlConnection *c;
+  if (SqlStatus status = try_acquire(user, pass, server, database, options, &c); !status)
+    throw SqlException(status.Error());
+  return c;
+}
+
+SqlStatus SqlConnectionFactory::try_acquire(const std::string& user,
+    const std::string& pass, const std::string& server,
+    const std::string& database, const SqlConnectionOptions *options,
+    SqlConnection **out)
+{
+  settle_fork();
+  if ((*out = find_idle(server, database, options)) != nullptr)
+    return SqlStatus();
+
+  return open(user, pass, server, database, options, nullptr, out);
+}
+
+SqlStatus SqlConnectionFactory::try_acquire(const SqlDataSource& source,
+    SqlConnection **out)
+{
+  SqlPoolBucket *bucket = source.Bucket();
+  if (bucket == nullptr) {
+    return try_acquire(source.User(), source.Pass(), source.Server(),
+        source.Database(), source.Options(), out);
+  }
+
+  settle_fork();
+  if ((*out = find_idle(bucket)) != nullptr)
+    return SqlStatus();
+
+  return open(source.User(), source.Pass(), source.Server(),
+      source.Database(), source.Options(), bucket, out);
+}
+
+// Makes a new connection, options may be null for the server defaults.
+SqlStatus SqlConnectionFactory::open(const std::string& user,
+    const std::string& pass, const std::string& server,
+    const std::string& database, const SqlConnectionOptions *options,
+    SqlPoolBucket *bucket, SqlConnection **out)
+{
+  bool default_options = options == nullptr;
+  SqlConnectionOptions target_options;
+  if (default_options) {
+    std::lock_guard<std::mutex> locker(_mutex);
+    if (auto it = _target_options.find(server); it != _target_options.end())
+      target_options = it->second;
+    options = &target_options;
+  }
+
+  // Make new connection.
+  sql_log_event(SQL_LOG_INFO, "connect", server.c_str(), database.c_str(), -1, -1,
+      "SqlConnectionFactory::acquire > Making a new connection: %s - %s",
+      server.c_str(), database.c_str());
+
+  auto *c = new SqlConnection(user, pass, server, database, *options);
+  c->SetDefaultOptions(default_options);
+  c->SetBucket(bucket);
+  c->SetGeneration(_generation.load(std::memory_order_relaxed));
+  if (SqlStatus status = c->TryConnect(); !status) {
+    delete c;
+    return status;
+  }
+
+  *out = c;
+  return SqlStatus();
+}
+
+// Looks for an idle connection that can serve the request, first in the
+// calling thread's cache, then the shared pool and finally other threads'
+// caches.
+SqlConnection* SqlConnectionFactory::find_idle(const std::string& server,
+    const std::string& database, const SqlConnectionOptions *options)
 {
   SqlConnection *c;
 
+  // Fast path, a connection this thread released earlier.
+  if (int slots = _thread_cache_size.load(std::memory_order_relaxed); slots > 0) {
+    ThreadCache& cache = thread_cache();
+    for (int i = 0; i < slots; i++) {
+      c = cache.slots[i].exchange(nullptr, std::memory_order_acquire);
+      if (c == nullptr)
+        continue;
+
+      if (same_target(c, server, options) && c->Database() == database)
+        return c;
+
+      // Only this thread fills its slots, so it is still empty.
+      cache.slots[i].store(c, std::memory_order_release);
+    }
+  }
+
+  SqlConnection *other_db = nullptr;
   {
     std::lock_guard<std::mutex> locker(_mutex);
+
+    // Prefer a connection that is already using the right database, reusing
+    // it costs no round trips at all.
     for (auto it = sql_connections.begin(); it != sql_connections.end(); ++it) {
       c = *it;
       // TODO: Consider username and password when acquiring from pool?
-      if (c->Server() == server) {
+      if (same_target(c, server, options)) {
         if (c->Database() == database) {
           sql_connections.erase(it);
           return c;
-        } else if (c->ChangeDatabase(database)) {
-          sql_connections.erase(it);
-          return c;
+        } else if (other_db == nullptr) {
+          other_db = c;
         }
       }
     }
+
+    if (other_db != nullptr) {
+      sql_connections.remove(other_db);
+    } else {
+      // Nothing idle in the shared pool, see if another thread is sitting
+      // on a connection we can use.
+      other_db = steal([&](const SqlConnection *c) {
+        return same_target(c, server, options);
+      });
+    }
   }
 
-  // Make new connection.
-  std::string log_msg = "SqlConnectionFactory::acquire > Making a new connection: ";
-  log_msg += server;
-  log_msg += " - ";
-  log_msg += database;
+  // Switch databases without holding up everyone else.
+  if (other_db != nullptr) {
+    if (other_db->Database() == database || other_db->ChangeDatabase(database))
+      return other_db;
 
-  sql_log(1, log_msg.c_str());
+    std::lock_guard<std::mutex> locker(_mutex);
+    sql_connections.push_back(other_db);
+  }
 
-  c = new SqlConnection(user, pass, server, database);
-  c->Connect();
+  return nullptr;
+}
 
-  return c;
+// Bucketed connections never change database, any idle one will do.
+SqlConnection* SqlConnectionFactory::find_idle(SqlPoolBucket *bucket)
+{
+  if (int slots = _thread_cache_size.load(std::memory_order_relaxed); slots > 0) {
+    ThreadCache& cache = thread_cache();
+    for (int i = 0; i < slots; i++) {
+      SqlConnection *c = cache.slots[i].exchange(nullptr, std::memory_order_acquire);
+      if (c == nullptr)
+        continue;
+
+      if (c->Bucket() == bucket)
+        return c;
+
+      cache.slots[i].store(c, std::memory_order_release);
+    }
+  }
+
+  std::lock_guard<std::mutex> locker(_mutex);
+  if (!bucket->idle.empty()) {
+    SqlConnection *c = bucket->idle.back();
+    bucket->idle.pop_back();
+    return c;
+  }
+
+  return steal([bucket](const SqlConnection *c) {
+    return c->Bucket() == bucket;
+  });
 }
 
 }
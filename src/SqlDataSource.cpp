@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2012-2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <mutex>
+#include <vector>
+
+#include "SqlConnection.h"
+#include "SqlConnectionFactory.h"
+#include "SqlDataSource.h"
+
+namespace tds {
+
+static std::mutex g_sources_mutex;
+static std::vector<std::shared_ptr<const SqlDataSource>> g_sources;
+
+SqlDataSource::SqlDataSource(const std::string& user, const std::string& pass,
+    const std::string& server, const std::string& database,
+    const SqlConnectionOptions *options) :
+  _user{user}, _pass{pass}, _server{server}, _database{database},
+  _clean_server{SqlConnection::fix_server(server)}
+{
+  if (options != nullptr)
+    _options = *options;
+}
+
+std::shared_ptr<const SqlDataSource> SqlDataSource::Create(
+    const std::string& user, const std::string& pass,
+    const std::string& server, const std::string& database,
+    const SqlConnectionOptions *options)
+{
+  return std::shared_ptr<const SqlDataSource>(
+      new SqlDataSource(user, pass, server, database, options));
+}
+
+std::shared_ptr<const SqlDataSource> SqlDataSource::Get(
+    const std::string& user, const std::string& pass,
+    const std::string& server, const std::string& database)
+{
+  return intern(user, pass, server, database, nullptr);
+}
+
+std::shared_ptr<const SqlDataSource> SqlDataSource::Get(
+    const std::string& user, const std::string& pass,
+    const std::string& server, const std::string& database,
+    const SqlConnectionOptions& options)
+{
+  return intern(user, pass, server, database, &options);
+}
+
+// Sources are few and looked up once each, a list does.
+std::shared_ptr<const SqlDataSource> SqlDataSource::intern(
+    const std::string& user, const std::string& pass,
+    const std::string& server, const std::string& database,
+    const SqlConnectionOptions *options)
+{
+  std::string clean_server = SqlConnection::fix_server(server);
+
+  std::lock_guard<std::mutex> locker(g_sources_mutex);
+  for (const auto& source : g_sources) {
+    if (source->_clean_server == clean_server &&
+        source->_database == database && source->_user == user &&
+        source->_pass == pass &&
+        (options == nullptr ? !source->_options :
+          source->_options && *source->_options == *options)) {
+      return source;
+    }
+  }
+
+  auto *source = new SqlDataSource(user, pass, server, database, options);
+  source->_bucket = SqlConnectionFactory::instance().add_bucket(server,
+      database);
+  g_sources.emplace_back(source);
+  return g_sources.back();
+}
+
+void SqlDataSource::lock_sources()
+{
+  g_sources_mutex.lock();
+}
+
+void SqlDataSource::unlock_sources()
+{
+  g_sources_mutex.unlock();
+}
+
+// Limiters and gates are never removed once added, so a found one can be
+// kept. Until then every call asks the factory again.
+SqlLimiter *SqlDataSource::Limiter() const
+{
+  SqlLimiter *limiter = _limiter.load(std::memory_order_acquire);
+  if (limiter == nullptr) {
+    limiter = SqlConnectionFactory::instance().limiter(_server);
+    _limiter.store(limiter, std::memory_order_release);
+  }
+  return limiter;
+}
+
+SqlWorkloadGate *SqlDataSource::Gate() const
+{
+  SqlWorkloadGate *gate = _gate.load(std::memory_order_acquire);
+  if (gate == nullptr) {
+    gate = SqlConnectionFactory::instance().workload_gate(_server);
+    _gate.store(gate, std::memory_order_release);
+  }
+  return gate;
+}
+
+} // namespace tds
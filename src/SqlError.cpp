@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2012-2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "SqlError.h"
+
+namespace tds {
+
+SqlErrorKind sql_classify_error(int msgno)
+{
+  switch (msgno) {
+  case 0:
+    return SqlErrorKind::None;
+  case 1205:
+    /* Transaction was deadlocked and has been chosen as the victim */
+    return SqlErrorKind::Deadlock;
+  case 1222:
+    /* Lock request time out period exceeded */
+    return SqlErrorKind::LockTimeout;
+  case 233:   /* No process is on the other end of the pipe */
+  case 10053: /* Transport level error, connection aborted */
+  case 10054: /* Transport level error, connection reset by peer */
+  case 10060: /* Network or instance specific error */
+    return SqlErrorKind::ConnectionLost;
+  case 952:   /* Database is in transition */
+  case 4060:  /* Cannot open database requested by the login */
+  case 4221:  /* Login to read-secondary failed, replica not available */
+  case 10928: /* Resource limit reached */
+  case 10929: /* Resource governance, minimum guarantee not met */
+  case 40197: /* Service encountered an error processing your request */
+  case 40501: /* Service is currently busy */
+  case 40613: /* Database is not currently available */
+  case 49918: /* Not enough resources to process request */
+  case 49919: /* Too many create or update operations in progress */
+  case 49920: /* Too many operations in progress */
+    return SqlErrorKind::Failover;
+  default:
+    return SqlErrorKind::General;
+  }
+}
+
+bool sql_error_is_transient(SqlErrorKind kind)
+{
+  switch (kind) {
+  case SqlErrorKind::Deadlock:
+  case SqlErrorKind::LockTimeout:
+  case SqlErrorKind::ConnectionLost:
+  case SqlErrorKind::Failover:
+    return true;
+  default:
+    return false;
+  }
+}
+
+}
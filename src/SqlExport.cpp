@@ -0,0 +1,421 @@
+/*
+ * Copyright (c) 2012-2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <unistd.h>
+
+// FreeTDS stuff
+#define MSDBLIB 1
+#include <sqlfront.h>
+#include <sybdb.h>
+
+#include "SqlClient.h"
+#include "SqlExport.h"
+
+namespace tds {
+
+SqlExporter::SqlExporter(const Sink& sink, const SqlExportOptions& options) :
+  _sink{sink}, _options{options}
+{
+  // Room for any single formatted number or date.
+  _size = std::max<size_t>(_options.buffer_size, 4096);
+  _buf.reset(new char[_size]);
+}
+
+SqlExporter::SqlExporter(int fd, const SqlExportOptions& options) :
+  SqlExporter([fd](const char *data, size_t len) {
+    while (len > 0) {
+      ssize_t n = write(fd, data, len);
+      if (n < 0) {
+        if (errno == EINTR)
+          continue;
+        throw std::runtime_error(std::string("Failed to write export: ") +
+            strerror(errno));
+      }
+      data += n;
+      len -= static_cast<size_t>(n);
+    }
+  }, options)
+{
+}
+
+SqlExporter::SqlExporter(std::string *out, const SqlExportOptions& options) :
+  SqlExporter([out](const char *data, size_t len) {
+    out->append(data, len);
+  }, options)
+{
+}
+
+SqlExporter::~SqlExporter()
+{
+  try {
+    Flush();
+  } catch (...) {
+  }
+}
+
+void SqlExporter::Flush()
+{
+  if (_len > 0) {
+    size_t len = _len;
+    _len = 0;
+    _sink(_buf.get(), len);
+  }
+}
+
+void SqlExporter::put(const char *data, size_t len)
+{
+  if (len > _size - _len) {
+    Flush();
+    if (len >= _size) {
+      _sink(data, len);
+      return;
+    }
+  }
+  memcpy(_buf.get() + _len, data, len);
+  _len += len;
+}
+
+// Makes room for len bytes, the caller fills them and bumps _len.
+char *SqlExporter::reserve(size_t len)
+{
+  if (len > _size - _len)
+    Flush();
+  return _buf.get() + _len;
+}
+
+static void append_json_string(std::string& out, const char *data, size_t len)
+{
+  static const char hex[] = "0123456789abcdef";
+
+  out += '"';
+  for (size_t i = 0; i < len; i++) {
+    unsigned char c = static_cast<unsigned char>(data[i]);
+    switch (c) {
+    case '"': out += "\\\""; break;
+    case '\\': out += "\\\\"; break;
+    case '\n': out += "\\n"; break;
+    case '\r': out += "\\r"; break;
+    case '\t': out += "\\t"; break;
+    default:
+      if (c < 0x20) {
+        out += "\\u00";
+        out += hex[c >> 4];
+        out += hex[c & 0xf];
+      } else {
+        out += static_cast<char>(c);
+      }
+    }
+  }
+  out += '"';
+}
+
+void SqlExporter::write_text(const char *data, size_t len)
+{
+  if (_options.format == SqlExportFormat::JsonLines) {
+    static const char hex[] = "0123456789abcdef";
+
+    put('"');
+    const char *run = data;
+    for (size_t i = 0; i < len; i++) {
+      unsigned char c = static_cast<unsigned char>(data[i]);
+      if (c >= 0x20 && c != '"' && c != '\\')
+        continue;
+
+      // Copy the plain run before the character needing an escape.
+      put(run, data + i - run);
+      run = data + i + 1;
+      switch (c) {
+      case '"': put("\\\"", 2); break;
+      case '\\': put("\\\\", 2); break;
+      case '\n': put("\\n", 2); break;
+      case '\r': put("\\r", 2); break;
+      case '\t': put("\\t", 2); break;
+      default: {
+        char esc[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf]};
+        put(esc, sizeof(esc));
+      }
+      }
+    }
+    put(run, data + len - run);
+    put('"');
+    return;
+  }
+
+  bool quote = false;
+  for (size_t i = 0; i < len && !quote; i++) {
+    char c = data[i];
+    quote = c == _options.delimiter || c == '"' || c == '\r' || c == '\n';
+  }
+  if (!quote) {
+    put(data, len);
+    return;
+  }
+
+  put('"');
+  const char *run = data;
+  for (const char *p = data; p < data + len; p++) {
+    if (*p == '"') {
+      put(run, p + 1 - run);
+      put('"');
+      run = p + 1;
+    }
+  }
+  put(run, data + len - run);
+  put('"');
+}
+
+void SqlExporter::write_header(SqlClient& client, int cols)
+{
+  std::vector<std::string> names = client.GetAllColumnNames();
+
+  if (_options.format == SqlExportFormat::JsonLines) {
+    _json_keys.clear();
+    for (const auto& name : names) {
+      std::string key;
+      append_json_string(key, name.data(), name.size());
+      key += ':';
+      _json_keys.push_back(std::move(key));
+    }
+    return;
+  }
+
+  if (!_options.header)
+    return;
+  for (int col = 0; col < cols; col++) {
+    if (col > 0)
+      put(_options.delimiter);
+    write_text(names[col].data(), names[col].size());
+  }
+  put("\r\n", 2);
+}
+
+static char *put_digits(char *p, unsigned value, int width)
+{
+  for (int i = width - 1; i >= 0; i--) {
+    p[i] = static_cast<char>('0' + value % 10);
+    value /= 10;
+  }
+  return p + width;
+}
+
+// Formats "YYYY-MM-DD HH:MM:SS.mmm" from days since 1900-01-01 and
+// milliseconds since midnight.
+static char *format_datetime(char *p, int64_t days, int64_t ms)
+{
+  // Days to civil date, from Howard Hinnant's date algorithms.
+  int64_t z = days - 25567 + 719468;  // Shift the epoch to 0000-03-01
+  int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+  unsigned doe = static_cast<unsigned>(z - era * 146097);
+  unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  unsigned mp = (5 * doy + 2) / 153;
+  unsigned day = doy - (153 * mp + 2) / 5 + 1;
+  unsigned month = mp < 10 ? mp + 3 : mp - 9;
+  int64_t year = static_cast<int64_t>(yoe) + era * 400 + (month <= 2);
+
+  p = put_digits(p, static_cast<unsigned>(year), 4);
+  *p++ = '-';
+  p = put_digits(p, month, 2);
+  *p++ = '-';
+  p = put_digits(p, day, 2);
+  *p++ = ' ';
+  p = put_digits(p, static_cast<unsigned>(ms / 3600000), 2);
+  *p++ = ':';
+  p = put_digits(p, static_cast<unsigned>(ms / 60000 % 60), 2);
+  *p++ = ':';
+  p = put_digits(p, static_cast<unsigned>(ms / 1000 % 60), 2);
+  *p++ = '.';
+  return put_digits(p, static_cast<unsigned>(ms % 1000), 3);
+}
+
+// Money is a fixed point number with 4 decimals.
+static char *format_money(char *p, char *end, int64_t value)
+{
+  uint64_t abs = value < 0 ? 0 - static_cast<uint64_t>(value) :
+    static_cast<uint64_t>(value);
+  if (value < 0)
+    *p++ = '-';
+  p = std::to_chars(p, end, abs / 10000).ptr;
+  *p++ = '.';
+  return put_digits(p, static_cast<unsigned>(abs % 10000), 4);
+}
+
+template <typename T>
+static T load(const unsigned char *data)
+{
+  T value;
+  memcpy(&value, data, sizeof(value));
+  return value;
+}
+
+void SqlExporter::write_value(SqlClient& client, int col, int type)
+{
+  bool json = _options.format == SqlExportFormat::JsonLines;
+
+  int len;
+  const unsigned char *data = client.GetColumnData(col, &len);
+  if (data == nullptr) {
+    if (json)
+      put("null", 4);
+    return;
+  }
+
+  constexpr size_t max_number = 64;
+  char *p;
+  char *end;
+
+  switch (type) {
+  case SYBCHAR:
+  case SYBVARCHAR:
+  case SYBTEXT:
+    write_text(reinterpret_cast<const char *>(data), len);
+    return;
+  case SYBINT1:
+  case SYBINT2:
+  case SYBINT4:
+  case SYBINT8: {
+    int64_t value = type == SYBINT1 ? data[0] :
+      type == SYBINT2 ? load<int16_t>(data) :
+      type == SYBINT4 ? load<int32_t>(data) : load<int64_t>(data);
+    p = reserve(max_number);
+    _len += std::to_chars(p, p + max_number, value).ptr - p;
+    return;
+  }
+  case SYBBIT:
+    if (json)
+      data[0] ? put("true", 4) : put("false", 5);
+    else
+      put(data[0] ? '1' : '0');
+    return;
+  case SYBFLT8:
+  case SYBREAL: {
+    double value = type == SYBFLT8 ? load<double>(data) : load<float>(data);
+    if (!std::isfinite(value)) {
+      if (json)
+        put("null", 4);
+      return;
+    }
+    p = reserve(max_number);
+    auto res = type == SYBFLT8 ? std::to_chars(p, p + max_number, value) :
+      std::to_chars(p, p + max_number, static_cast<float>(value));
+    _len += res.ptr - p;
+    return;
+  }
+  case SYBMONEY:
+  case SYBMONEY4: {
+    int64_t value = type == SYBMONEY4 ? load<int32_t>(data) :
+      static_cast<int64_t>(static_cast<uint64_t>(load<int32_t>(data)) << 32 |
+          load<uint32_t>(data + 4));
+    p = reserve(max_number);
+    _len += format_money(p, p + max_number, value) - p;
+    return;
+  }
+  case SYBDATETIME:
+  case SYBDATETIME4: {
+    int64_t days;
+    int64_t ms;
+    if (type == SYBDATETIME) {
+      // Time is in 1/300ths of a second, rounded the way dbdatecrack does.
+      days = load<int32_t>(data);
+      uint32_t ticks = load<uint32_t>(data + 4);
+      ms = static_cast<int64_t>(ticks / 300) * 1000 + ((ticks % 300) * 1000 + 150) / 300;
+    } else {
+      days = load<uint16_t>(data);
+      ms = static_cast<int64_t>(load<uint16_t>(data + 2)) * 60000;
+    }
+    p = reserve(max_number);
+    end = p;
+    if (json)
+      *end++ = '"';
+    end = format_datetime(end, days, ms);
+    if (json)
+      *end++ = '"';
+    _len += end - p;
+    return;
+  }
+  case SYBBINARY:
+  case SYBVARBINARY:
+  case SYBIMAGE: {
+    static const char hex[] = "0123456789ABCDEF";
+    if (json)
+      put('"');
+    put("0x", 2);
+    for (int i = 0; i < len; i++) {
+      put(hex[data[i] >> 4]);
+      put(hex[data[i] & 0xf]);
+    }
+    if (json)
+      put('"');
+    return;
+  }
+  default:
+    break;
+  }
+
+  // Everything else (decimals, GUIDs, the newer date types) goes through
+  // dbconvert, decimals are bare numbers in JSON.
+  char text[512];
+  int n = client.ConvertColToText(col, text, sizeof(text));
+  if (n < 0) {
+    std::string str = client.GetStringCol(col);
+    write_text(str.data(), str.size());
+  } else if (json && (type == SYBNUMERIC || type == SYBDECIMAL)) {
+    put(text, n);
+  } else {
+    write_text(text, n);
+  }
+}
+
+int64_t SqlExporter::Write(SqlClient& client)
+{
+  bool json = _options.format == SqlExportFormat::JsonLines;
+  int cols = client.GetColumnCount();
+
+  std::vector<int> types(cols);
+  for (int col = 0; col < cols; col++)
+    types[col] = client.GetColumnType(col);
+  write_header(client, cols);
+
+  int64_t rows = 0;
+  while (client.NextRow()) {
+    if (json)
+      put('{');
+    for (int col = 0; col < cols; col++) {
+      if (json) {
+        if (col > 0)
+          put(',');
+        put(_json_keys[col].data(), _json_keys[col].size());
+      } else if (col > 0) {
+        put(_options.delimiter);
+      }
+      write_value(client, col, types[col]);
+    }
+    if (json)
+      put("}\n", 2);
+    else
+      put("\r\n", 2);
+    rows++;
+  }
+  return rows;
+}
+
+}
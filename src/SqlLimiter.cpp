@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2012-2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <algorithm>
+#include <cmath>
+
+#include "SqlLimiter.h"
+
+namespace tds {
+
+SqlLimiter::SqlLimiter(const SqlLimitOptions& options) :
+  _options{options}, _limit{options.initial_limit},
+  _estimate{static_cast<double>(options.initial_limit)}
+{
+}
+
+bool SqlLimiter::TryAcquire()
+{
+  int in_flight = _in_flight.load(std::memory_order_relaxed);
+  do {
+    if (in_flight >= _limit.load(std::memory_order_relaxed))
+      return false;
+  } while (!_in_flight.compare_exchange_weak(in_flight, in_flight + 1,
+        std::memory_order_acquire, std::memory_order_relaxed));
+  return true;
+}
+
+void SqlLimiter::Release()
+{
+  _in_flight.fetch_sub(1, std::memory_order_release);
+}
+
+void SqlLimiter::Sample(std::chrono::microseconds latency, bool dropped)
+{
+  double rtt = std::max<double>(static_cast<double>(latency.count()), 1.0);
+  int in_flight = _in_flight.load(std::memory_order_relaxed);
+
+  std::lock_guard<std::mutex> locker(_mutex);
+
+  double estimate;
+  if (dropped) {
+    estimate = _estimate * _options.backoff;
+  } else {
+    if (_long_rtt == 0.0) {
+      _short_rtt = _long_rtt = rtt;
+    } else {
+      _short_rtt += (rtt - _short_rtt) * 0.1;
+      _long_rtt += (rtt - _long_rtt) * 0.002;
+    }
+
+    // After a sustained slowdown the baseline would otherwise take ages to
+    // come back down.
+    if (_long_rtt > _short_rtt * 2)
+      _long_rtt *= 0.95;
+
+    double gradient = std::clamp(_options.tolerance * _long_rtt / _short_rtt,
+        0.5, 1.0);
+
+    // Only probe upwards when the limit is actually being used.
+    double headroom = in_flight * 2 >= _estimate ? std::sqrt(_estimate) : 0.0;
+    double target = _estimate * gradient + headroom;
+    estimate = _estimate * (1 - _options.smoothing) + target * _options.smoothing;
+  }
+
+  _estimate = std::clamp(estimate, static_cast<double>(_options.min_limit),
+      static_cast<double>(_options.max_limit));
+  _limit.store(static_cast<int>(_estimate), std::memory_order_relaxed);
+}
+
+}
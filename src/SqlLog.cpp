@@ -0,0 +1,253 @@
+/*
+ * Copyright (c) 2012-2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <pthread.h>
+#include <thread>
+#include <vector>
+
+#include "SqlLog.h"
+#include "SqlRingBuffer.h"
+
+namespace tds {
+
+std::atomic<int> g_sql_log_threshold{-1};
+
+static std::atomic<void (*)(int, const char *)> g_log_func{nullptr};
+static std::atomic<void (*)(const SqlLogRecord&)> g_record_func{nullptr};
+static std::atomic<int> g_log_level{SQL_LOG_DEBUG};
+
+// Async delivery state. Producers only touch the queue pointer, which is
+// published once the drain thread is running.
+static std::mutex g_async_mutex;
+static std::unique_ptr<SqlRingBuffer<SqlLogRecord>> g_queue;
+// Queues of earlier runs, kept for producers that may still hold them.
+static std::vector<std::unique_ptr<SqlRingBuffer<SqlLogRecord>>> g_retired;
+static std::atomic<SqlRingBuffer<SqlLogRecord> *> g_async_queue{nullptr};
+static std::atomic<bool> g_async_stop{false};
+static std::atomic<uint64_t> g_dropped{0};
+static std::thread g_drain_thread;
+
+// The drain thread sleeps on g_wake while the queue is empty. It sets
+// g_drain_idle first, the producer that clears it does the waking.
+static std::mutex g_wake_mutex;
+static std::condition_variable g_wake;
+static std::atomic<bool> g_drain_idle{false};
+
+static void wake_drain()
+{
+  std::lock_guard<std::mutex> locker(g_wake_mutex);
+  g_wake.notify_one();
+}
+
+static void update_threshold()
+{
+  bool have_sink = g_log_func.load() != nullptr || g_record_func.load() != nullptr;
+  g_sql_log_threshold.store(have_sink ? g_log_level.load() : -1);
+}
+
+void sql_log_set_level(int level)
+{
+  g_log_level.store(level);
+  update_threshold();
+}
+
+void sql_log_set_func(void (*log_func)(int, const char *))
+{
+  g_log_func.store(log_func);
+  update_threshold();
+}
+
+void sql_log_set_record_func(void (*record_func)(const SqlLogRecord&))
+{
+  g_record_func.store(record_func);
+  update_threshold();
+}
+
+static void deliver(const SqlLogRecord& rec)
+{
+  if (auto *func = g_record_func.load(std::memory_order_acquire); func != nullptr)
+    func(rec);
+  if (auto *func = g_log_func.load(std::memory_order_acquire); func != nullptr)
+    func(rec.level, rec.message);
+}
+
+static void drain()
+{
+  SqlRingBuffer<SqlLogRecord> *queue = g_queue.get();
+  SqlLogRecord rec;
+
+  for (;;) {
+    bool stopping = g_async_stop.load(std::memory_order_acquire);
+
+    bool any = false;
+    while (queue->TryPop(rec)) {
+      deliver(rec);
+      any = true;
+    }
+
+    if (uint64_t dropped = g_dropped.exchange(0); dropped > 0) {
+      rec.level = SQL_LOG_ERROR;
+      rec.event = "log_dropped";
+      rec.time_us = -1;
+      rec.duration_us = -1;
+      rec.rows = -1;
+      rec.target[0] = '\0';
+      snprintf(rec.message, sizeof(rec.message),
+          "sql_log > Dropped %llu log records, queue full",
+          static_cast<unsigned long long>(dropped));
+      deliver(rec);
+    }
+
+    if (stopping)
+      break;
+    if (!any) {
+      std::unique_lock<std::mutex> locker(g_wake_mutex);
+      g_drain_idle.store(true);
+      // Pairs with the fence in submit, either we see the producer's
+      // record or it sees us idle.
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      g_wake.wait(locker, [queue] {
+        return queue->Size() > 0 || g_async_stop.load() ||
+          g_dropped.load() > 0;
+      });
+      g_drain_idle.store(false);
+    }
+  }
+}
+
+// Held across fork() so the child doesn't inherit them locked. The order
+// matches sql_log_stop_async.
+static void before_fork()
+{
+  g_async_mutex.lock();
+  g_wake_mutex.lock();
+}
+
+static void after_fork_parent()
+{
+  g_wake_mutex.unlock();
+  g_async_mutex.unlock();
+}
+
+// The drain thread didn't survive the fork. Records go back to being
+// delivered on the calling thread, and the thread object is forgotten
+// rather than joined, destroying it while joinable would terminate. What
+// was still queued is the parent's to deliver.
+static void after_fork_child()
+{
+  g_async_queue.store(nullptr, std::memory_order_relaxed);
+  g_drain_idle.store(false, std::memory_order_relaxed);
+  new (&g_drain_thread) std::thread();
+  new (&g_wake) std::condition_variable();
+  after_fork_parent();
+}
+
+void sql_log_start_async(size_t capacity)
+{
+  static std::once_flag installed;
+  std::call_once(installed, [] {
+    pthread_atfork(before_fork, after_fork_parent, after_fork_child);
+  });
+
+  std::lock_guard<std::mutex> locker(g_async_mutex);
+  if (g_drain_thread.joinable())
+    return;
+
+  if (g_queue)
+    g_retired.push_back(std::move(g_queue));
+  g_queue.reset(new SqlRingBuffer<SqlLogRecord>(capacity));
+  g_async_stop.store(false);
+  g_drain_thread = std::thread(drain);
+  g_async_queue.store(g_queue.get(), std::memory_order_release);
+}
+
+void sql_log_stop_async()
+{
+  std::lock_guard<std::mutex> locker(g_async_mutex);
+  if (!g_drain_thread.joinable())
+    return;
+
+  // Stop accepting new records, then let the drain thread empty the queue.
+  // A producer that loaded the queue pointer just before this may still be
+  // pushing, which is why the queue itself is never freed.
+  g_async_queue.store(nullptr, std::memory_order_release);
+  g_async_stop.store(true);
+  wake_drain();
+  g_drain_thread.join();
+}
+
+static void submit(SqlLogRecord& rec)
+{
+  rec.time_us = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+
+  if (auto *queue = g_async_queue.load(std::memory_order_acquire); queue != nullptr) {
+    if (!queue->TryPush(rec))
+      g_dropped.fetch_add(1);
+    // Only the first record after the queue ran empty pays for this.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (g_drain_idle.load() && g_drain_idle.exchange(false))
+      wake_drain();
+    return;
+  }
+  deliver(rec);
+}
+
+void sql_log(int level, const char *msg)
+{
+  if (!sql_log_enabled(level))
+    return;
+
+  SqlLogRecord rec;
+  rec.level = level;
+  rec.event = "message";
+  rec.duration_us = -1;
+  rec.rows = -1;
+  rec.target[0] = '\0';
+  snprintf(rec.message, sizeof(rec.message), "%s", msg);
+  submit(rec);
+}
+
+void sql_log_event(int level, const char *event, const char *server,
+    const char *database, int64_t duration_us, int64_t rows,
+    const char *fmt, ...)
+{
+  if (!sql_log_enabled(level))
+    return;
+
+  SqlLogRecord rec;
+  rec.level = level;
+  rec.event = event;
+  rec.duration_us = duration_us;
+  rec.rows = rows;
+  snprintf(rec.target, sizeof(rec.target), "%s/%s",
+      server != nullptr ? server : "", database != nullptr ? database : "");
+
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(rec.message, sizeof(rec.message), fmt, ap);
+  va_end(ap);
+  submit(rec);
+}
+
+}
@@ -0,0 +1,309 @@
+/*
+ * Copyright (c) 2012-2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+#include "SqlCancelToken.h"
+#include "SqlClient.h"
+#include "SqlParallelScan.h"
+
+namespace tds {
+
+// State shared by the workers of one run.
+struct SqlParallelScan::Shared {
+  std::mutex mutex;
+  std::condition_variable cond;
+  size_t ranges{0};
+  size_t next_range{0};
+
+  // First failure, everything else winds down once it's set.
+  bool failed{false};
+  std::exception_ptr error;
+  SqlCancelToken cancel;
+
+  // Run: consumer called by the workers.
+  const std::function<void(int, SqlRowBatch&)> *consumer{nullptr};
+
+  // RunOrdered: a bounded queue per range, drained in range order.
+  bool ordered{false};
+  const std::function<void(SqlRowBatch&)> *ordered_consumer{nullptr};
+  std::vector<std::deque<SqlRowBatch>> queues;
+  std::vector<bool> done;
+
+  void fail()
+  {
+    std::lock_guard<std::mutex> locker(mutex);
+    if (!failed) {
+      failed = true;
+      error = std::current_exception();
+    }
+    cancel.Cancel();
+    cond.notify_all();
+  }
+};
+
+SqlParallelScan::SqlParallelScan(const std::string& user,
+    const std::string& pass, const std::string& server,
+    const std::string& database, const SqlScanOptions& options) :
+  _user{user}, _pass{pass}, _server{server}, _database{database},
+  _options{options}
+{
+}
+
+SqlParallelScan::SqlParallelScan(const std::string& user,
+    const std::string& pass, const std::string& server,
+    const std::string& database, const SqlScanOptions& options,
+    const SqlConnectionOptions& conn_options) :
+  _user{user}, _pass{pass}, _server{server}, _database{database},
+  _options{options}, _conn_options{conn_options}
+{
+}
+
+static std::string where_clause(const std::string& filter)
+{
+  if (filter.empty())
+    return std::string();
+  return " WHERE (" + filter + ")";
+}
+
+void SqlParallelScan::compute_bounds()
+{
+  _bounds = _options.bounds;
+  if (!_bounds.empty())
+    return;
+
+  int ranges = _options.ranges > 0 ? _options.ranges : _options.workers;
+  if (ranges <= 1)
+    return;
+
+  SqlClient client(_user, _pass, _server, _database);
+  std::string sql;
+
+  if (_options.sample_percent > 0.0) {
+    // The largest key of each of the sample's quantiles.
+    sql = "SELECT MAX(k) FROM (SELECT " + _options.key + " AS k, NTILE(" +
+      std::to_string(ranges) + ") OVER (ORDER BY " + _options.key +
+      ") AS t FROM " + _options.table + " TABLESAMPLE (" +
+      std::to_string(_options.sample_percent) + " PERCENT)" +
+      where_clause(_options.where) + ") s GROUP BY t ORDER BY t";
+    client.ExecSql(sql.c_str(), true);
+    while (client.NextRow()) {
+      if (!client.IsNullCol(0))
+        _bounds.push_back(std::stoll(client.GetStringCol(0)));
+    }
+
+    // The last quantile ends at the sample's maximum, which isn't a split.
+    if (!_bounds.empty())
+      _bounds.pop_back();
+    for (auto& bound : _bounds)
+      bound++;
+  } else {
+    sql = "SELECT MIN(" + _options.key + "), MAX(" + _options.key + ") FROM " +
+      _options.table + where_clause(_options.where);
+    client.ExecSql(sql.c_str(), true);
+    if (client.NextRow() && !client.IsNullCol(0)) {
+      int64_t lo = std::stoll(client.GetStringCol(0));
+      int64_t hi = std::stoll(client.GetStringCol(1));
+      uint64_t span = static_cast<uint64_t>(hi) - static_cast<uint64_t>(lo);
+      for (int i = 1; i < ranges; i++) {
+        _bounds.push_back(static_cast<int64_t>(static_cast<uint64_t>(lo) +
+              span / ranges * i));
+      }
+    }
+  }
+  client.Dispose();
+
+  // Small or skewed tables can produce duplicate split points.
+  _bounds.erase(std::unique(_bounds.begin(), _bounds.end()), _bounds.end());
+}
+
+std::string SqlParallelScan::range_sql(size_t range, bool ordered) const
+{
+  std::string sql = "SELECT " + _options.columns + " FROM " + _options.table;
+
+  std::string cond;
+  if (!_bounds.empty()) {
+    // NULL keys sort first, they go with the first range.
+    if (range == 0) {
+      cond = "(" + _options.key + " < " + std::to_string(_bounds[0]) +
+        " OR " + _options.key + " IS NULL)";
+    } else {
+      cond = _options.key + " >= " + std::to_string(_bounds[range - 1]);
+      if (range < _bounds.size())
+        cond += " AND " + _options.key + " < " + std::to_string(_bounds[range]);
+    }
+  }
+
+  if (!_options.where.empty()) {
+    sql += " WHERE (" + _options.where + ")";
+    if (!cond.empty())
+      sql += " AND " + cond;
+  } else if (!cond.empty()) {
+    sql += " WHERE " + cond;
+  }
+
+  if (ordered)
+    sql += " ORDER BY " + _options.key;
+  return sql;
+}
+
+void SqlParallelScan::scan_range(Shared& shared, size_t range)
+{
+  std::optional<SqlClient> client;
+  if (_conn_options)
+    client.emplace(_user, _pass, _server, _database, *_conn_options);
+  else
+    client.emplace(_user, _pass, _server, _database);
+  client->SetCancelToken(&shared.cancel);
+
+  std::string sql = range_sql(range, shared.ordered);
+  client->ExecSql(sql.c_str(), true);
+
+  std::vector<std::string> names = client->GetAllColumnNames();
+  SqlRowBatch batch;
+  batch.Reset(names, _options.batch_rows);
+
+  // Hands the batch over, false if the run is being abandoned.
+  auto deliver = [&]() {
+    if (!shared.ordered) {
+      (*shared.consumer)(static_cast<int>(range), batch);
+      batch.Clear();
+      return !shared.cancel.IsCancelled();
+    }
+
+    std::unique_lock<std::mutex> locker(shared.mutex);
+    shared.cond.wait(locker, [&] {
+      return shared.failed || shared.queues[range].size() < _options.queue_batches;
+    });
+    if (shared.failed)
+      return false;
+    shared.queues[range].push_back(std::move(batch));
+    shared.cond.notify_all();
+    locker.unlock();
+
+    batch.Reset(names, _options.batch_rows);
+    return true;
+  };
+
+  while (client->NextRow()) {
+    batch.Append(*client);
+    if (batch.Rows() >= _options.batch_rows && !deliver())
+      return;
+  }
+  if (!batch.Empty() && !deliver())
+    return;
+
+  client->Dispose();
+}
+
+void SqlParallelScan::run(Shared& shared)
+{
+  compute_bounds();
+  shared.ranges = _bounds.size() + 1;
+  if (shared.ordered) {
+    shared.queues.resize(shared.ranges);
+    shared.done.assign(shared.ranges, false);
+  }
+
+  auto worker = [this, &shared]() {
+    for (;;) {
+      size_t range;
+      {
+        std::lock_guard<std::mutex> locker(shared.mutex);
+        if (shared.failed || shared.next_range >= shared.ranges)
+          return;
+        range = shared.next_range++;
+      }
+
+      try {
+        scan_range(shared, range);
+      } catch (...) {
+        shared.fail();
+        return;
+      }
+
+      if (shared.ordered) {
+        std::lock_guard<std::mutex> locker(shared.mutex);
+        shared.done[range] = true;
+        shared.cond.notify_all();
+      }
+    }
+  };
+
+  size_t workers = std::min<size_t>(std::max(_options.workers, 1), shared.ranges);
+  std::vector<std::thread> threads;
+  threads.reserve(workers);
+  for (size_t i = 0; i < workers; i++)
+    threads.emplace_back(worker);
+
+  if (shared.ordered) {
+    try {
+      for (size_t range = 0; range < shared.ranges; range++) {
+        for (;;) {
+          std::unique_lock<std::mutex> locker(shared.mutex);
+          shared.cond.wait(locker, [&] {
+            return shared.failed || !shared.queues[range].empty() ||
+              shared.done[range];
+          });
+          if (shared.failed)
+            break;
+          if (shared.queues[range].empty())
+            break;
+
+          SqlRowBatch batch = std::move(shared.queues[range].front());
+          shared.queues[range].pop_front();
+          shared.cond.notify_all();
+          locker.unlock();
+
+          (*shared.ordered_consumer)(batch);
+        }
+      }
+    } catch (...) {
+      shared.fail();
+    }
+  }
+
+  for (auto& thread : threads)
+    thread.join();
+
+  if (shared.error)
+    std::rethrow_exception(shared.error);
+}
+
+void SqlParallelScan::Run(
+    const std::function<void(int range, SqlRowBatch&)>& consumer)
+{
+  Shared shared;
+  shared.consumer = &consumer;
+  run(shared);
+}
+
+void SqlParallelScan::RunOrdered(
+    const std::function<void(SqlRowBatch&)>& consumer)
+{
+  Shared shared;
+  shared.ordered = true;
+  shared.ordered_consumer = &consumer;
+  run(shared);
+}
+
+}
@@ -73,4 +73,18 @@ void SqlParams::AddNull(const char *name, ParamType type)
   pvec.push_back(p);
 }
 
+std::string sql_quote_literal(const std::string& str)
+{
+  std::string quoted;
+  quoted.reserve(str.size() + 3);
+  quoted += "N'";
+  for (char c : str) {
+    if (c == '\'')
+      quoted += '\'';
+    quoted += c;
+  }
+  quoted += '\'';
+  return quoted;
+}
+
 }
@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2012-2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "SqlClient.h"
+#include "SqlPrefetchReader.h"
+
+namespace tds {
+
+SqlPrefetchReader::SqlPrefetchReader(SqlClient& client, size_t batch_rows,
+    size_t depth) :
+  _client{client}, _batch_rows{batch_rows > 0 ? batch_rows : 1},
+  _depth{depth > 0 ? depth : 1}, _names{client.GetAllColumnNames()}
+{
+  _thread = std::thread(&SqlPrefetchReader::fetch, this);
+}
+
+SqlPrefetchReader::~SqlPrefetchReader()
+{
+  {
+    std::lock_guard<std::mutex> locker(_mutex);
+    _stop = true;
+    _cond.notify_all();
+  }
+  _thread.join();
+}
+
+void SqlPrefetchReader::fetch()
+{
+  try {
+    for (;;) {
+      SqlRowBatch batch;
+      {
+        std::unique_lock<std::mutex> locker(_mutex);
+        _cond.wait(locker, [&] { return _stop || _ready.size() < _depth; });
+        if (_stop)
+          return;
+        if (!_free.empty()) {
+          batch = std::move(_free.back());
+          _free.pop_back();
+        }
+      }
+
+      // Reset keeps the vectors' capacity from the last time around.
+      batch.Reset(_names, _batch_rows);
+      bool more = true;
+      while (batch.Rows() < _batch_rows && (more = _client.NextRow()))
+        batch.Append(_client);
+
+      std::lock_guard<std::mutex> locker(_mutex);
+      if (!batch.Empty())
+        _ready.push_back(std::move(batch));
+      if (!more) {
+        _done = true;
+        _cond.notify_all();
+        return;
+      }
+      _cond.notify_all();
+    }
+  } catch (...) {
+    std::lock_guard<std::mutex> locker(_mutex);
+    _error = std::current_exception();
+    _done = true;
+    _cond.notify_all();
+  }
+}
+
+bool SqlPrefetchReader::NextBatch(SqlRowBatch& batch)
+{
+  std::unique_lock<std::mutex> locker(_mutex);
+  _cond.wait(locker, [&] { return !_ready.empty() || _done; });
+
+  if (_ready.empty()) {
+    if (_error)
+      std::rethrow_exception(_error);
+    return false;
+  }
+
+  // The consumer's previous batch goes back to the fetcher for reuse.
+  std::swap(batch, _ready.front());
+  if (_free.size() < _depth)
+    _free.push_back(std::move(_ready.front()));
+  _ready.pop_front();
+  _cond.notify_all();
+  return true;
+}
+
+bool SqlPrefetchReader::NextRow()
+{
+  if (_started && _row + 1 < _current.Rows()) {
+    _row++;
+    return true;
+  }
+
+  _started = true;
+  _row = 0;
+  return NextBatch(_current);
+}
+
+}
@@ -0,0 +1,606 @@
+/*
+ * Copyright (c) 2012-2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// FreeTDS stuff
+#define MSDBLIB 1
+#include <sqlfront.h>
+#include <sybdb.h>
+
+#include "SqlClient.h"
+#include "SqlProxy.h"
+
+namespace tds {
+
+static constexpr uint32_t null_len = 0xFFFFFFFF;
+static constexpr uint32_t max_frame = 64 << 20;
+
+namespace {
+
+struct Encoder {
+  std::string buf;
+
+  void u8(uint8_t v) { buf += static_cast<char>(v); }
+  void u32(uint32_t v) { buf.append(reinterpret_cast<const char *>(&v), sizeof(v)); }
+  void i32(int32_t v) { buf.append(reinterpret_cast<const char *>(&v), sizeof(v)); }
+  void str(const char *s, size_t len)
+  {
+    u32(static_cast<uint32_t>(len));
+    buf.append(s, len);
+  }
+  void str(const std::string& s) { str(s.data(), s.size()); }
+};
+
+// Reads values off a buffer, ok goes false instead of reading past end.
+struct Decoder {
+  const char *p;
+  const char *end;
+  bool ok{true};
+
+  bool have(size_t n)
+  {
+    if (ok && static_cast<size_t>(end - p) >= n)
+      return true;
+    ok = false;
+    return false;
+  }
+  uint8_t u8() { return have(1) ? static_cast<uint8_t>(*p++) : 0; }
+  uint32_t u32()
+  {
+    uint32_t v = 0;
+    if (have(sizeof(v))) {
+      memcpy(&v, p, sizeof(v));
+      p += sizeof(v);
+    }
+    return v;
+  }
+  int32_t i32() { return static_cast<int32_t>(u32()); }
+  std::string str()
+  {
+    uint32_t len = u32();
+    if (!have(len))
+      return std::string();
+    std::string s(p, len);
+    p += len;
+    return s;
+  }
+};
+
+}
+
+static bool write_all(int sock, const char *data, size_t len)
+{
+  while (len > 0) {
+    ssize_t n = send(sock, data, len, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    data += n;
+    len -= static_cast<size_t>(n);
+  }
+  return true;
+}
+
+static bool read_all(int sock, char *data, size_t len)
+{
+  while (len > 0) {
+    ssize_t n = recv(sock, data, len, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    data += n;
+    len -= static_cast<size_t>(n);
+  }
+  return true;
+}
+
+// Sends a length prefixed frame, with fd attached to its first byte.
+static bool write_frame(int sock, const std::string& payload, int fd = -1)
+{
+  uint32_t len = static_cast<uint32_t>(payload.size());
+  if (fd == -1) {
+    return write_all(sock, reinterpret_cast<const char *>(&len), sizeof(len)) &&
+      write_all(sock, payload.data(), payload.size());
+  }
+
+  struct iovec iov;
+  iov.iov_base = &len;
+  iov.iov_len = sizeof(len);
+
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  memset(&control, 0, sizeof(control));
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+  ssize_t n;
+  while ((n = sendmsg(sock, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR) {
+  }
+  if (n <= 0)
+    return false;
+
+  // The fd went with the first byte, the rest is plain data.
+  return write_all(sock, reinterpret_cast<const char *>(&len) + n,
+      sizeof(len) - n) && write_all(sock, payload.data(), payload.size());
+}
+
+// Reads a frame, *fd is set to a received descriptor or -1.
+static bool read_frame(int sock, std::string *payload, int *fd)
+{
+  uint32_t len;
+  *fd = -1;
+
+  struct iovec iov;
+  iov.iov_base = &len;
+  iov.iov_len = sizeof(len);
+
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control;
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  ssize_t n;
+  while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) {
+  }
+  if (n <= 0)
+    return false;
+
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr;
+      cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+      memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+  }
+
+  if (!read_all(sock, reinterpret_cast<char *>(&len) + n, sizeof(len) - n) ||
+      len > max_frame) {
+    return false;
+  }
+
+  payload->resize(len);
+  return read_all(sock, &(*payload)[0], len);
+}
+
+std::vector<db_param> SqlProxyRequest::ToParams() const
+{
+  std::vector<db_param> out;
+  out.reserve(params.size());
+  for (const auto& param : params) {
+    db_param p;
+    p.name = param.name.c_str();
+    p.type = param.type;
+    p.ivalue = param.ivalue;
+    if (param.is_null) {
+      p.pvalue = nullptr;
+      p.datalen = 0;
+    } else if (param.type == ParamType::String) {
+      p.pvalue = param.svalue.data();
+      p.datalen = static_cast<int>(param.svalue.size());
+    } else {
+      p.pvalue = nullptr;
+      p.datalen = param.type == ParamType::Bit ? 1 : -1;
+    }
+    out.push_back(p);
+  }
+  return out;
+}
+
+bool sql_proxy_read_request(int sock, SqlProxyRequest *req)
+{
+  std::string payload;
+  int fd;
+  if (!read_frame(sock, &payload, &fd))
+    return false;
+  if (fd != -1)
+    close(fd);
+
+  Decoder in{payload.data(), payload.data() + payload.size()};
+  req->op = static_cast<SqlProxyOp>(in.u8());
+  req->user = in.str();
+  req->pass = in.str();
+  req->server = in.str();
+  req->database = in.str();
+  req->text = in.str();
+  req->timeout_ms = in.i32();
+
+  uint32_t count = in.u32();
+  req->params.clear();
+  for (uint32_t i = 0; i < count && in.ok; i++) {
+    SqlProxyRequest::Param param;
+    param.name = in.str();
+    param.type = static_cast<ParamType>(in.u8());
+    param.is_null = in.u8() != 0;
+    param.ivalue = in.i32();
+    param.svalue = in.str();
+    req->params.push_back(std::move(param));
+  }
+  return in.ok && req->op >= SqlProxyOp::ExecSql &&
+    req->op <= SqlProxyOp::ExecNonQuery;
+}
+
+bool sql_proxy_send_response(int sock, const SqlStatus& status, int results_fd)
+{
+  Encoder out;
+  out.u8(status.Ok() ? 1 : 0);
+  if (!status) {
+    const SqlError& error = status.Error();
+    out.i32(static_cast<int32_t>(error.kind));
+    out.i32(error.msgno);
+    out.i32(error.severity);
+    out.i32(error.state);
+    out.i32(error.line);
+    out.str(error.server, strlen(error.server));
+    out.str(error.proc, strlen(error.proc));
+    out.str(error.message, strlen(error.message));
+    out.str(error.text, strlen(error.text));
+  }
+  out.u8(results_fd != -1 ? 1 : 0);
+  return write_frame(sock, out.buf, results_fd);
+}
+
+namespace {
+
+// Buffered writes to the results file.
+struct FileWriter {
+  int fd;
+  std::string buf;
+
+  void flush()
+  {
+    const char *data = buf.data();
+    size_t len = buf.size();
+    while (len > 0) {
+      ssize_t n = write(fd, data, len);
+      if (n < 0) {
+        if (errno == EINTR)
+          continue;
+        throw std::runtime_error(std::string("Failed to write results: ") +
+            strerror(errno));
+      }
+      data += n;
+      len -= static_cast<size_t>(n);
+    }
+    buf.clear();
+  }
+  void reserve(size_t len)
+  {
+    if (buf.size() + len > (1 << 20))
+      flush();
+  }
+  void u8(uint8_t v)
+  {
+    reserve(1);
+    buf += static_cast<char>(v);
+  }
+  void u32(uint32_t v)
+  {
+    reserve(sizeof(v));
+    buf.append(reinterpret_cast<const char *>(&v), sizeof(v));
+  }
+  void bytes(const char *data, size_t len)
+  {
+    u32(static_cast<uint32_t>(len));
+    reserve(len);
+    buf.append(data, len);
+  }
+};
+
+}
+
+int sql_proxy_write_results(SqlClient& client)
+{
+  int fd = memfd_create("sql_poold", MFD_CLOEXEC);
+  if (fd == -1) {
+    throw std::runtime_error(std::string("Failed to create results file: ") +
+        strerror(errno));
+  }
+
+  try {
+    FileWriter out{fd, std::string()};
+    do {
+      int cols = client.GetColumnCount();
+      if (cols <= 0)
+        continue;
+
+      out.u8(1);
+      out.u32(static_cast<uint32_t>(cols));
+      std::vector<int> types(cols);
+      std::vector<std::string> names = client.GetAllColumnNames();
+      for (int col = 0; col < cols; col++) {
+        types[col] = client.GetColumnType(col);
+        out.bytes(names[col].data(), names[col].size());
+      }
+
+      while (client.NextRow()) {
+        out.u8(1);
+        for (int col = 0; col < cols; col++) {
+          int len;
+          const unsigned char *data = client.GetColumnData(col, &len);
+          if (data == nullptr) {
+            out.u32(null_len);
+          } else if (types[col] == SYBCHAR || types[col] == SYBVARCHAR ||
+              types[col] == SYBTEXT) {
+            out.bytes(reinterpret_cast<const char *>(data), len);
+          } else {
+            char text[512];
+            int n = client.ConvertColToText(col, text, sizeof(text));
+            if (n >= 0) {
+              out.bytes(text, n);
+            } else {
+              std::string str = client.GetStringCol(col);
+              out.bytes(str.data(), str.size());
+            }
+          }
+        }
+      }
+      out.u8(0);
+    } while (client.NextResult());
+    out.u8(0);
+    out.flush();
+  } catch (...) {
+    close(fd);
+    throw;
+  }
+  return fd;
+}
+
+SqlProxyClient::SqlProxyClient(const std::string& socket_path) :
+  _path{socket_path}
+{
+}
+
+SqlProxyClient::~SqlProxyClient()
+{
+  Dispose();
+  if (_sock != -1)
+    close(_sock);
+}
+
+static SqlStatus proxy_error(SqlErrorKind kind, const char *what)
+{
+  SqlError error;
+  error.kind = kind;
+  snprintf(error.message, sizeof(error.message), "%s", what);
+  snprintf(error.text, sizeof(error.text), "SqlProxyClient > %s", what);
+  return SqlStatus(error);
+}
+
+bool SqlProxyClient::connect_socket()
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (_path.size() >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return false;
+  }
+  memcpy(addr.sun_path, _path.c_str(), _path.size());
+
+  _sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (_sock == -1)
+    return false;
+
+  if (connect(_sock, reinterpret_cast<struct sockaddr *>(&addr),
+        sizeof(addr)) == -1) {
+    int err = errno;
+    close(_sock);
+    _sock = -1;
+    errno = err;
+    return false;
+  }
+  return true;
+}
+
+SqlStatus SqlProxyClient::Exec(SqlProxyOp op, const std::string& user,
+    const std::string& pass, const std::string& server,
+    const std::string& database, const char *text,
+    SqlParamSpan params, std::chrono::milliseconds timeout)
+{
+  Dispose();
+
+  if (_sock == -1 && !connect_socket()) {
+    std::string what = "Failed to connect to " + _path + ": " + strerror(errno);
+    return proxy_error(SqlErrorKind::ConnectionLost, what.c_str());
+  }
+
+  Encoder out;
+  out.u8(static_cast<uint8_t>(op));
+  out.str(user);
+  out.str(pass);
+  out.str(server);
+  out.str(database);
+  out.str(text, strlen(text));
+  out.i32(static_cast<int32_t>(timeout.count()));
+  out.u32(static_cast<uint32_t>(params.size()));
+  for (const auto& param : params) {
+    bool is_null = param.type == ParamType::String ?
+      param.pvalue == nullptr : param.datalen == 0;
+    out.str(param.name != nullptr ? param.name : "",
+        param.name != nullptr ? strlen(param.name) : 0);
+    out.u8(static_cast<uint8_t>(param.type));
+    out.u8(is_null ? 1 : 0);
+    out.i32(param.ivalue);
+    if (param.type == ParamType::String && !is_null)
+      out.str(static_cast<const char *>(param.pvalue), param.datalen);
+    else
+      out.str("", 0);
+  }
+
+  std::string payload;
+  int fd = -1;
+  if (!write_frame(_sock, out.buf) || !read_frame(_sock, &payload, &fd)) {
+    // The daemon went away, try a fresh connection next time.
+    close(_sock);
+    _sock = -1;
+    return proxy_error(SqlErrorKind::ConnectionLost,
+        "Lost connection to sql_poold");
+  }
+
+  Decoder in{payload.data(), payload.data() + payload.size()};
+  if (in.u8() == 0) {
+    SqlError error;
+    error.kind = static_cast<SqlErrorKind>(in.i32());
+    error.msgno = in.i32();
+    error.severity = in.i32();
+    error.state = in.i32();
+    error.line = in.i32();
+    snprintf(error.server, sizeof(error.server), "%s", in.str().c_str());
+    snprintf(error.proc, sizeof(error.proc), "%s", in.str().c_str());
+    snprintf(error.message, sizeof(error.message), "%s", in.str().c_str());
+    snprintf(error.text, sizeof(error.text), "%s", in.str().c_str());
+    if (fd != -1)
+      close(fd);
+    return SqlStatus(error);
+  }
+
+  if (fd != -1) {
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map != MAP_FAILED) {
+        _map = static_cast<const char *>(map);
+        _map_len = static_cast<size_t>(st.st_size);
+      }
+    }
+    close(fd);
+
+    if (_map == nullptr)
+      return proxy_error(SqlErrorKind::General, "Failed to map results");
+    _pos = _map;
+    read_result_header();
+  }
+  return SqlStatus();
+}
+
+bool SqlProxyClient::read_result_header()
+{
+  _in_rows = false;
+  _names.clear();
+  _cells.clear();
+  if (_pos == nullptr)
+    return false;
+
+  Decoder in{_pos, _map + _map_len};
+  if (in.u8() != 1) {
+    _pos = nullptr;
+    return false;
+  }
+
+  uint32_t cols = in.u32();
+  for (uint32_t i = 0; i < cols && in.ok; i++)
+    _names.push_back(in.str());
+  if (!in.ok) {
+    _pos = nullptr;
+    _names.clear();
+    return false;
+  }
+
+  _pos = in.p;
+  _cells.resize(cols);
+  _in_rows = true;
+  return true;
+}
+
+bool SqlProxyClient::NextRow()
+{
+  if (!_in_rows)
+    return false;
+
+  Decoder in{_pos, _map + _map_len};
+  if (in.u8() != 1) {
+    _pos = in.ok ? in.p : nullptr;
+    _in_rows = false;
+    return false;
+  }
+
+  for (auto& cell : _cells) {
+    uint32_t len = in.u32();
+    if (len == null_len) {
+      cell = {nullptr, 0};
+    } else if (in.have(len)) {
+      cell = {in.p, len};
+      in.p += len;
+    }
+  }
+  if (!in.ok) {
+    _pos = nullptr;
+    _in_rows = false;
+    return false;
+  }
+
+  _pos = in.p;
+  return true;
+}
+
+bool SqlProxyClient::NextResult()
+{
+  while (NextRow()) {
+  }
+  return read_result_header();
+}
+
+void SqlProxyClient::Dispose()
+{
+  if (_map != nullptr)
+    munmap(const_cast<char *>(_map), _map_len);
+  _map = nullptr;
+  _map_len = 0;
+  _pos = nullptr;
+  _in_rows = false;
+  _names.clear();
+  _cells.clear();
+}
+
+int SqlProxyClient::GetOrdinal(const char *name) const
+{
+  for (size_t i = 0; i < _names.size(); i++) {
+    if (_names[i] == name)
+      return static_cast<int>(i);
+  }
+  throw std::runtime_error(std::string("Unable to find column: ") + name);
+}
+
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2012-2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+// FreeTDS stuff
+#define MSDBLIB 1
+#include <sqlfront.h>
+#include <sybdb.h>
+
+#include "SqlClient.h"
+#include "SqlRowBatch.h"
+
+namespace tds {
+
+void SqlRowBatch::Reset(const std::vector<std::string>& names,
+    size_t reserve_rows)
+{
+  _columns.resize(names.size());
+  for (size_t i = 0; i < names.size(); i++) {
+    _columns[i].name = names[i];
+    _columns[i].values.reserve(reserve_rows);
+    _columns[i].nulls.clear();
+    _columns[i].nulls.reserve(reserve_rows);
+  }
+  _rows = 0;
+}
+
+void SqlRowBatch::Clear()
+{
+  for (auto& column : _columns)
+    column.nulls.clear();
+  _rows = 0;
+}
+
+// Copies a value into the string left in the slot by an earlier row, so
+// once the batch has been through a few rows its cells stop allocating.
+static void assign_value(SqlClient& client, int col, std::string& out)
+{
+  int type = client.GetColumnType(col);
+  if (type == SYBCHAR || type == SYBTEXT) {
+    int len;
+    const unsigned char *data = client.GetColumnData(col, &len);
+    out.assign(reinterpret_cast<const char *>(data), len);
+    return;
+  }
+
+  char text[4096];
+  int n = client.ConvertColToText(col, text, sizeof(text));
+  if (n >= 0)
+    out.assign(text, n);
+  else
+    out = client.GetStringCol(col);
+}
+
+void SqlRowBatch::Append(SqlClient& client)
+{
+  for (size_t i = 0; i < _columns.size(); i++) {
+    Column& column = _columns[i];
+    int col = static_cast<int>(i);
+    if (column.values.size() == _rows)
+      column.values.emplace_back();
+    bool null = client.IsNullCol(col);
+    if (null)
+      column.values[_rows].clear();
+    else
+      assign_value(client, col, column.values[_rows]);
+    column.nulls.push_back(null);
+  }
+  _rows++;
+}
+
+}
@@ -0,0 +1,291 @@
+/*
+ * Copyright (c) 2012-2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// FreeTDS stuff
+#define MSDBLIB 1
+#include <sqlfront.h>
+#include <sybdb.h>
+
+#include "SqlClient.h"
+#include "SqlRowset.h"
+
+namespace tds {
+
+int64_t SqlRowsetTable::GetInt64(size_t row, size_t col) const
+{
+  const Column& c = _columns[col];
+  if (IsNull(row, col))
+    return 0;
+
+  switch (c.type) {
+  case SqlRowsetType::Int:
+    return c.ints[row];
+  case SqlRowsetType::Float:
+    return static_cast<int64_t>(c.floats[row]);
+  default:
+    return strtoll(std::string(GetText(row, col)).c_str(), nullptr, 10);
+  }
+}
+
+double SqlRowsetTable::GetDouble(size_t row, size_t col) const
+{
+  const Column& c = _columns[col];
+  if (IsNull(row, col))
+    return 0.0;
+
+  switch (c.type) {
+  case SqlRowsetType::Int:
+    return static_cast<double>(c.ints[row]);
+  case SqlRowsetType::Float:
+    return c.floats[row];
+  default:
+    return strtod(std::string(GetText(row, col)).c_str(), nullptr);
+  }
+}
+
+std::string SqlRowsetTable::GetString(size_t row, size_t col) const
+{
+  const Column& c = _columns[col];
+  if (IsNull(row, col))
+    return std::string();
+
+  switch (c.type) {
+  case SqlRowsetType::Int:
+    return std::to_string(c.ints[row]);
+  case SqlRowsetType::Float: {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.17g", c.floats[row]);
+    return buf;
+  }
+  default:
+    return std::string(GetText(row, col));
+  }
+}
+
+std::shared_ptr<const SqlRowset> SqlRowset::Load(SqlClient& client,
+    const SqlRowsetOptions& options)
+{
+  std::shared_ptr<SqlRowset> rowset(new SqlRowset());
+  rowset->load(client, options);
+  return rowset;
+}
+
+SqlRowset::~SqlRowset()
+{
+  if (_map != nullptr)
+    munmap(_map, _arena_size);
+  if (_fd != -1)
+    close(_fd);
+}
+
+static void write_all(int fd, const char *data, size_t len)
+{
+  while (len > 0) {
+    ssize_t n = write(fd, data, len);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      throw std::runtime_error(std::string("Failed to spill rowset: ") +
+          strerror(errno));
+    }
+    data += n;
+    len -= static_cast<size_t>(n);
+  }
+}
+
+void SqlRowset::flush_spill()
+{
+  write_all(_fd, _spill_buf.data(), _spill_buf.size());
+  _spill_buf.clear();
+}
+
+void SqlRowset::append_text(const char *data, size_t len,
+    const SqlRowsetOptions& options)
+{
+  _arena_size += len;
+
+  if (_fd == -1) {
+    _heap.insert(_heap.end(), data, data + len);
+    if (_heap.size() <= options.spill_threshold)
+      return;
+
+    // Too big to keep on the heap, move what we have to a temp file. It's
+    // unlinked right away so nothing is left behind if we crash.
+    std::string path = options.temp_dir + "/sql_rowset.XXXXXX";
+    _fd = mkstemp(&path[0]);
+    if (_fd == -1) {
+      throw std::runtime_error(std::string("Failed to create rowset file: ") +
+          strerror(errno));
+    }
+    unlink(path.c_str());
+
+    write_all(_fd, _heap.data(), _heap.size());
+    std::vector<char>().swap(_heap);
+    _spill_buf.reserve(1 << 20);
+    return;
+  }
+
+  if (_spill_buf.size() + len > _spill_buf.capacity())
+    flush_spill();
+  if (len >= _spill_buf.capacity())
+    write_all(_fd, data, len);
+  else
+    _spill_buf.insert(_spill_buf.end(), data, data + len);
+}
+
+void SqlRowset::finish()
+{
+  const char *arena = _heap.data();
+
+  if (_fd != -1) {
+    flush_spill();
+    std::vector<char>().swap(_spill_buf);
+
+    _map = mmap(nullptr, _arena_size, PROT_READ, MAP_PRIVATE, _fd, 0);
+    if (_map == MAP_FAILED) {
+      _map = nullptr;
+      throw std::runtime_error(std::string("Failed to map rowset file: ") +
+          strerror(errno));
+    }
+    arena = static_cast<const char *>(_map);
+  }
+
+  for (auto& table : _tables)
+    table._arena = arena;
+}
+
+static SqlRowsetType storage_type(int type)
+{
+  switch (type) {
+  case SYBINT1:
+  case SYBINT2:
+  case SYBINT4:
+  case SYBINT8:
+  case SYBBIT:
+    return SqlRowsetType::Int;
+  case SYBFLT8:
+  case SYBREAL:
+    return SqlRowsetType::Float;
+  default:
+    return SqlRowsetType::Text;
+  }
+}
+
+template <typename T>
+static T load_value(const unsigned char *data)
+{
+  T value;
+  memcpy(&value, data, sizeof(value));
+  return value;
+}
+
+void SqlRowset::load(SqlClient& client, const SqlRowsetOptions& options)
+{
+  do {
+    int cols = client.GetColumnCount();
+    if (cols <= 0)
+      continue;
+
+    _tables.emplace_back();
+    SqlRowsetTable& table = _tables.back();
+
+    std::vector<std::string> names = client.GetAllColumnNames();
+    std::vector<int> types(cols);
+    table._columns.resize(cols);
+    for (int col = 0; col < cols; col++) {
+      types[col] = client.GetColumnType(col);
+      auto& column = table._columns[col];
+      column.name = names[col];
+      column.type = storage_type(types[col]);
+      if (column.type == SqlRowsetType::Text)
+        column.offsets.push_back(_arena_size);
+    }
+
+    size_t row = 0;
+    while (client.NextRow()) {
+      for (int col = 0; col < cols; col++) {
+        auto& column = table._columns[col];
+        if (row % 64 == 0)
+          column.nulls.push_back(0);
+
+        int len;
+        const unsigned char *data = client.GetColumnData(col, &len);
+        if (data == nullptr)
+          column.nulls.back() |= uint64_t{1} << (row % 64);
+
+        switch (column.type) {
+        case SqlRowsetType::Int: {
+          int64_t value = 0;
+          if (data != nullptr) {
+            switch (types[col]) {
+            case SYBINT1: case SYBBIT: value = data[0]; break;
+            case SYBINT2: value = load_value<int16_t>(data); break;
+            case SYBINT4: value = load_value<int32_t>(data); break;
+            default: value = load_value<int64_t>(data); break;
+            }
+          }
+          column.ints.push_back(value);
+          break;
+        }
+        case SqlRowsetType::Float: {
+          double value = 0.0;
+          if (data != nullptr) {
+            value = types[col] == SYBFLT8 ? load_value<double>(data) :
+              load_value<float>(data);
+          }
+          column.floats.push_back(value);
+          break;
+        }
+        case SqlRowsetType::Text:
+          if (data != nullptr) {
+            int type = types[col];
+            if (type == SYBCHAR || type == SYBVARCHAR || type == SYBTEXT ||
+                type == SYBBINARY || type == SYBVARBINARY || type == SYBIMAGE) {
+              append_text(reinterpret_cast<const char *>(data), len, options);
+            } else {
+              char text[512];
+              int n = client.ConvertColToText(col, text, sizeof(text));
+              if (n >= 0) {
+                append_text(text, n, options);
+              } else {
+                std::string str = client.GetStringCol(col);
+                append_text(str.data(), str.size(), options);
+              }
+            }
+          }
+          column.offsets.push_back(_arena_size);
+          break;
+        }
+      }
+      row++;
+    }
+    table._rows = row;
+  } while (client.NextResult());
+
+  // Everything is in memory, the connection can go.
+  client.Release();
+  finish();
+}
+
+}
@@ -0,0 +1,227 @@
+/*
+ * Copyright (c) 2012-2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+
+#include "SqlConnectionFactory.h"
+#include "SqlScatter.h"
+
+namespace tds {
+
+SqlScatter::SqlScatter(const std::string& user, const std::string& pass,
+    const SqlScatterOptions& options) :
+  _user{user}, _pass{pass}, _options{options}
+{
+  // With no room on any server nothing would ever run.
+  _options.max_per_server = std::max(_options.max_per_server, 1);
+}
+
+static SqlStatus status_from(const std::exception& e)
+{
+  if (const auto *sql = dynamic_cast<const SqlException *>(&e))
+    return SqlStatus(sql->Error());
+
+  SqlError error;
+  error.kind = SqlErrorKind::General;
+  snprintf(error.message, sizeof(error.message), "%s", e.what());
+  snprintf(error.text, sizeof(error.text), "%s", e.what());
+  return SqlStatus(error);
+}
+
+// A target whose rows were cut off because the run was stopped.
+static SqlStatus aborted_status()
+{
+  SqlError error;
+  error.kind = SqlErrorKind::Cancelled;
+  snprintf(error.message, sizeof(error.message),
+      "Stopped after a consumer failure");
+  snprintf(error.text, sizeof(error.text),
+      "SqlScatter > Stopped after a consumer failure");
+  return SqlStatus(error);
+}
+
+std::vector<SqlScatterResult> SqlScatter::Run(
+    const std::vector<SqlShard>& targets, const Call& call,
+    const Consumer& consumer)
+{
+  std::vector<SqlScatterResult> results(targets.size());
+
+  std::mutex mutex;
+  std::condition_variable cond;
+  std::vector<size_t> pending(targets.size());
+  for (size_t i = 0; i < pending.size(); i++)
+    pending[i] = i;
+  std::map<std::string, int> in_flight;
+
+  // A consumer failure ends the whole run.
+  std::mutex consumer_mutex;
+  std::exception_ptr consumer_error;
+  bool stop = false;
+
+  // Picks the next target whose server has room, preferring one that an
+  // idle pooled connection is already using. Returns targets.size() when
+  // there is nothing left.
+  auto next_target = [&]() {
+    std::unique_lock<std::mutex> locker(mutex);
+    for (;;) {
+      if (stop || pending.empty())
+        return targets.size();
+
+      std::set<std::pair<std::string, std::string>> idle;
+      if (pending.size() > 1) {
+        for (auto& target : SqlConnectionFactory::instance().idle_targets())
+          idle.insert(std::move(target));
+      }
+
+      auto best = pending.end();
+      for (auto it = pending.begin(); it != pending.end(); ++it) {
+        const SqlShard& shard = targets[*it];
+        if (in_flight[shard.server] >= _options.max_per_server)
+          continue;
+        if (best == pending.end())
+          best = it;
+        if (idle.count({shard.server, shard.database}) > 0) {
+          best = it;
+          break;
+        }
+      }
+
+      if (best != pending.end()) {
+        size_t target = *best;
+        pending.erase(best);
+        in_flight[targets[target].server]++;
+        return target;
+      }
+      cond.wait(locker);
+    }
+  };
+
+  auto finish_target = [&](size_t target) {
+    std::lock_guard<std::mutex> locker(mutex);
+    in_flight[targets[target].server]--;
+    cond.notify_all();
+  };
+
+  auto deliver = [&](size_t target, SqlRowBatch& batch) {
+    std::lock_guard<std::mutex> locker(consumer_mutex);
+    if (consumer_error)
+      return false;
+    try {
+      consumer(target, batch);
+    } catch (...) {
+      consumer_error = std::current_exception();
+      std::lock_guard<std::mutex> sched_locker(mutex);
+      stop = true;
+      cond.notify_all();
+      return false;
+    }
+    batch.Clear();
+    return true;
+  };
+
+  auto run_target = [&](size_t target) {
+    const SqlShard& shard = targets[target];
+    SqlScatterResult& result = results[target];
+    auto start = std::chrono::steady_clock::now();
+
+    try {
+      SqlClient client(_user, _pass, shard.server, shard.database);
+      client.SetTimeout(_options.timeout);
+      client.SetRetryPolicy(_options.retry);
+
+      SqlStatus status = call(client);
+      SqlRowBatch batch;
+      bool aborted = false;
+      for (bool more = status.Ok(); more && status && !aborted; ) {
+        batch.Reset(client.GetAllColumnNames(), _options.batch_rows);
+
+        bool has_row;
+        while ((status = client.TryNextRow(&has_row)) && has_row) {
+          batch.Append(client);
+          result.rows++;
+          if (batch.Rows() >= _options.batch_rows && !deliver(target, batch)) {
+            aborted = true;
+            break;
+          }
+        }
+        if (aborted || !status)
+          break;
+        if (!batch.Empty() && !deliver(target, batch)) {
+          aborted = true;
+          break;
+        }
+
+        status = client.TryNextResult(&more);
+      }
+      result.status = aborted ? aborted_status() : status;
+    } catch (const std::exception& e) {
+      result.status = status_from(e);
+    }
+
+    result.elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start);
+  };
+
+  auto worker = [&]() {
+    for (;;) {
+      size_t target = next_target();
+      if (target == targets.size())
+        return;
+      run_target(target);
+      finish_target(target);
+    }
+  };
+
+  size_t workers = std::min<size_t>(std::max(_options.max_threads, 1),
+      targets.size());
+  std::vector<std::thread> threads;
+  threads.reserve(workers);
+  for (size_t i = 0; i < workers; i++)
+    threads.emplace_back(worker);
+  for (auto& thread : threads)
+    thread.join();
+
+  if (consumer_error)
+    std::rethrow_exception(consumer_error);
+  return results;
+}
+
+std::vector<SqlScatterResult> SqlScatter::ExecSql(
+    const std::vector<SqlShard>& targets, const char *sql,
+    const Consumer& consumer)
+{
+  return Run(targets, [sql](SqlClient& client) {
+    return client.TryExecSql(sql);
+  }, consumer);
+}
+
+std::vector<SqlScatterResult> SqlScatter::ExecStoredProc(
+    const std::vector<SqlShard>& targets, const char *proc,
+    const std::vector<db_param>& params, const Consumer& consumer)
+{
+  return Run(targets, [proc, &params](SqlClient& client) {
+    return client.TryExecStoredProc(proc, params);
+  }, consumer);
+}
+
+}
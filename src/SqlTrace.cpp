@@ -0,0 +1,419 @@
+/*
+ * Copyright (c) 2012-2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <mutex>
+#include <random>
+#include <unordered_map>
+
+#include "SqlLog.h"
+#include "SqlTrace.h"
+
+namespace tds {
+
+std::atomic<bool> g_sql_trace_enabled{false};
+
+static std::mutex g_trace_mutex;
+static SqlTraceOptions g_trace_options;
+static std::unordered_map<uint64_t, SqlTraceStat> g_trace_stats;
+
+void sql_trace_start(const SqlTraceOptions& options)
+{
+  std::lock_guard<std::mutex> locker(g_trace_mutex);
+  g_trace_options = options;
+  g_sql_trace_enabled.store(true);
+}
+
+void sql_trace_stop()
+{
+  g_sql_trace_enabled.store(false);
+}
+
+std::vector<SqlTraceStat> sql_trace_stats()
+{
+  std::vector<SqlTraceStat> stats;
+  {
+    std::lock_guard<std::mutex> locker(g_trace_mutex);
+    stats.reserve(g_trace_stats.size());
+    for (const auto& entry : g_trace_stats)
+      stats.push_back(entry.second);
+  }
+
+  std::sort(stats.begin(), stats.end(),
+      [](const SqlTraceStat& a, const SqlTraceStat& b) {
+        return a.total_us > b.total_us;
+      });
+  return stats;
+}
+
+void sql_trace_reset()
+{
+  std::lock_guard<std::mutex> locker(g_trace_mutex);
+  g_trace_stats.clear();
+}
+
+static bool is_ident(char c)
+{
+  return isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '@' ||
+    c == '#' || c == '$';
+}
+
+// Length of the string or numeric literal starting at p, 0 if there isn't
+// one. after_ident says whether p directly follows an identifier character,
+// in which case digits are part of a name (t1, @p2).
+static size_t literal_length(const char *p, bool after_ident)
+{
+  const char *s = p;
+
+  if (!after_ident && (*s == 'N' || *s == 'n') && s[1] == '\'')
+    s++;
+
+  if (*s == '\'') {
+    for (s++; *s != '\0'; s++) {
+      if (*s == '\'') {
+        if (s[1] != '\'')
+          return s + 1 - p;
+        s++;
+      }
+    }
+    return s - p;
+  }
+
+  if (after_ident || !isdigit(static_cast<unsigned char>(*p)))
+    return 0;
+
+  // Covers decimals, 0x binary literals and exponents.
+  for (s = p; isalnum(static_cast<unsigned char>(*s)) || *s == '.'; s++) {
+    if ((*s == 'e' || *s == 'E') && (s[1] == '+' || s[1] == '-'))
+      s++;
+  }
+  return s - p;
+}
+
+// Skips whitespace and comments.
+static const char *skip_space(const char *p)
+{
+  for (;;) {
+    if (isspace(static_cast<unsigned char>(*p))) {
+      p++;
+    } else if (p[0] == '-' && p[1] == '-') {
+      while (*p != '\0' && *p != '\n')
+        p++;
+    } else if (p[0] == '/' && p[1] == '*') {
+      p += 2;
+      while (*p != '\0' && !(p[0] == '*' && p[1] == '/'))
+        p++;
+      if (*p != '\0')
+        p += 2;
+    } else {
+      return p;
+    }
+  }
+}
+
+// Skips the parenthesized tuple starting at p, minding string literals.
+static const char *skip_tuple(const char *p)
+{
+  int depth = 0;
+  while (*p != '\0') {
+    if (*p == '\'') {
+      p += literal_length(p, false);
+      continue;
+    }
+    if (*p == '(') {
+      depth++;
+    } else if (*p == ')' && --depth == 0) {
+      return p + 1;
+    }
+    p++;
+  }
+  return p;
+}
+
+static bool is_word(char c)
+{
+  return is_ident(c) || c == '?' || c == '[' || c == ']' || c == '"';
+}
+
+static bool is_operator(char c)
+{
+  return strchr("<>=!+-*/%&|^~", c) != nullptr;
+}
+
+// Spacing between tokens is made uniform so that "a=1" and "a = 1" give the
+// same fingerprint, had_space says whether the statement had any.
+static bool needs_space(char last, char next, bool had_space)
+{
+  if (next == ',' || next == ')' || next == '.' || last == '(' || last == '.')
+    return false;
+  if (is_word(last) && (is_word(next) || next == '('))
+    return had_space;
+  if (is_operator(last) && is_operator(next))
+    return false;
+  return true;
+}
+
+uint64_t sql_fingerprint(const char *sql, char *out, size_t out_size)
+{
+  uint64_t hash = 14695981039346656037ULL; // FNV-1a
+  size_t len = 0;
+
+  char last = '\0';
+  auto emit = [&](char c) {
+    last = c;
+    hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ULL;
+    if (len + 1 < out_size)
+      out[len++] = c;
+  };
+
+  bool after_ident = false;
+  bool after_literal = false;
+  bool space = false;
+  const char *p = skip_space(sql);
+
+  // The last word, to tell literal lists (IN (...) and VALUES (...)) from
+  // select lists and function arguments. Bit n of lists is set while the
+  // parenthesis at depth n opened one.
+  char word[8];
+  size_t word_len = 0;
+  uint64_t lists = 0;
+  int depth = 0;
+  int in_values = 0;        // Depth of the open VALUES row, if any
+  bool values_rows = false; // Just closed a VALUES row, more may follow
+  auto is_word_now = [&](const char *kw) {
+    return word_len == strlen(kw) && memcmp(word, kw, word_len) == 0;
+  };
+
+  while (*p != '\0') {
+    if (const char *q = skip_space(p); q != p) {
+      p = q;
+      space = true;
+      after_ident = false;
+      continue;
+    }
+
+    // Further VALUES rows collapse into the first one.
+    if (*p == ',' && values_rows) {
+      if (const char *q = skip_space(p + 1); *q == '(') {
+        p = skip_tuple(q);
+        space = false;
+        continue;
+      }
+    }
+    values_rows = false;
+
+    // "IN (1, 2, 3)" fingerprints the same as "IN (1)".
+    if (*p == ',' && after_literal && depth > 0 && depth < 64 &&
+        (lists >> depth) & 1) {
+      const char *q = skip_space(p + 1);
+      if (size_t skip = literal_length(q, false); skip > 0) {
+        p = q + skip;
+        space = false;
+        continue;
+      }
+    }
+
+    size_t n = literal_length(p, after_ident);
+    if (len > 0 && needs_space(last, n > 0 ? '?' : *p, space))
+      emit(' ');
+    space = false;
+
+    if (n > 0) {
+      emit('?');
+      p += n;
+      after_ident = false;
+      after_literal = true;
+      word_len = 0;
+      continue;
+    }
+
+    // Quoted identifiers are kept as is.
+    if (*p == '[' || *p == '"') {
+      word_len = 0;
+      char close = *p == '[' ? ']' : '"';
+      emit(*p++);
+      while (*p != '\0' && *p != close)
+        emit(*p++);
+      if (*p != '\0')
+        emit(*p++);
+      after_ident = false;
+      after_literal = false;
+      continue;
+    }
+
+    char c = static_cast<char>(tolower(static_cast<unsigned char>(*p)));
+    if (c == '(') {
+      bool values = is_word_now("values");
+      if (++depth < 64 && (values || is_word_now("in")))
+        lists |= uint64_t{1} << depth;
+      if (values)
+        in_values = depth;
+    } else if (c == ')' && depth > 0) {
+      if (depth < 64)
+        lists &= ~(uint64_t{1} << depth);
+      depth--;
+      values_rows = in_values == depth + 1;
+      if (values_rows)
+        in_values = 0;
+    }
+
+    if (is_ident(c)) {
+      if (!after_ident)
+        word_len = 0;
+      if (word_len < sizeof(word))
+        word[word_len++] = c;
+    } else {
+      word_len = 0;
+    }
+
+    after_ident = is_ident(*p);
+    after_literal = false;
+    emit(c);
+    p++;
+  }
+
+  if (out_size > 0)
+    out[len] = '\0';
+  return hash;
+}
+
+void SqlTraceSpan::Begin(const char *text, bool is_proc)
+{
+  _active = sql_trace_enabled();
+  if (!_active)
+    return;
+
+  _failed = false;
+  _attempts = 0;
+  _rows = 0;
+  _checkout_us = 0;
+  _start = std::chrono::steady_clock::now();
+  _sent = _start;
+
+  if (is_proc) {
+    // Procedure names are already a fingerprint, just fold the case.
+    size_t len = 0;
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char *p = text; *p != '\0'; p++) {
+      char c = static_cast<char>(tolower(static_cast<unsigned char>(*p)));
+      hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ULL;
+      if (len + 1 < sizeof(_text))
+        _text[len++] = c;
+    }
+    _text[len] = '\0';
+    _fingerprint = hash;
+  } else {
+    _fingerprint = sql_fingerprint(text, _text, sizeof(_text));
+  }
+
+  // Fingerprint 0 is reserved for the overflow bucket.
+  if (_fingerprint == 0)
+    _fingerprint = 1;
+}
+
+void SqlTraceSpan::Checkout(std::chrono::steady_clock::time_point start)
+{
+  if (_active) {
+    _checkout_us += std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+  }
+}
+
+void SqlTraceSpan::Sent(bool ok)
+{
+  if (_active) {
+    _sent = std::chrono::steady_clock::now();
+    _failed = !ok;
+    _attempts++;
+  }
+}
+
+static int64_t micros(std::chrono::steady_clock::duration d)
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+}
+
+void SqlTraceSpan::End(const std::string& server, const std::string& database)
+{
+  if (!_active)
+    return;
+  _active = false;
+
+  auto now = std::chrono::steady_clock::now();
+  int64_t total_us = micros(now - _start);
+  int64_t exec_us = std::max<int64_t>(0, micros(_sent - _start) - _checkout_us);
+  int64_t first_row_us = _rows > 0 ? micros(_first_row - _sent) : 0;
+  int64_t drain_us = micros(now - (_rows > 0 ? _first_row : _sent));
+
+  bool slow = false;
+  bool sampled = false;
+  {
+    std::lock_guard<std::mutex> locker(g_trace_mutex);
+
+    uint64_t key = _fingerprint;
+    auto it = g_trace_stats.find(key);
+    if (it == g_trace_stats.end()) {
+      if (g_trace_stats.size() >= g_trace_options.max_fingerprints) {
+        key = 0;
+        it = g_trace_stats.find(key);
+      }
+      if (it == g_trace_stats.end()) {
+        SqlTraceStat stat{};
+        stat.fingerprint = key;
+        stat.text = key != 0 ? _text : "(other)";
+        it = g_trace_stats.emplace(key, std::move(stat)).first;
+      }
+    }
+
+    SqlTraceStat& stat = it->second;
+    stat.calls++;
+    if (_failed)
+      stat.errors++;
+    stat.rows += _rows;
+    stat.total_us += total_us;
+    stat.max_us = std::max(stat.max_us, total_us);
+    stat.checkout_us += _checkout_us;
+    stat.exec_us += exec_us;
+    stat.first_row_us += first_row_us;
+    stat.drain_us += drain_us;
+
+    int64_t threshold = g_trace_options.slow_threshold.count();
+    if (threshold > 0 && total_us >= threshold) {
+      slow = true;
+    } else if (g_trace_options.sample_rate > 0.0) {
+      thread_local std::minstd_rand rng{std::random_device{}()};
+      std::uniform_real_distribution<double> dist(0.0, 1.0);
+      if (dist(rng) < g_trace_options.sample_rate)
+        sampled = true;
+    }
+  }
+
+  if (!slow && !sampled)
+    return;
+
+  const char *event = slow ? "slow_query" : "query_sample";
+  sql_log_event(slow ? SQL_LOG_INFO : SQL_LOG_DEBUG, event, server.c_str(), database.c_str(), total_us, _rows,
+      "SqlTrace > %s %lld us (checkout %lld, exec %lld, first row %lld, "
+      "drain %lld, attempts %d%s) %016llx: %s", event,
+      static_cast<long long>(total_us), static_cast<long long>(_checkout_us),
+      static_cast<long long>(exec_us), static_cast<long long>(first_row_us),
+      static_cast<long long>(drain_us), _attempts, _failed ? ", failed" : "",
+      static_cast<unsigned long long>(_fingerprint), _text);
+}
+
+}
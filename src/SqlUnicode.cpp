@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2012-2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "SqlUnicode.h"
+
+namespace tds {
+
+static inline uint16_t load_unit(const unsigned char *p)
+{
+  return static_cast<uint16_t>(p[0] | (p[1] << 8));
+}
+
+int sql_utf16_to_utf8(const unsigned char *src, size_t src_len, char *dst,
+    size_t dst_size)
+{
+  size_t units = src_len / 2;
+  size_t i = 0;
+  size_t out = 0;
+
+  while (i < units) {
+#if defined(__SSE2__)
+    // Fast path, 8 ASCII code units become 8 bytes. x86 is little endian
+    // like the data, so the units load as is.
+    while (i + 8 <= units && out + 8 <= dst_size) {
+      __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i * 2));
+      __m128i high = _mm_and_si128(v, _mm_set1_epi16(static_cast<short>(0xFF80)));
+      if (_mm_movemask_epi8(_mm_cmpeq_epi16(high, _mm_setzero_si128())) != 0xFFFF)
+        break;
+      _mm_storel_epi64(reinterpret_cast<__m128i *>(dst + out),
+          _mm_packus_epi16(v, v));
+      i += 8;
+      out += 8;
+    }
+    if (i >= units)
+      break;
+#endif
+
+    uint32_t cp = load_unit(src + i * 2);
+    i++;
+    if (cp >= 0xD800 && cp <= 0xDFFF) {
+      uint32_t low = i < units ? load_unit(src + i * 2) : 0;
+      if (cp <= 0xDBFF && low >= 0xDC00 && low <= 0xDFFF) {
+        cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+        i++;
+      } else {
+        cp = 0xFFFD;
+      }
+    }
+
+    if (cp < 0x80) {
+      if (out + 1 > dst_size)
+        return -1;
+      dst[out++] = static_cast<char>(cp);
+    } else if (cp < 0x800) {
+      if (out + 2 > dst_size)
+        return -1;
+      dst[out++] = static_cast<char>(0xC0 | (cp >> 6));
+      dst[out++] = static_cast<char>(0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+      if (out + 3 > dst_size)
+        return -1;
+      dst[out++] = static_cast<char>(0xE0 | (cp >> 12));
+      dst[out++] = static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+      dst[out++] = static_cast<char>(0x80 | (cp & 0x3F));
+    } else {
+      if (out + 4 > dst_size)
+        return -1;
+      dst[out++] = static_cast<char>(0xF0 | (cp >> 18));
+      dst[out++] = static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+      dst[out++] = static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+      dst[out++] = static_cast<char>(0x80 | (cp & 0x3F));
+    }
+  }
+  return static_cast<int>(out);
+}
+
+} // namespace tds
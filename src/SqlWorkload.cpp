@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2012-2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <algorithm>
+
+#include "SqlWorkload.h"
+
+namespace tds {
+
+SqlWorkloadGate::SqlWorkloadGate(const SqlWorkloadOptions& options) :
+  _options{options}
+{
+}
+
+// Whether cls could take a connection right now, ignoring other waiters.
+bool SqlWorkloadGate::admissible(int cls) const
+{
+  if (_in_use[cls] >= _options.cap[cls])
+    return false;
+
+  // Connections other classes have reserved but aren't using yet.
+  int held_back = 0;
+  for (int other = 0; other < sql_priority_count; other++) {
+    if (other != cls)
+      held_back += std::max(0, _options.reserved[other] - _in_use[other]);
+  }
+  return _total < _options.max_connections - held_back;
+}
+
+// Admissible and not jumping ahead of a waiting class of higher priority
+// that could run instead.
+bool SqlWorkloadGate::runnable(int cls) const
+{
+  if (!admissible(cls))
+    return false;
+  for (int higher = 0; higher < cls; higher++) {
+    if (_waiting[higher] > 0 && admissible(higher))
+      return false;
+  }
+  return true;
+}
+
+bool SqlWorkloadGate::Acquire(SqlPriority priority)
+{
+  int cls = static_cast<int>(priority);
+
+  std::unique_lock<std::mutex> locker(_mutex);
+  if (!runnable(cls)) {
+    _waiting[cls]++;
+    bool ok = _cond[cls].wait_for(locker, _options.max_wait,
+        [&] { return runnable(cls); });
+    _waiting[cls]--;
+    if (!ok) {
+      // Lower classes may have been held back for us.
+      for (auto& cond : _cond)
+        cond.notify_all();
+      return false;
+    }
+  }
+
+  _in_use[cls]++;
+  _total++;
+
+  // Several slots may have come free while we waited, or the wakeup meant
+  // for us may have gone to a waiter that then found no room. Pass it on.
+  wake();
+  return true;
+}
+
+void SqlWorkloadGate::Release(SqlPriority priority)
+{
+  int cls = static_cast<int>(priority);
+
+  std::lock_guard<std::mutex> locker(_mutex);
+  _in_use[cls]--;
+  _total--;
+  wake();
+}
+
+// Wakes one waiter of the highest priority class that can now run, the
+// others keep waiting their turn. Called with the mutex held.
+void SqlWorkloadGate::wake()
+{
+  for (int waiter = 0; waiter < sql_priority_count; waiter++) {
+    if (_waiting[waiter] > 0 && admissible(waiter)) {
+      _cond[waiter].notify_one();
+      return;
+    }
+  }
+}
+
+int SqlWorkloadGate::InUse(SqlPriority priority)
+{
+  std::lock_guard<std::mutex> locker(_mutex);
+  return _in_use[static_cast<int>(priority)];
+}
+
+}
@@ -0,0 +1,247 @@
+/*
+ * Copyright (c) 2012-2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <algorithm>
+
+#include "SqlLog.h"
+#include "SqlWriteBehind.h"
+
+namespace tds {
+
+static void append_name(std::string& args, const char *name)
+{
+  if (!args.empty())
+    args += ", ";
+  args += name;
+  args += " = ";
+}
+
+SqlWrite& SqlWrite::AddInt(const char *name, int ival)
+{
+  append_name(_args, name);
+  _args += std::to_string(ival);
+  return *this;
+}
+
+SqlWrite& SqlWrite::AddString(const char *name, const std::string& str)
+{
+  append_name(_args, name);
+  _args += sql_quote_literal(str);
+  return *this;
+}
+
+SqlWrite& SqlWrite::AddBool(const char *name, bool bval)
+{
+  append_name(_args, name);
+  _args += bval ? '1' : '0';
+  return *this;
+}
+
+SqlWrite& SqlWrite::AddNull(const char *name)
+{
+  append_name(_args, name);
+  _args += "NULL";
+  return *this;
+}
+
+SqlWrite& SqlWrite::OnDone(std::function<void(const SqlStatus&)> done)
+{
+  _done = std::move(done);
+  return *this;
+}
+
+void SqlWrite::append_exec(std::string& sql) const
+{
+  sql += "EXEC ";
+  sql += _proc;
+  if (!_args.empty()) {
+    sql += ' ';
+    sql += _args;
+  }
+  sql += ";\n";
+}
+
+SqlWriteBehind::SqlWriteBehind(const std::string& user,
+    const std::string& pass, const std::string& server,
+    const std::string& database, const SqlWriteBehindOptions& options) :
+  _user{user}, _pass{pass}, _server{server}, _database{database},
+  _options{options}, _queue{options.capacity}
+{
+  if (_options.max_batch == 0)
+    _options.max_batch = 1;
+
+  for (int i = 0; i < std::max(_options.flushers, 1); i++)
+    _threads.emplace_back(&SqlWriteBehind::flusher, this);
+}
+
+SqlWriteBehind::~SqlWriteBehind()
+{
+  Stop();
+}
+
+bool SqlWriteBehind::TryEnqueue(SqlWrite&& write)
+{
+  // Announce ourselves before looking at _stopping, Stop waits for us to
+  // finish so that nothing lands in the queue after the flushers are done.
+  _enqueuing.fetch_add(1);
+  bool queued = !_stopping.load() && _queue.TryPush(std::move(write));
+  if (queued)
+    _enqueued.fetch_add(1, std::memory_order_release);
+  _enqueuing.fetch_sub(1, std::memory_order_release);
+  return queued;
+}
+
+bool SqlWriteBehind::Enqueue(SqlWrite&& write)
+{
+  while (!TryEnqueue(std::move(write))) {
+    if (_stopping.load(std::memory_order_relaxed))
+      return false;
+
+    // Full, wait for a flusher to make some room.
+    std::unique_lock<std::mutex> locker(_mutex);
+    _progress.wait_for(locker, std::chrono::milliseconds(1));
+  }
+  return true;
+}
+
+void SqlWriteBehind::Flush()
+{
+  uint64_t target = _enqueued.load(std::memory_order_acquire);
+
+  std::unique_lock<std::mutex> locker(_mutex);
+  _flush_target = std::max(_flush_target, target);
+  _wake.notify_all();
+  _progress.wait(locker, [&] {
+    return _written.load(std::memory_order_acquire) >= target;
+  });
+}
+
+void SqlWriteBehind::Stop()
+{
+  _stopping.store(true);
+
+  // Let enqueues that got past the check finish, everything accepted is
+  // then in the queue before the flushers are told to wind down.
+  while (_enqueuing.load(std::memory_order_acquire) != 0)
+    std::this_thread::yield();
+
+  {
+    std::lock_guard<std::mutex> locker(_mutex);
+    _closed.store(true);
+    _wake.notify_all();
+  }
+
+  for (auto& thread : _threads)
+    thread.join();
+  _threads.clear();
+}
+
+void SqlWriteBehind::flusher()
+{
+  SqlClient client(_user, _pass, _server, _database);
+  client.SetRetryPolicy(_options.retry);
+
+  std::vector<SqlWrite> batch;
+  batch.reserve(_options.max_batch);
+
+  auto fill = [&]() {
+    SqlWrite write;
+    while (batch.size() < _options.max_batch && _queue.TryPop(write))
+      batch.push_back(std::move(write));
+  };
+
+  for (;;) {
+    fill();
+
+    // Give a partial batch time to fill up, unless someone is waiting on
+    // it.
+    if (batch.size() < _options.max_batch) {
+      std::unique_lock<std::mutex> locker(_mutex);
+      _wake.wait_for(locker, _options.flush_interval, [&] {
+        return _closed.load() || (_flush_target >
+            _written.load(std::memory_order_acquire) && _queue.Size() > 0);
+      });
+      locker.unlock();
+      fill();
+    }
+
+    if (batch.empty()) {
+      if (_closed.load())
+        return;
+      continue;
+    }
+
+    write_batch(client, batch);
+    batch.clear();
+  }
+}
+
+// Runs body with XACT_ABORT on, so any error rolls all of it back. SET
+// options made inside EXEC () revert when it returns, the pooled
+// connection goes back to the next user as it was, even if body fails.
+static std::string xact_abort(const std::string& body)
+{
+  return "EXEC (" + sql_quote_literal("SET XACT_ABORT ON;\n" + body) + ");";
+}
+
+void SqlWriteBehind::write_batch(SqlClient& client, std::vector<SqlWrite>& batch)
+{
+  // The whole batch either committed or it didn't.
+  std::string body = "BEGIN TRANSACTION;\n";
+  for (const auto& write : batch)
+    write.append_exec(body);
+  body += "COMMIT TRANSACTION;";
+
+  std::string sql = xact_abort(body);
+  SqlStatus status = client.TryExecDML(sql.c_str());
+  if (!status) {
+    sql_log_event(SQL_LOG_ERROR, "write_behind_failed", _server.c_str(),
+        _database.c_str(), -1, static_cast<int64_t>(batch.size()),
+        "SqlWriteBehind > Batch of %zu writes failed: %s", batch.size(),
+        status.Error().text);
+  }
+
+  // A write the server rejected took the rest of the batch down with it.
+  // Nothing was committed, so send them one at a time to find out which
+  // ones actually fail.
+  bool singly = !status && batch.size() > 1 &&
+    !sql_error_is_transient(status.Error().kind);
+
+  for (auto& write : batch) {
+    if (singly) {
+      body.clear();
+      write.append_exec(body);
+      sql = xact_abort(body);
+      status = client.TryExecDML(sql.c_str());
+    }
+
+    if (!write._done)
+      continue;
+    try {
+      write._done(status);
+    } catch (const std::exception& e) {
+      sql_log_event(SQL_LOG_ERROR, "write_behind_callback", _server.c_str(),
+          _database.c_str(), -1, -1, "SqlWriteBehind > Callback threw: %s",
+          e.what());
+    }
+  }
+
+  std::lock_guard<std::mutex> locker(_mutex);
+  _written.fetch_add(batch.size(), std::memory_order_release);
+  _progress.notify_all();
+}
+
+}
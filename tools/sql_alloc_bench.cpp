@@ -0,0 +1,171 @@
+/*
+ * Copyright (c) 2012-2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+// sql_alloc_bench: counts heap allocations per query when reading results
+// with the plain std::string calls versus the std::pmr overloads backed by
+// a per-query arena.
+//
+// Usage: sql_alloc_bench -S server [-D database] [-U user] [-P pass]
+//            [-n iterations] query
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory_resource>
+#include <new>
+#include <unistd.h>
+
+#include "SqlClient.h"
+#include "SqlConnection.h"
+#include "SqlConnectionFactory.h"
+
+using namespace tds;
+
+static std::atomic<uint64_t> g_allocs{0};
+
+void *operator new(size_t size)
+{
+  g_allocs.fetch_add(1, std::memory_order_relaxed);
+  if (void *p = malloc(size != 0 ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{
+  free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+  free(p);
+}
+
+struct BenchOptions {
+  std::string server;
+  std::string database;
+  std::string user;
+  std::string pass;
+  int iterations = 1000;
+  const char *query = nullptr;
+};
+
+static size_t run_heap(const BenchOptions& opts)
+{
+  SqlClient client(opts.user, opts.pass, opts.server, opts.database);
+  client.ExecSql(opts.query);
+
+  size_t bytes = 0;
+  std::vector<std::string> names = client.GetAllColumnNames();
+  while (client.NextRow()) {
+    for (size_t i = 0; i < names.size(); i++)
+      bytes += client.GetStringCol(static_cast<int>(i)).size();
+  }
+  return bytes;
+}
+
+static size_t run_arena(const BenchOptions& opts)
+{
+  // Everything the query allocates goes here and is freed in one go.
+  char buf[65536];
+  std::pmr::monotonic_buffer_resource arena(buf, sizeof(buf));
+
+  SqlClient client(opts.user, opts.pass, opts.server, opts.database);
+  client.ExecSql(opts.query);
+
+  size_t bytes = 0;
+  auto names = client.GetAllColumnNames(&arena);
+  while (client.NextRow()) {
+    for (size_t i = 0; i < names.size(); i++)
+      bytes += client.GetStringCol(static_cast<int>(i), &arena).size();
+  }
+  return bytes;
+}
+
+static void bench(const char *label, const BenchOptions& opts,
+    size_t (*run)(const BenchOptions&))
+{
+  run(opts); // Warm up the pool
+
+  uint64_t before = g_allocs.load();
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < opts.iterations; i++)
+    run(opts);
+  double elapsed = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+  uint64_t allocs = g_allocs.load() - before;
+
+  printf("%-6s %10.1f allocations/query %10.1f us/query\n", label,
+      static_cast<double>(allocs) / opts.iterations,
+      elapsed * 1e6 / opts.iterations);
+}
+
+static void usage()
+{
+  fprintf(stderr, "Usage: sql_alloc_bench -S server [-D database] [-U user] "
+      "[-P pass] [-n iterations] query\n");
+  exit(2);
+}
+
+static void log_stderr(int level, const char *msg)
+{
+  fprintf(stderr, "%s\n", msg);
+}
+
+int main(int argc, char *argv[])
+{
+  BenchOptions opts;
+  int opt;
+  while ((opt = getopt(argc, argv, "S:D:U:P:n:")) != -1) {
+    switch (opt) {
+    case 'S':
+      opts.server = optarg;
+      break;
+    case 'D':
+      opts.database = optarg;
+      break;
+    case 'U':
+      opts.user = optarg;
+      break;
+    case 'P':
+      opts.pass = optarg;
+      break;
+    case 'n':
+      opts.iterations = atoi(optarg);
+      break;
+    default:
+      usage();
+    }
+  }
+  if (opts.server.empty() || opts.iterations <= 0 || optind + 1 != argc)
+    usage();
+  opts.query = argv[optind];
+
+  sql_startup(log_stderr);
+  SqlConnectionFactory::instance().set_thread_cache_size(1);
+
+  try {
+    bench("heap", opts, run_heap);
+    bench("arena", opts, run_arena);
+  } catch (const std::exception& e) {
+    fprintf(stderr, "sql_alloc_bench: %s\n", e.what());
+    return 1;
+  }
+
+  sql_shutdown();
+  return 0;
+}
@@ -0,0 +1,204 @@
+/*
+ * Copyright (c) 2012-2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+// sql_poold: holds one connection pool on behalf of every process on the
+// host that talks to it, see SqlProxy.h.
+//
+// Usage: sql_poold [-c slots] socket_path
+
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "SqlClient.h"
+#include "SqlConnection.h"
+#include "SqlConnectionFactory.h"
+#include "SqlDataSource.h"
+#include "SqlProxy.h"
+
+using namespace tds;
+
+static void log_stderr(int level, const char *msg)
+{
+  fprintf(stderr, "%s\n", msg);
+}
+
+static SqlStatus general_error(const char *what)
+{
+  SqlError error;
+  error.kind = SqlErrorKind::General;
+  snprintf(error.message, sizeof(error.message), "%s", what);
+  snprintf(error.text, sizeof(error.text), "sql_poold > %s", what);
+  return SqlStatus(error);
+}
+
+static SqlStatus run(const SqlProxyRequest& req, int *results)
+{
+  // A pooled connection is only held for the length of the call. Each set
+  // of credentials gets its own bucket, a caller never gets a session
+  // that was opened with someone else's login.
+  SqlClient client(SqlDataSource::Get(req.user, req.pass, req.server,
+        req.database));
+  client.SetTimeout(std::chrono::milliseconds(req.timeout_ms));
+
+  std::vector<db_param> params = req.ToParams();
+  const char *text = req.text.c_str();
+
+  SqlStatus status;
+  bool rows = false;
+  switch (req.op) {
+  case SqlProxyOp::ExecSql:
+    status = client.TryExecSql(text);
+    rows = true;
+    break;
+  case SqlProxyOp::ExecDML:
+    status = client.TryExecDML(text);
+    break;
+  case SqlProxyOp::ExecStoredProc:
+    status = client.TryExecStoredProc(text, params);
+    rows = true;
+    break;
+  case SqlProxyOp::ExecNonQuery:
+    status = client.TryExecNonQuery(text, params);
+    break;
+  }
+
+  if (status && rows)
+    *results = sql_proxy_write_results(client);
+  return status;
+}
+
+// Only the daemon's own user (and root) may use its sessions. The socket
+// is created 0600 already, this also covers a path in a shared directory
+// that someone loosened afterwards.
+static bool trusted_peer(int sock)
+{
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1)
+    return false;
+  return cred.uid == 0 || cred.uid == getuid();
+}
+
+static void serve(int sock)
+{
+  if (!trusted_peer(sock)) {
+    fprintf(stderr, "sql_poold: rejected connection from another user\n");
+    close(sock);
+    return;
+  }
+
+  SqlProxyRequest req;
+  while (sql_proxy_read_request(sock, &req)) {
+    int results = -1;
+    SqlStatus status;
+    try {
+      status = run(req, &results);
+    } catch (const SqlException& e) {
+      status = SqlStatus(e.Error());
+    } catch (const std::exception& e) {
+      status = general_error(e.what());
+    }
+
+    bool sent = sql_proxy_send_response(sock, status, results);
+    if (results != -1)
+      close(results);
+    if (!sent)
+      break;
+  }
+  close(sock);
+}
+
+static void usage()
+{
+  fprintf(stderr, "Usage: sql_poold [-c slots] socket_path\n");
+  exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+  int opt;
+  int cache_slots = 0;
+  while ((opt = getopt(argc, argv, "c:")) != -1) {
+    switch (opt) {
+    case 'c':
+      cache_slots = atoi(optarg);
+      break;
+    default:
+      usage();
+    }
+  }
+  if (optind + 1 != argc)
+    usage();
+
+  const char *path = argv[optind];
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "sql_poold: socket path too long\n");
+    return 1;
+  }
+  strcpy(addr.sun_path, path);
+
+  signal(SIGPIPE, SIG_IGN);
+  sql_startup(log_stderr);
+
+  // Connection threads come and go with their clients, only worth caching
+  // for when clients hold their socket open.
+  SqlConnectionFactory::instance().set_thread_cache_size(cache_slots);
+
+  int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listener == -1) {
+    perror("sql_poold: socket");
+    return 1;
+  }
+
+  // Create the socket 0600 from the start, chmod after bind would leave a
+  // window where anyone could connect.
+  unlink(path);
+  mode_t old_mask = umask(0177);
+  int bound = bind(listener, reinterpret_cast<struct sockaddr *>(&addr),
+      sizeof(addr));
+  umask(old_mask);
+  if (bound == -1 || listen(listener, 128) == -1) {
+    perror("sql_poold: bind");
+    return 1;
+  }
+
+  for (;;) {
+    int sock = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+    if (sock == -1) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      perror("sql_poold: accept");
+      break;
+    }
+    std::thread(serve, sock).detach();
+  }
+
+  close(listener);
+  sql_shutdown();
+  return 1;
+}
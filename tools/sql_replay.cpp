@@ -0,0 +1,310 @@
+/*
+ * Copyright (c) 2012-2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+// sql_replay: drives the library with a log written by sql_capture_start,
+// keeping each recorded thread's calls on a thread of their own and
+// starting every call at its recorded offset. Point it at a stand-in
+// server with -S to benchmark pool and fetch changes against a real
+// workload's shape. -S is required, logs hold writes and are never
+// replayed against the server they name unless asked to. -D defaults to
+// each call's recorded database.
+//
+// Usage: sql_replay -S server [-D database] [-U user] [-P pass]
+//            [-x speed] capture_file
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <thread>
+#include <unistd.h>
+
+#include "SqlCapture.h"
+#include "SqlClient.h"
+#include "SqlConnection.h"
+
+using namespace tds;
+
+struct ReplayOptions {
+  const char *server = nullptr;
+  const char *database = nullptr;
+  std::string user;
+  std::string pass;
+  double speed = 1.0; // 0 runs every call back to back
+};
+
+struct ReplayStats {
+  std::vector<int64_t> latency_us;
+  uint64_t errors = 0;
+  uint64_t mismatches = 0; // Result shape differs from the recording
+  int64_t max_lag_us = 0;  // Worst late start
+};
+
+static void log_stderr(int level, const char *msg)
+{
+  fprintf(stderr, "%s\n", msg);
+}
+
+static std::vector<db_param> to_params(const SqlCaptureRecord& rec)
+{
+  std::vector<db_param> params;
+  for (const auto& param : rec.params) {
+    db_param p;
+    p.name = param.name.c_str();
+    p.type = param.type;
+    p.ivalue = param.ivalue;
+    if (param.is_null) {
+      p.pvalue = nullptr;
+      p.datalen = 0;
+    } else if (param.type == ParamType::String) {
+      p.pvalue = param.svalue.data();
+      p.datalen = static_cast<int>(param.svalue.size());
+    } else {
+      p.pvalue = nullptr;
+      p.datalen = param.type == ParamType::Bit ? 1 : -1;
+    }
+    params.push_back(p);
+  }
+  return params;
+}
+
+// Runs one call and reads all its results. Returns the shapes seen.
+static SqlStatus replay_call(SqlClient& client, const SqlCaptureRecord& rec,
+    std::vector<SqlCaptureShape> *shapes)
+{
+  std::vector<db_param> params = to_params(rec);
+  const char *text = rec.text.c_str();
+
+  SqlStatus status;
+  bool rows = false;
+  switch (rec.op) {
+  case SqlCaptureOp::ExecSql:
+    status = client.TryExecSql(text);
+    rows = true;
+    break;
+  case SqlCaptureOp::ExecDML:
+    status = client.TryExecDML(text);
+    break;
+  case SqlCaptureOp::ExecStoredProc:
+    status = client.TryExecStoredProc(text, params);
+    rows = true;
+    break;
+  case SqlCaptureOp::ExecNonQuery:
+    status = client.TryExecNonQuery(text, params);
+    break;
+  }
+
+  shapes->clear();
+  if (!status || !rows)
+    return status;
+
+  bool more = true;
+  while (more) {
+    SqlCaptureShape shape{static_cast<uint32_t>(client.GetColumnCount()), 0,
+      true};
+    bool has_row;
+    while ((status = client.TryNextRow(&has_row)) && has_row)
+      shape.rows++;
+    if (!status)
+      return status;
+    shapes->push_back(shape);
+
+    if (!(status = client.TryNextResult(&more)))
+      return status;
+  }
+  return status;
+}
+
+// Replay reads every row of every result set, the original caller may
+// have stopped early. Only what it actually saw to the end must match.
+static bool same_shapes(const std::vector<SqlCaptureShape>& replayed,
+    const SqlCaptureRecord& rec)
+{
+  const std::vector<SqlCaptureShape>& recorded = rec.shapes;
+  if (rec.complete ? replayed.size() != recorded.size() :
+      replayed.size() < recorded.size()) {
+    return false;
+  }
+
+  for (size_t i = 0; i < recorded.size(); i++) {
+    if (replayed[i].columns != recorded[i].columns)
+      return false;
+    if (recorded[i].exact ? replayed[i].rows != recorded[i].rows :
+        replayed[i].rows < recorded[i].rows) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void replay_thread(const ReplayOptions& opts,
+    const std::vector<const SqlCaptureRecord *>& calls,
+    std::chrono::steady_clock::time_point start, ReplayStats *stats)
+{
+  std::vector<SqlCaptureShape> shapes;
+  for (const SqlCaptureRecord *rec : calls) {
+    auto due = start;
+    if (opts.speed > 0) {
+      due += std::chrono::microseconds(
+          static_cast<int64_t>(rec->start_us / opts.speed));
+      std::this_thread::sleep_until(due);
+    }
+
+    auto begin = std::chrono::steady_clock::now();
+    if (opts.speed > 0) {
+      stats->max_lag_us = std::max<int64_t>(stats->max_lag_us,
+          std::chrono::duration_cast<std::chrono::microseconds>(
+            begin - due).count());
+    }
+
+    // A client per call, as the pool sees it in most applications.
+    SqlClient client(opts.user, opts.pass, opts.server,
+        opts.database != nullptr ? opts.database : rec->database);
+
+    SqlStatus status;
+    try {
+      status = replay_call(client, *rec, &shapes);
+    } catch (const SqlException& e) {
+      status = SqlStatus(e.Error());
+    }
+    client.Release();
+
+    stats->latency_us.push_back(
+        std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - begin).count());
+    if (!status) {
+      stats->errors++;
+    } else if (rec->ok && !same_shapes(shapes, *rec)) {
+      stats->mismatches++;
+    }
+  }
+}
+
+static double percentile_ms(const std::vector<int64_t>& sorted, double p)
+{
+  if (sorted.empty())
+    return 0.0;
+  size_t i = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+  return sorted[i] / 1000.0;
+}
+
+static void print_latency(const char *label, std::vector<int64_t>& us)
+{
+  std::sort(us.begin(), us.end());
+  printf("%-9s p50 %.3f ms  p90 %.3f ms  p99 %.3f ms  p99.9 %.3f ms  "
+      "max %.3f ms\n", label, percentile_ms(us, 0.5), percentile_ms(us, 0.9),
+      percentile_ms(us, 0.99), percentile_ms(us, 0.999),
+      percentile_ms(us, 1.0));
+}
+
+static void usage()
+{
+  fprintf(stderr, "Usage: sql_replay -S server [-D database] [-U user] "
+      "[-P pass] [-x speed] capture_file\n");
+  exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+  ReplayOptions opts;
+  int opt;
+  while ((opt = getopt(argc, argv, "S:D:U:P:x:")) != -1) {
+    switch (opt) {
+    case 'S':
+      opts.server = optarg;
+      break;
+    case 'D':
+      opts.database = optarg;
+      break;
+    case 'U':
+      opts.user = optarg;
+      break;
+    case 'P':
+      opts.pass = optarg;
+      break;
+    case 'x':
+      opts.speed = atof(optarg);
+      break;
+    default:
+      usage();
+    }
+  }
+  if (opts.server == nullptr || optind + 1 != argc)
+    usage();
+
+  SqlCaptureReader reader(argv[optind]);
+  if (!reader.Ok()) {
+    fprintf(stderr, "sql_replay: %s is not a capture log\n", argv[optind]);
+    return 1;
+  }
+
+  std::vector<SqlCaptureRecord> records;
+  SqlCaptureRecord rec;
+  while (reader.Next(&rec))
+    records.push_back(rec);
+
+  // Records are written as calls finish, replay them in start order.
+  std::map<uint32_t, std::vector<const SqlCaptureRecord *>> threads;
+  std::vector<int64_t> recorded_us;
+  for (const auto& r : records) {
+    threads[r.thread].push_back(&r);
+    recorded_us.push_back(r.total_us);
+  }
+  for (auto& entry : threads) {
+    std::sort(entry.second.begin(), entry.second.end(),
+        [](const SqlCaptureRecord *a, const SqlCaptureRecord *b) {
+          return a->start_us < b->start_us;
+        });
+  }
+
+  sql_startup(log_stderr);
+
+  std::vector<ReplayStats> stats(threads.size());
+  std::vector<std::thread> workers;
+  auto start = std::chrono::steady_clock::now();
+  size_t i = 0;
+  for (const auto& entry : threads) {
+    workers.emplace_back(replay_thread, std::cref(opts),
+        std::cref(entry.second), start, &stats[i++]);
+  }
+  for (auto& worker : workers)
+    worker.join();
+  double elapsed = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+
+  ReplayStats total;
+  for (const auto& s : stats) {
+    total.latency_us.insert(total.latency_us.end(), s.latency_us.begin(),
+        s.latency_us.end());
+    total.errors += s.errors;
+    total.mismatches += s.mismatches;
+    total.max_lag_us = std::max(total.max_lag_us, s.max_lag_us);
+  }
+
+  printf("calls     %zu on %zu threads in %.3f s (%.1f calls/s)\n",
+      total.latency_us.size(), threads.size(), elapsed,
+      elapsed > 0 ? total.latency_us.size() / elapsed : 0.0);
+  printf("errors    %" PRIu64 ", result shape mismatches %" PRIu64 "\n",
+      total.errors, total.mismatches);
+  if (opts.speed > 0)
+    printf("max lag   %.3f ms behind schedule\n", total.max_lag_us / 1000.0);
+  print_latency("replayed", total.latency_us);
+  print_latency("recorded", recorded_us);
+
+  sql_shutdown();
+  return total.errors > 0 ? 1 : 0;
+}
@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2012-2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+// sql_utf16_bench: measures sql_utf16_to_utf8 on synthetic text and,
+// given a server, compares reading wide NVARCHAR result sets through
+// FreeTDS's charset conversion with reading them as raw UTF-16.
+//
+// Usage: sql_utf16_bench [-S server] [-D database] [-U user] [-P pass]
+//            [-n iterations] [text_query binary_query]
+//
+// binary_query should select the same columns as text_query, each cast to
+// VARBINARY(MAX).
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "SqlClient.h"
+#include "SqlConnection.h"
+#include "SqlUnicode.h"
+
+using namespace tds;
+
+struct BenchOptions {
+  std::string server;
+  std::string database;
+  std::string user;
+  std::string pass;
+  int iterations = 100;
+};
+
+// UTF-16LE bytes of text mixing ASCII with some two and three byte
+// characters, roughly what NVARCHAR columns of names and addresses hold.
+static std::string sample_utf16(size_t units, bool ascii)
+{
+  static const uint16_t mixed[] = {0xE9, 0xFC, 0x4E2D, 0x6587, 0x3042};
+  std::string bytes;
+  bytes.reserve(units * 2);
+  for (size_t i = 0; i < units; i++) {
+    uint16_t unit = 'a' + i % 26;
+    if (!ascii && i % 16 == 15)
+      unit = mixed[(i / 16) % 5];
+    bytes += static_cast<char>(unit & 0xFF);
+    bytes += static_cast<char>(unit >> 8);
+  }
+  return bytes;
+}
+
+static void bench_transcoder(const char *label, const std::string& src,
+    int iterations)
+{
+  std::vector<char> dst(src.size() * 3 / 2 + 16);
+  size_t total = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations * 1000; i++) {
+    total += sql_utf16_to_utf8(reinterpret_cast<const unsigned char *>(src.data()),
+        src.size(), dst.data(), dst.size());
+  }
+  double elapsed = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+
+  printf("%-16s %8.1f MB/s of UTF-16 (%zu bytes out)\n", label,
+      src.size() * 1000.0 * iterations / elapsed / 1e6, total);
+}
+
+// Reads every column of every row, into buf with GetUtf8Col or into
+// strings with GetStringCol.
+static double bench_query(const BenchOptions& opts, const char *query,
+    bool utf8_col, size_t *bytes)
+{
+  std::vector<char> buf(1 << 20);
+  *bytes = 0;
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < opts.iterations; i++) {
+    SqlClient client(opts.user, opts.pass, opts.server, opts.database);
+    client.ExecSql(query);
+    int cols = client.GetColumnCount();
+    while (client.NextRow()) {
+      for (int col = 0; col < cols; col++) {
+        if (utf8_col) {
+          int n = client.GetUtf8Col(col, buf.data(), static_cast<int>(buf.size()));
+          *bytes += n > 0 ? n : 0;
+        } else {
+          *bytes += client.GetStringCol(col).size();
+        }
+      }
+    }
+  }
+  return std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count() / opts.iterations;
+}
+
+static void usage()
+{
+  fprintf(stderr, "Usage: sql_utf16_bench [-S server] [-D database] "
+      "[-U user] [-P pass] [-n iterations] [text_query binary_query]\n");
+  exit(2);
+}
+
+static void log_stderr(int level, const char *msg)
+{
+  fprintf(stderr, "%s\n", msg);
+}
+
+int main(int argc, char *argv[])
+{
+  BenchOptions opts;
+  int opt;
+  while ((opt = getopt(argc, argv, "S:D:U:P:n:")) != -1) {
+    switch (opt) {
+    case 'S':
+      opts.server = optarg;
+      break;
+    case 'D':
+      opts.database = optarg;
+      break;
+    case 'U':
+      opts.user = optarg;
+      break;
+    case 'P':
+      opts.pass = optarg;
+      break;
+    case 'n':
+      opts.iterations = atoi(optarg);
+      break;
+    default:
+      usage();
+    }
+  }
+  if (opts.iterations <= 0 || (optind != argc && optind + 2 != argc) ||
+      (opts.server.empty() != (optind == argc))) {
+    usage();
+  }
+
+  bench_transcoder("ascii 4000", sample_utf16(4000, true), opts.iterations);
+  bench_transcoder("mixed 4000", sample_utf16(4000, false), opts.iterations);
+  bench_transcoder("ascii 40", sample_utf16(40, true), opts.iterations);
+
+  if (opts.server.empty())
+    return 0;
+
+  sql_startup(log_stderr);
+  try {
+    size_t text_bytes, binary_bytes;
+    double text = bench_query(opts, argv[optind], false, &text_bytes);
+    double binary = bench_query(opts, argv[optind + 1], true, &binary_bytes);
+    printf("charset path     %8.3f ms/query (%zu bytes)\n", text * 1e3,
+        text_bytes / opts.iterations);
+    printf("raw UTF-16 path  %8.3f ms/query (%zu bytes)\n", binary * 1e3,
+        binary_bytes / opts.iterations);
+  } catch (const std::exception& e) {
+    fprintf(stderr, "sql_utf16_bench: %s\n", e.what());
+    return 1;
+  }
+  sql_shutdown();
+  return 0;
+}